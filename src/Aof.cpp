@@ -0,0 +1,430 @@
+#include "Aof.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Command.h"
+#include "Database.h"
+#include "Persistence.h"
+#include "Resp.h"
+
+enum Fsync_policy
+{
+    Fsync_always,
+    Fsync_everysec,
+    Fsync_no
+};
+
+constexpr auto fsync_interval = std::chrono::seconds(1);
+// the writer's buffer is let go of once a burst that grew it past this is written
+constexpr size_t max_idle_buffer = 16 * 1024 * 1024;
+
+std::atomic<bool> aof_on = false;
+Fsync_policy fsync_policy = Fsync_everysec;
+int aof_fd = -1;
+
+struct Waiter
+{
+    size_t offset;
+    std::function<void()> done;
+};
+
+std::mutex aof_lock;
+std::condition_variable appended_to;
+// what the reactors appended since the writer last took it, and the file's size once it's written
+std::string pending_writes;
+size_t appended = 0;
+// the file's size as far as it was written (and, with always, fsynced)
+size_t synced_size = 0;
+std::vector<Waiter> waiters;
+bool last_write_ok = true;
+size_t fsyncs = 0;
+
+std::string aof_path()
+{
+    const std::string dir = get_config("dir");
+    const std::string name = get_config("appendfilename");
+    return (dir.empty() ? "." : dir) + "/" + name;
+}
+
+// false when a write failed; what it wrote of data is then taken back off the file's end
+bool write_all(const std::string_view data, const size_t file_size)
+{
+    for (std::string_view rest = data; !rest.empty();)
+    {
+        const ssize_t n = write(aof_fd, rest.data(), rest.size());
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            std::cerr << "Error writing to the AOF file: " << std::strerror(n < 0 ? errno : ENOSPC) << "\n";
+            if (ftruncate(aof_fd, static_cast<off_t>(file_size)) != 0)
+            {
+                std::cerr << "Could not remove a partial write from the AOF file\n";
+            }
+            return false;
+        }
+        rest.remove_prefix(n);
+    }
+    return true;
+}
+
+// a write that failed is retried with what was appended since; with always, the clients waiting for it
+// can't be answered, so the server stops as Redis does
+void write_aof()
+{
+    std::string writing;
+    size_t file_size = synced_size;
+    bool unsynced_writes = false;
+    auto last_fsync = std::chrono::steady_clock::now();
+    std::vector<Waiter> ready;
+    std::unique_lock lock(aof_lock);
+    while (true)
+    {
+        // everysec wakes up for an fsync that's due even when nothing more comes
+        appended_to.wait_for(lock, fsync_interval, [] { return !pending_writes.empty(); });
+        if (writing.empty())
+        {
+            std::swap(pending_writes, writing);
+        }
+        else
+        {
+            writing += pending_writes;
+            pending_writes.clear();
+        }
+        const size_t end = appended;
+        lock.unlock();
+
+        bool ok = write_all(writing, file_size);
+        unsynced_writes |= ok && !writing.empty();
+        const auto now = std::chrono::steady_clock::now();
+        bool fsynced = false;
+        if (ok && unsynced_writes &&
+            (fsync_policy == Fsync_always || (fsync_policy == Fsync_everysec && now - last_fsync >= fsync_interval)))
+        {
+            ok = fdatasync(aof_fd) == 0;
+            if (!ok)
+            {
+                std::cerr << "Error syncing the AOF file: " << std::strerror(errno) << "\n";
+            }
+            fsynced = ok;
+            unsynced_writes = !ok;
+            last_fsync = now;
+        }
+        if (!ok && fsync_policy == Fsync_always)
+        {
+            std::cerr << "Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...\n";
+            std::_Exit(1);
+        }
+        if (ok)
+        {
+            file_size = end;
+            writing.clear();
+            if (writing.capacity() > max_idle_buffer)
+            {
+                writing = std::string();
+            }
+        }
+        else
+        {
+            // a full disk isn't retried in a loop
+            std::this_thread::sleep_for(fsync_interval);
+        }
+
+        lock.lock();
+        last_write_ok = ok;
+        fsyncs += fsynced;
+        if (ok)
+        {
+            synced_size = end;
+            for (Waiter& waiter : waiters)
+            {
+                if (waiter.offset <= end)
+                {
+                    ready.push_back(std::move(waiter));
+                }
+            }
+            std::erase_if(waiters, [end](const Waiter& waiter) { return waiter.offset <= end; });
+        }
+        if (!ready.empty())
+        {
+            lock.unlock();
+            for (const Waiter& waiter : ready)
+            {
+                waiter.done();
+            }
+            ready.clear();
+            lock.lock();
+        }
+    }
+}
+
+// runs a command read back from the file as a connection would, on the shards it's routed to. Blocking
+// commands were written once they had their element, or had timed out, so they don't wait here
+void replay(const Request cmd, Rel_data& data, std::string& reply)
+{
+    Resp_writer out(reply);
+    const auto run = [&](const Request request)
+    {
+        process_command(request, data, out);
+        if (data.blocked)
+        {
+            if (!data.blocked->poll(false, out))
+            {
+                data.blocked->poll(true, out);
+            }
+            data.blocked.reset();
+        }
+    };
+    switch (const Route route = route_command(cmd, data); route.type)
+    {
+    case Single_shard:
+        {
+            const Shard_guard guard(route.shard);
+            run(cmd);
+            return;
+        }
+    case All_shards:
+        for (size_t shard = 0; shard < shard_count(); shard++)
+        {
+            const Shard_guard guard(shard);
+            run(cmd);
+        }
+        return;
+    case Each_queued:
+        data.queue_commands = false;
+        while (!data.transaction_queue.empty())
+        {
+            const Owned_request queued = std::move(data.transaction_queue.front());
+            data.transaction_queue.pop();
+            replay(queued.request(), data, reply);
+        }
+        return;
+    case Split_keys:
+        {
+            const Key_split split = split_keys(cmd);
+            for (size_t i = 0; i < split.requests.size(); i++)
+            {
+                const Shard_guard guard(split.shards[i]);
+                run(split.requests[i]);
+            }
+            return;
+        }
+    case Cross_shard:
+        return;
+    case Anywhere:
+        run(cmd);
+    }
+}
+
+bool load_aof()
+{
+    if (get_config("appendonly") != "yes")
+    {
+        return false;
+    }
+    const std::string path = aof_path();
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const auto started = std::chrono::steady_clock::now();
+    struct stat st{};
+    const size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    void* map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        std::cerr << "Unable to read the append only file\n";
+        std::exit(1);
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const std::string_view file(static_cast<const char*>(map), size);
+    size_t at = 0;
+    if (file.starts_with("REDIS"))
+    {
+        at = read_rdb_preamble(file);
+        if (at == 0)
+        {
+            std::cerr << "Bad file format reading the append only file\n";
+            std::exit(1);
+        }
+    }
+    // the arguments point into the mapped file
+    Request_parser parser;
+    std::vector<std::string_view> args;
+    Rel_data data;
+    // commands from the file, like a master's, are let through over maxmemory
+    data.is_replica = true;
+    std::string reply;
+    size_t commands = 0;
+    Request_parser::Status status = Request_parser::Complete;
+    while (at < size)
+    {
+        size_t consumed;
+        status = parser.parse(file.substr(at), args, consumed);
+        if (status != Request_parser::Complete)
+        {
+            break;
+        }
+        at += consumed;
+        if (!args.empty())
+        {
+            reply.clear();
+            replay(args, data, reply);
+            commands++;
+        }
+    }
+    if (map)
+    {
+        munmap(map, size);
+    }
+    if (status == Request_parser::Protocol_error)
+    {
+        std::cerr << "Bad file format reading the append only file\n";
+        std::exit(1);
+    }
+    if (at < size)
+    {
+        std::cerr << "Truncating the append only file: its last " << size - at << " bytes are a partial command\n";
+        if (truncate(path.c_str(), static_cast<off_t>(at)) != 0)
+        {
+            std::cerr << "Unable to truncate the append only file\n";
+            std::exit(1);
+        }
+    }
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - started;
+    std::cout << "DB loaded from append only file: " << key_count() << " keys, " << commands << " commands in "
+        << took.count() << " seconds\n";
+    return true;
+}
+
+// the keyspace as the file's preamble, in a temporary file that's renamed over the old one once it's on
+// disk. An empty keyspace makes an empty file
+bool write_aof_base(const std::string& path)
+{
+    const std::string temp = path.substr(0, path.rfind('/') + 1) + "temp-rewriteaof-" + std::to_string(getpid()) +
+        ".aof";
+    const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const bool written = (key_count() == 0 || write_rdb_preamble(fd)) && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void start_aof(const bool rewrite)
+{
+    if (get_config("appendonly") != "yes" || aof_on)
+    {
+        return;
+    }
+    const std::string fsync_setting = get_config("appendfsync");
+    fsync_policy = fsync_setting == "always" ? Fsync_always : fsync_setting == "no" ? Fsync_no : Fsync_everysec;
+    if (fsync_policy == Fsync_everysec && fsync_setting != "everysec")
+    {
+        std::cerr << "Unknown appendfsync " << fsync_setting << ", using everysec\n";
+    }
+
+    const std::string path = aof_path();
+    struct stat st{};
+    if ((rewrite || stat(path.c_str(), &st) != 0) && !write_aof_base(path))
+    {
+        std::cerr << "Can't create the append only file " << path << ": " << std::strerror(errno) << "\n";
+        std::exit(1);
+    }
+    aof_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (aof_fd < 0 || fstat(aof_fd, &st) != 0)
+    {
+        std::cerr << "Can't open the append only file " << path << ": " << std::strerror(errno) << "\n";
+        std::exit(1);
+    }
+    appended = synced_size = st.st_size;
+    aof_on = true;
+    std::thread(write_aof).detach();
+}
+
+bool aof_enabled()
+{
+    return aof_on.load(std::memory_order_relaxed);
+}
+
+size_t append_aof(const Request cmd, const std::string_view frame)
+{
+    if (!aof_on.load(std::memory_order_relaxed))
+    {
+        return 0;
+    }
+    const std::string rewritten = absolute_expiry(cmd);
+    const std::string_view command = rewritten.empty() ? frame : rewritten;
+    bool was_empty;
+    size_t end;
+    {
+        const std::lock_guard lock(aof_lock);
+        was_empty = pending_writes.empty();
+        pending_writes += command;
+        appended += command.size();
+        end = appended;
+    }
+    // the writer only waits while there's nothing to write
+    if (was_empty)
+    {
+        appended_to.notify_one();
+    }
+    return end;
+}
+
+bool aof_fsync_always()
+{
+    return fsync_policy == Fsync_always;
+}
+
+bool aof_synced(const size_t offset)
+{
+    const std::lock_guard lock(aof_lock);
+    return synced_size >= offset;
+}
+
+void when_aof_synced(const size_t offset, std::function<void()> done)
+{
+    {
+        const std::lock_guard lock(aof_lock);
+        if (synced_size < offset)
+        {
+            waiters.emplace_back(offset, std::move(done));
+            return;
+        }
+    }
+    done();
+}
+
+Aof_stats aof_stats()
+{
+    const std::lock_guard lock(aof_lock);
+    return {aof_on, last_write_ok, appended, fsyncs};
+}
@@ -0,0 +1,50 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include <cstddef>
+#include <functional>
+#include <string_view>
+
+#include "Resp.h"
+
+// the append only file, dir/appendfilename when appendonly is yes: every write, in the bytes it's
+// propagated to replicas as, but for relative expiries. It may start with a snapshot of the keyspace as it was when the file was
+// made (Redis's RDB preamble), the commands since follow
+
+// replays the file into the keyspace, before the reactors run; false when appendonly is no or there's
+// no file yet, and the snapshot is loaded instead. A command cut short at the end (as by a crash in
+// the middle of a write) is truncated away
+bool load_aof();
+
+// opens the file for appending and starts its writer thread, when appendonly is yes. A new file starts
+// with the keyspace loaded from the snapshot; rewrite replaces the old one the same way, for a replica
+// whose keyspace came from its master
+void start_aof(bool rewrite = false);
+
+bool aof_enabled();
+
+// the reactors append to one buffer while the writer thread writes out the other, and fsyncs it as
+// appendfsync says: after every write (always), about once a second (everysec), or never (no). frame is
+// the command's encoding, appended unless its expiry has to be made absolute (see absolute_expiry). The
+// offset in the file of the command's end, 0 when there's no AOF
+size_t append_aof(Request cmd, std::string_view frame);
+
+// with appendfsync always, a write is only answered once it's on disk. done is called on the writer
+// thread when everything up to offset is, after the fsync that covers all the commands appended while
+// the one before it ran (a group commit), or right away when it already is
+bool aof_fsync_always();
+bool aof_synced(size_t offset);
+void when_aof_synced(size_t offset, std::function<void()> done);
+
+// what INFO persistence reports
+struct Aof_stats
+{
+    bool enabled = false;
+    bool last_write_ok = true;
+    size_t size = 0;
+    size_t fsyncs = 0;
+};
+
+Aof_stats aof_stats();
+
+#endif //AOF_H
@@ -10,7 +10,20 @@ const std::unordered_set<std::string> simple_args = {
     "--dir",
     "--dbfilename",
     "--port",
-    "--replicaof"
+    "--replicaof",
+    "--threads",
+    "--io-backend",
+    "--lockfree-reads",
+    "--maxmemory",
+    "--maxmemory-policy",
+    "--maxmemory-samples",
+    "--save",
+    "--repl-diskless-sync-delay",
+    "--rdbcompression",
+    "--rdb-compression-threshold",
+    "--appendonly",
+    "--appendfilename",
+    "--appendfsync"
 };
 
 bool process_args(const int argc, char** argv)
@@ -24,7 +37,7 @@ bool process_args(const int argc, char** argv)
             {
                 return false;
             }
-            config_key_vals()[arg.substr(2)] = std::string(argv[i]);
+            set_config(arg.substr(2), argv[i]);
         }
     }
     return true;
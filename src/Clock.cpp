@@ -0,0 +1,35 @@
+#include "Clock.h"
+
+struct Cached_clock
+{
+    long long unix_millis = 0;
+    std::chrono::steady_clock::time_point steady;
+};
+
+thread_local Cached_clock cached;
+
+void update_clock()
+{
+    cached.unix_millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    cached.steady = std::chrono::steady_clock::now();
+}
+
+long long unix_millis_now()
+{
+    // a thread that never picked up work (like one loading a snapshot) reads the clock the first time
+    if (cached.unix_millis == 0)
+    {
+        update_clock();
+    }
+    return cached.unix_millis;
+}
+
+std::chrono::steady_clock::time_point steady_now()
+{
+    if (cached.unix_millis == 0)
+    {
+        update_clock();
+    }
+    return cached.steady;
+}
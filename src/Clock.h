@@ -0,0 +1,16 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+
+// the time commands run at, read once for a batch of commands rather than for every key they touch:
+// each thread caches it, and refreshes it whenever it picks up work (a connection's input, a command
+// handed over from another reactor, a blocked command's poll, an expiry tick). Within a batch the time
+// stands still, as it does for a command in Redis
+void update_clock();
+// wall time, for what's defined by it: expiry times and stream IDs
+long long unix_millis_now();
+// monotonic time, for timeouts
+std::chrono::steady_clock::time_point steady_now();
+
+#endif //CLOCK_H
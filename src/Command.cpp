@@ -1,200 +1,491 @@
 #include "Command.h"
 #include "Resp.h"
+#include "Aof.h"
 #include "Database.h"
 #include "Replication.h"
 #include "Channels.h"
+#include "Clock.h"
+#include "Glob.h"
+#include "Memory.h"
+#include "Persistence.h"
 
-#include <unordered_map>
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <limits>
+#include <optional>
 #include <ranges>
-#include <thread>
+#include <span>
 
 const std::string bad_cmd = bulk_string("bad command");
 
-typedef std::string (*Cmd)(const RESP_data&, Rel_data&);
-
 void to_upper(std::string& s)
 {
     std::ranges::transform(s, s.begin(), toupper);
 }
 
-std::string ping(const RESP_data& resp, Rel_data& data)
+// compares an argument with an upper case option name
+bool is_option(const std::string_view arg, const std::string_view option)
+{
+    return std::ranges::equal(arg, option, [](const char a, const char b) { return toupper(a) == b; });
+}
+
+bool parse_integer(const std::string_view arg, long long& val)
+{
+    const auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), val);
+    return ec == std::errc() && end == arg.data() + arg.size();
+}
+
+// the largest expiry in any unit, so that one counted from now still fits in milliseconds
+constexpr long long max_expiry = std::numeric_limits<long long>::max() / 1000;
+
+// the unix time in milliseconds an expiry of n units comes to; a relative one counts from the time the
+// command runs at
+long long expiry_time(const long long n, const std::chrono::milliseconds unit, const bool absolute)
+{
+    return (absolute ? 0 : unix_millis_now()) + n * unit.count();
+}
+
+// the key's value when it holds a T; nullptr when the key doesn't exist, and when it holds another type,
+// which also sets wrong
+template <typename T>
+T* find_value(const std::string_view key, bool& wrong)
+{
+    Key_entry* entry = find_key(key);
+    wrong = entry && !entry->holds<T>();
+    return entry && !wrong ? &entry->as<T>() : nullptr;
+}
+
+void ping(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
 
     if (data.subscribed)
     {
-        return array({bulk_string("pong"), empty_bulk_string});
+        out.array_header(2);
+        out.bulk_string("pong");
+        return out.raw(empty_bulk_string);
     }
 
-    if (resp.array.size() > 1)
+    if (resp.size() > 1)
     {
-        return bulk_string(resp.array[1].string);
+        return out.bulk_string(resp[1]);
     }
 
-    return simple_string("PONG");
+    out.simple_string("PONG");
 }
 
-std::string echo(const RESP_data& resp, Rel_data& data)
+void echo(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    return bulk_string(resp.array[1].string);
+    out.bulk_string(resp[1]);
 }
 
-std::string set(const RESP_data& resp, Rel_data& data)
+void set(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    data.repeat = true;
-    key_vals()[resp.array[1].string] = resp.array[2].string;
-    if (key_expiry().contains(resp.array[1].string))
+    // EX and PX count from now, EXAT and PXAT are unix times
+    const bool seconds = resp.size() > 4 && (is_option(resp[3], "EX") || is_option(resp[3], "EXAT"));
+    const bool millis = resp.size() > 4 && (is_option(resp[3], "PX") || is_option(resp[3], "PXAT"));
+    long long when = 0;
+    if (seconds || millis)
     {
-        key_expiry().erase(resp.array[1].string);
+        const std::chrono::milliseconds unit = seconds ? std::chrono::seconds(1) : std::chrono::milliseconds(1);
+        long long n;
+        if (!parse_integer(resp[4], n) || n <= 0 || n > max_expiry / unit.count())
+        {
+            return out.error("ERR invalid expire time in 'set' command");
+        }
+        when = expiry_time(n, unit, is_option(resp[3], "EXAT") || is_option(resp[3], "PXAT"));
     }
 
-    if (resp.array.size() > 4)
+    data.repeat = true;
+    bool inserted;
+    Key_entry& entry = upsert_key(resp[1], inserted);
+    entry.set_string(resp[2]);
+    if (when)
     {
-        std::string mod = resp.array[3].string;
-        to_upper(mod);
-        if (mod == "PX")
-        {
-            key_expiry()[resp.array[1].string] = std::chrono::system_clock::now() + std::chrono::milliseconds(
-            std::stoi(resp.array[4].string));
-        }
+        set_expiry(resp[1], entry, when);
+    }
+    else
+    {
+        clear_expiry(resp[1], entry);
     }
 
-    return OK_simple;
+    out.raw(OK_simple);
 }
 
-bool is_active(const std::string& key)
+void get(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (!key_expiry().contains(key))
+    data.repeat = false;
+    if (resp.size() < 2)
+    {
+        return out.raw(bad_cmd);
+    }
+
+    if (lockfree_reads())
+    {
+        if (!write_published_string(resp[1], out))
+        {
+            out.raw(null_bulk_string);
+        }
+        return;
+    }
+    const Key_entry* entry = find_key(resp[1]);
+    if (!entry)
     {
-        return true;
+        return out.raw(null_bulk_string);
     }
-    if (key_expiry()[key] >= std::chrono::system_clock::now())
+    if (!entry->holds<std::string>())
     {
-        return true;
+        return out.raw(wrong_type);
     }
-    return false;
+    Digits digits;
+    out.bulk_string(entry->string_value(digits));
 }
 
-void remove_key(const std::string& key)
+// calls f with the argument indices of the keys (every step-th argument after the name) of one shard at
+// a time, in order, with the shard locked: a command with many keys takes each lock once
+template <typename F>
+void for_each_shard(const Request resp, const size_t step, F&& f)
 {
-    key_expiry().erase(key);
-    key_vals().erase(key);
+    std::vector<std::pair<size_t, size_t>> keys;
+    keys.reserve(resp.size() / step);
+    for (size_t i = 1; i < resp.size(); i += step)
+    {
+        keys.emplace_back(shard_of(resp[i]), i);
+    }
+    std::ranges::sort(keys);
+    std::vector<size_t> indices;
+    for (size_t begin = 0, end; begin < keys.size(); begin = end)
+    {
+        indices.clear();
+        for (end = begin; end < keys.size() && keys[end].first == keys[begin].first; end++)
+        {
+            indices.push_back(keys[end].second);
+        }
+        const Shard_guard guard(keys[begin].first);
+        f(std::span<const size_t>(indices));
+    }
 }
 
-std::string get(const RESP_data& resp, Rel_data& data)
+void mget(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    // the values are encoded a shard at a time, and put back in the order of the keys at the end
+    std::string values;
+    Resp_writer writer(values);
+    std::vector<std::pair<size_t, size_t>> spans(resp.size() - 1);
+    for_each_shard(resp, 1, [&](const std::span<const size_t> indices)
+    {
+        for (const size_t i : indices)
+        {
+            const size_t start = values.size();
+            const Key_entry* entry = find_key(resp[i]);
+            if (entry && entry->holds<std::string>())
+            {
+                Digits digits;
+                writer.bulk_string(entry->string_value(digits));
+            }
+            else
+            {
+                writer.raw(null_bulk_string);
+            }
+            spans[i - 1] = {start, values.size() - start};
+        }
+    });
+    out.array_header(spans.size());
+    for (const auto [start, size] : spans)
     {
-        return bad_cmd;
+        out.raw(std::string_view(values).substr(start, size));
     }
+}
 
-    if (key_vals().contains(resp.array[1].string))
+void set_pairs(const Request resp)
+{
+    for_each_shard(resp, 2, [resp](const std::span<const size_t> indices)
     {
-        if (is_active(resp.array[1].string))
+        for (const size_t i : indices)
         {
-            return bulk_string(key_vals()[resp.array[1].string]);
+            bool inserted;
+            Key_entry& entry = upsert_key(resp[i], inserted);
+            entry.set_string(resp[i + 1]);
+            clear_expiry(resp[i], entry);
         }
-        remove_key(resp.array[1].string);
+    });
+}
+
+void mset(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    if (resp.size() % 2 == 0)
+    {
+        data.repeat = false;
+        return out.error("ERR wrong number of arguments for 'mset' command");
+    }
+
+    data.repeat = true;
+    set_pairs(resp);
+    out.raw(OK_simple);
+}
+
+// the keys all have to be on one reactor, so that none can be created between the check and the sets
+void msetnx(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    if (resp.size() % 2 == 0)
+    {
+        return out.error("ERR wrong number of arguments for 'msetnx' command");
     }
-    return null_bulk_string;
+
+    bool exists = false;
+    for_each_shard(resp, 2, [&](const std::span<const size_t> indices)
+    {
+        exists = exists || std::ranges::any_of(indices, [resp](const size_t i) { return find_key(resp[i]); });
+    });
+    if (exists)
+    {
+        return out.integer(0);
+    }
+    data.repeat = true;
+    set_pairs(resp);
+    out.integer(1);
 }
 
-std::string config_get(const RESP_data& resp, Rel_data& data)
+void config_get(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    std::vector<std::string> ret;
-    for (size_t i = 2; i < resp.array.size(); i++)
+    out.array_header(2 * (resp.size() - 2));
+    for (size_t i = 2; i < resp.size(); i++)
     {
-        ret.push_back(bulk_string(resp.array[i].string));
-        if (config_key_vals().contains(resp.array[i].string))
+        out.bulk_string(resp[i]);
+        if (has_config(resp[i]))
         {
-            ret.push_back(bulk_string(config_key_vals()[resp.array[i].string]));
+            out.bulk_string(get_config(resp[i]));
             continue;
         }
-        ret.push_back(null_bulk_string);
+        out.raw(null_bulk_string);
     }
-    return array(ret);
 }
 
-const std::unordered_map<std::string, Cmd> config_cmd_map = {
-    {"GET", config_get}
+constexpr Command_spec config_subcommands[] = {
+    {"GET", config_get, -3, Cmd_admin}
 };
 
-std::string config(const RESP_data& resp, Rel_data& data)
+// subcommand tables are tiny, a linear scan beats hashing
+const Command_spec* find_subcommand(const std::span<const Command_spec> table, const std::string_view name)
+{
+    const auto it = std::ranges::find_if(table, [name](const Command_spec& spec) { return is_option(name, spec.name); });
+    return it == table.end() ? nullptr : &*it;
+}
+
+void config(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    std::string cmd = resp.array[1].string;
-    to_upper(cmd);
-    if (!config_cmd_map.contains(cmd))
+    const Command_spec* spec = find_subcommand(config_subcommands, resp[1]);
+    if (!spec)
     {
         // temp value
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
-    return config_cmd_map.at(cmd)(resp, data);
+    spec->handler(resp, data, out);
 }
 
-std::string keys(const RESP_data& resp, Rel_data& data)
+void keys(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    if (resp.array[1].string != "*")
+    const Glob pattern(resp[1]);
+    std::vector<std::string> expired_keys;
+    const long long now = unix_millis_now();
+    for (const Key_table::Node& node : entries())
+    {
+        if (node.value.has_expiry() && node.value.expiry_ms() < now)
+        {
+            expired_keys.emplace_back(node.key());
+        }
+    }
+    for (const auto& key : expired_keys)
+    {
+        expire_key(key);
+    }
+    if (pattern.matches_all())
+    {
+        out.array_header(entries().size());
+        for (const Key_table::Node& node : entries())
+        {
+            out.bulk_string(node.key());
+        }
+        return;
+    }
+    std::vector<std::string_view> matched;
+    for (const Key_table::Node& node : entries())
+    {
+        if (pattern.matches(node.key()))
+        {
+            matched.push_back(node.key());
+        }
+    }
+    out.array_header(matched.size());
+    for (const std::string_view key : matched)
     {
-        return bulk_string("Filtering not supported yet :)");
+        out.bulk_string(key);
     }
+}
 
-    std::vector<std::string> ret;
-    std::vector<std::string> expired_keys;
-    for (const auto& key : key_vals() | std::views::keys)
+// SCAN's cursor has the shard in its low bits and the cursor of the shard's table above them: a call
+// scans one shard, on the shard's reactor, and the cursor moves on to the next shard once it's done
+bool parse_cursor(const std::string_view arg, unsigned long long& cursor)
+{
+    const auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), cursor);
+    return ec == std::errc() && end == arg.data() + arg.size();
+}
+
+size_t cursor_shard(const unsigned long long cursor)
+{
+    return cursor & (shard_count() - 1);
+}
+
+struct Scan_options
+{
+    std::optional<Glob> match;
+    long long count = 10;
+    // lower case, empty for any type
+    std::string type;
+};
+
+// MATCH, COUNT and (for SCAN) TYPE, from the argument at first on; false once the error is written
+bool parse_scan_options(const Request resp, const size_t first, const bool with_type, Scan_options& options,
+                        Resp_writer& out)
+{
+    for (size_t i = first; i < resp.size(); i += 2)
     {
-        if (is_active(key))
+        if (i + 1 == resp.size())
+        {
+            out.error("ERR syntax error");
+            return false;
+        }
+        if (is_option(resp[i], "MATCH"))
+        {
+            options.match.emplace(resp[i + 1]);
+        }
+        else if (is_option(resp[i], "COUNT"))
+        {
+            if (!parse_integer(resp[i + 1], options.count))
+            {
+                out.error("ERR value is not an integer or out of range");
+                return false;
+            }
+            if (options.count < 1)
+            {
+                out.error("ERR syntax error");
+                return false;
+            }
+        }
+        else if (with_type && is_option(resp[i], "TYPE"))
         {
-            ret.push_back(bulk_string(key));
+            options.type = resp[i + 1];
+            std::ranges::transform(options.type, options.type.begin(), tolower);
         }
         else
         {
-            expired_keys.push_back(key);
+            out.error("ERR syntax error");
+            return false;
         }
     }
-    for (const auto& key : expired_keys)
+    return true;
+}
+
+// a step goes on until it has count elements, or has gone through ten times that many groups of slots
+// without finding them, so a sparse or filtered scan still returns quickly
+template <typename Table, typename T, typename F>
+size_t scan_steps(const Table& table, size_t cursor, const Scan_options& options, const std::vector<T>& found, F&& f)
+{
+    for (long long steps = 0; steps < options.count * 10; steps++)
     {
-        remove_key(key);
+        cursor = table.scan(cursor, f);
+        if (cursor == 0 || found.size() >= static_cast<size_t>(options.count))
+        {
+            break;
+        }
     }
-    return array(ret);
+    return cursor;
 }
 
-std::string info(const RESP_data& resp, Rel_data& data)
+void scan(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    std::string str;
-    if (resp.array.size() > 1)
+    unsigned long long cursor;
+    if (!parse_cursor(resp[1], cursor))
+    {
+        return out.error("ERR invalid cursor");
+    }
+    Scan_options options;
+    if (!parse_scan_options(resp, 2, true, options, out))
+    {
+        return;
+    }
+
+    const size_t shard = cursor_shard(cursor);
+    const int shard_bits = std::countr_zero(shard_count());
+    std::vector<std::string_view> keys;
+    std::vector<std::string> expired_keys;
+    const long long now = unix_millis_now();
+    size_t next = scan_steps(entries(), cursor >> shard_bits, options, keys, [&](const Key_table::Node& node)
     {
-        if (resp.array[1].string != "replication")
+        if (node.value.has_expiry() && node.value.expiry_ms() < now)
+        {
+            expired_keys.emplace_back(node.key());
+        }
+        else if ((options.type.empty() || node.value.type_name() == options.type) &&
+            (!options.match || options.match->matches(node.key())))
         {
-            return bulk_string("Filtering not supported yet :)\n");
+            keys.push_back(node.key());
         }
+    });
+    // the other keys' elements don't move as these are removed
+    for (const auto& key : expired_keys)
+    {
+        expire_key(key);
+    }
+
+    if (next != 0)
+    {
+        next = next << shard_bits | shard;
+    }
+    else if (shard + 1 < shard_count())
+    {
+        next = shard + 1;
+    }
+    out.array_header(2);
+    out.bulk_string(std::to_string(next));
+    out.array_header(keys.size());
+    for (const std::string_view key : keys)
+    {
+        out.bulk_string(key);
     }
+}
 
+void info_replication(std::string& str)
+{
     str += "# Replication\n";
 
     if (is_slave())
@@ -207,145 +498,423 @@ std::string info(const RESP_data& resp, Rel_data& data)
     }
     str += "master_replid:" + master_replid + "\n";
     str += "master_repl_offset:" + std::to_string(master_repl_offset()) + "\n";
+}
+
+// as Redis prints sizes: 1.50M
+std::string human_bytes(const size_t bytes)
+{
+    constexpr std::string_view units = "BKMGTP";
+    double size = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (size >= 1024 && unit < units.size() - 1)
+    {
+        size /= 1024;
+        unit++;
+    }
+    if (unit == 0)
+    {
+        return std::to_string(bytes) + "B";
+    }
+    return std::format("{:.2f}", size) + units[unit];
+}
+
+// what INFO memory and MEMORY STATS report, the overhead is everything that isn't keys and values:
+// connection buffers, the replication queue, published keys and what the server starts with
+struct Memory_stats
+{
+    size_t used = used_memory();
+    size_t peak = peak_memory();
+    size_t startup = startup_memory();
+    size_t rss = rss_memory();
+    size_t dataset = std::min(dataset_memory(), used);
+    size_t overhead = used - dataset;
+    size_t keys = key_count();
+
+    double fragmentation() const
+    {
+        return used ? static_cast<double>(rss) / static_cast<double>(used) : 0;
+    }
+
+    double dataset_percentage() const
+    {
+        return used > startup ? 100.0 * static_cast<double>(dataset) / static_cast<double>(used - startup) : 0;
+    }
+};
+
+void info_memory(std::string& str)
+{
+    const Memory_stats stats;
+    str += "# Memory\n";
+    str += "used_memory:" + std::to_string(stats.used) + "\n";
+    str += "used_memory_human:" + human_bytes(stats.used) + "\n";
+    str += "used_memory_rss:" + std::to_string(stats.rss) + "\n";
+    str += "used_memory_rss_human:" + human_bytes(stats.rss) + "\n";
+    str += "used_memory_peak:" + std::to_string(stats.peak) + "\n";
+    str += "used_memory_peak_human:" + human_bytes(stats.peak) + "\n";
+    str += std::format("used_memory_peak_perc:{:.2f}%\n", stats.peak ? 100.0 * stats.used / stats.peak : 0);
+    str += "used_memory_overhead:" + std::to_string(stats.overhead) + "\n";
+    str += "used_memory_startup:" + std::to_string(stats.startup) + "\n";
+    str += "used_memory_dataset:" + std::to_string(stats.dataset) + "\n";
+    str += std::format("used_memory_dataset_perc:{:.2f}%\n", stats.dataset_percentage());
+    str += std::format("mem_fragmentation_ratio:{:.2f}\n", stats.fragmentation());
+    str += "mem_fragmentation_bytes:" + std::to_string(static_cast<long long>(stats.rss - stats.used)) + "\n";
+    str += "maxmemory:" + std::to_string(memory_limit()) + "\n";
+    str += "maxmemory_human:" + human_bytes(memory_limit()) + "\n";
+    str += "maxmemory_policy:" + get_config("maxmemory-policy") + "\n";
+}
 
-    return bulk_string(str);
+void info_persistence(std::string& str)
+{
+    const Save_stats stats = save_stats();
+    str += "# Persistence\n";
+    str += "loading:0\n";
+    str += "rdb_changes_since_last_save:" + std::to_string(stats.changes) + "\n";
+    str += "rdb_bgsave_in_progress:" + std::to_string(stats.bgsave_in_progress) + "\n";
+    str += "rdb_last_save_time:" + std::to_string(stats.last_save_time) + "\n";
+    str += std::string("rdb_last_bgsave_status:") + (stats.last_bgsave_ok ? "ok" : "err") + "\n";
+    str += "rdb_last_bgsave_time_sec:" + std::to_string(stats.last_bgsave_seconds) + "\n";
+    str += "rdb_current_bgsave_time_sec:" + std::to_string(stats.current_bgsave_seconds) + "\n";
+    str += "rdb_saves:" + std::to_string(stats.saves) + "\n";
+    str += "rdb_last_cow_size:" + std::to_string(stats.last_cow_bytes) + "\n";
+    const Aof_stats aof = aof_stats();
+    str += "aof_enabled:" + std::to_string(aof.enabled) + "\n";
+    str += std::string("aof_last_write_status:") + (aof.last_write_ok ? "ok" : "err") + "\n";
+    if (aof.enabled)
+    {
+        str += "aof_current_size:" + std::to_string(aof.size) + "\n";
+        str += "aof_fsyncs:" + std::to_string(aof.fsyncs) + "\n";
+    }
 }
 
-std::string replconf_getack(const RESP_data& resp, Rel_data& data)
+void info_stats(std::string& str)
 {
-    return command({"REPLCONF", "ACK", std::to_string(master_repl_offset())});
+    str += "# Stats\n";
+    str += "expired_keys:" + std::to_string(expired_keys()) + "\n";
+    str += "expired_keys_per_sec:" + std::to_string(expired_keys_per_sec()) + "\n";
+    str += "evicted_keys:" + std::to_string(evicted_keys()) + "\n";
 }
 
-std::string replconf_ack(const RESP_data& resp, Rel_data& data)
+// INFO without arguments lists every section; section names are upper case for is_option
+constexpr std::pair<std::string_view, void (*)(std::string&)> info_sections[] = {
+    {"MEMORY", info_memory},
+    {"PERSISTENCE", info_persistence},
+    {"STATS", info_stats},
+    {"REPLICATION", info_replication}
+};
+
+void info(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    std::string str;
+    for (const auto& [name, section] : info_sections)
+    {
+        if (resp.size() > 1 && !std::ranges::any_of(resp.subspan(1), [&](const std::string_view arg)
+        {
+            return is_option(arg, name);
+        }))
+        {
+            continue;
+        }
+        if (!str.empty())
+        {
+            str += "\n";
+        }
+        section(str);
+    }
+    out.bulk_string(str);
+}
+
+void save_db(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    switch (save())
+    {
+    case Save_ok:
+        return out.raw(OK_simple);
+    case Save_in_progress:
+        return out.error("ERR Background save already in progress");
+    default:
+        return out.error("ERR");
+    }
+}
+
+void bgsave(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    switch (start_bgsave())
+    {
+    case Save_ok:
+        return out.simple_string("Background saving started");
+    case Save_in_progress:
+        return out.error("ERR Background save already in progress");
+    default:
+        return out.error("ERR");
+    }
+}
+
+void replconf_getack(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    out.array_header(3);
+    out.bulk_string("REPLCONF");
+    out.bulk_string("ACK");
+    out.bulk_string(std::to_string(master_repl_offset()));
+}
+
+void replconf_ack(const Request resp, Rel_data& data, Resp_writer& out)
 {
     replica_acked();
-    return OK_simple;
+    out.raw(OK_simple);
+}
+
+// REPLCONF capa <capability> [capa <capability> ...]: eof means the replica takes a snapshot streamed
+// without its length
+void replconf_capa(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    for (size_t i = 1; i + 1 < resp.size(); i += 2)
+    {
+        if (is_option(resp[i], "CAPA") && is_option(resp[i + 1], "EOF"))
+        {
+            data.replica_eof = true;
+        }
+    }
+    out.raw(OK_simple);
 }
 
-const std::unordered_map<std::string, Cmd> replconf_cmd_map = {
-    {"GETACK", replconf_getack},
-    {"ACK", replconf_ack}
+constexpr Command_spec replconf_subcommands[] = {
+    {"GETACK", replconf_getack, 3, Cmd_admin},
+    {"ACK", replconf_ack, 3, Cmd_admin},
+    {"CAPA", replconf_capa, -3, Cmd_admin}
 };
 
-std::string replconf(const RESP_data& resp, Rel_data& data)
+void replconf(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
     data.respond = true;
-    std::string cmd = resp.array[1].string;
-    to_upper(cmd);
-    if (!replconf_cmd_map.contains(cmd))
+    const Command_spec* spec = find_subcommand(replconf_subcommands, resp[1]);
+    if (!spec)
     {
-        return OK_simple;
+        return out.raw(OK_simple);
     }
-    return replconf_cmd_map.at(cmd)(resp, data);
+    spec->handler(resp, data, out);
 }
 
-std::string psync(const RESP_data& resp, Rel_data& data)
+void psync(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    if (resp.array[1].string == "?" && resp.array[2].string == "-1")
+    if (resp[1] == "?" && resp[2] == "-1")
     {
         data.send_rdb = true;
         data.client_is_replica = true;
-        slave_count()++;
-        return simple_string("FULLRESYNC " + master_replid + " " + std::to_string(master_repl_offset()));
+        return out.simple_string("FULLRESYNC " + master_replid + " " + std::to_string(master_repl_offset()));
     }
 
     // temp
-    return bulk_string("not supported yet");
+    out.bulk_string("not supported yet");
 }
 
-std::string wait(const RESP_data& resp, Rel_data& data)
+void wait(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
     if (!send_getack())
     {
-        return integer(slave_count());
+        return out.integer(slave_count());
     }
     // will probably not work if multiple clients send WAITs
     send_getack() = false;
-    const long numreplicas = std::stol(resp.array[1].string);
+    const long numreplicas = std::stol(std::string(resp[1]));
     if (numreplicas <= 0)
     {
-        return integer(0);
+        return out.integer(0);
     }
-    const unsigned int timeout = std::stol(resp.array[2].string);
+    const unsigned int timeout = std::stol(std::string(resp[2]));
 
     add_command(command({"REPLCONF", "GETACK", "*"}), true, timeout);
     reset_acks();
 
-    const auto millis = std::chrono::milliseconds(timeout);
-    const auto start = std::chrono::system_clock::now();
-    while (std::chrono::system_clock::now() - start < millis)
-    {
-        if (n_acks() >= numreplicas)
+    data.blocked = Blocking{
+        [numreplicas](const bool timed_out, Resp_writer& out)
         {
-            break;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
-    return integer(n_acks());
+            if (n_acks() >= numreplicas || timed_out)
+            {
+                out.integer(n_acks());
+                return true;
+            }
+            return false;
+        },
+        steady_now() + std::chrono::milliseconds(timeout)
+    };
 }
 
-std::string type(const RESP_data& resp, Rel_data& data)
+void type(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    if (key_vals().contains(resp.array[1].string))
+    if (lockfree_reads())
+    {
+        return out.simple_string(published_type(resp[1]));
+    }
+    const Key_entry* entry = find_key(resp[1]);
+    out.simple_string(entry ? entry->type_name() : "none");
+}
+
+// UNLINK too: values are freed as they're removed either way
+void del(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = true;
+    long long n = 0;
+    // the keys can be on different shards of this reactor
+    for_each_shard(resp, 1, [&](const std::span<const size_t> indices)
     {
-        if (is_active(resp.array[1].string))
+        for (const size_t i : indices)
         {
-            return simple_string("string");
+            n += remove_key(resp[i]);
         }
-        remove_key(resp.array[1].string);
+    });
+    out.integer(n);
+}
+
+void exists(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    long long n = 0;
+    for_each_shard(resp, 1, [&](const std::span<const size_t> indices)
+    {
+        n += std::ranges::count_if(indices, [resp](const size_t i) { return find_key(resp[i]) != nullptr; });
+    });
+    out.integer(n);
+}
+
+// EXPIRE and PEXPIRE count from now, EXPIREAT and PEXPIREAT are unix times
+void expire_in(const Request resp, Rel_data& data, Resp_writer& out, const std::chrono::milliseconds unit,
+               const bool absolute)
+{
+    long long n;
+    if (!parse_integer(resp[2], n))
+    {
+        return out.error("ERR value is not an integer or out of range");
+    }
+    if (n > max_expiry / unit.count() || n < -max_expiry / unit.count())
+    {
+        return out.error("ERR invalid expire time in '" + std::string(resp[0]) + "' command");
     }
-    if (stream_exists(resp.array[1].string))
+    Key_entry* entry = find_key(resp[1]);
+    if (!entry)
     {
-        return simple_string("stream");
+        return out.integer(0);
     }
-    return simple_string("none");
+    data.repeat = true;
+    // a time in the past deletes the key
+    const long long when = expiry_time(n, unit, absolute);
+    if (when <= unix_millis_now())
+    {
+        remove_key(resp[1]);
+        return out.integer(1);
+    }
+    set_expiry(resp[1], *entry, when);
+    out.integer(1);
+}
+
+void expire(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    expire_in(resp, data, out, std::chrono::seconds(1), false);
+}
+
+void pexpire(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    expire_in(resp, data, out, std::chrono::milliseconds(1), false);
+}
+
+void expireat(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    expire_in(resp, data, out, std::chrono::seconds(1), true);
+}
+
+void pexpireat(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    expire_in(resp, data, out, std::chrono::milliseconds(1), true);
 }
 
-std::string xadd(const RESP_data& resp, Rel_data& data)
+// -2 for keys that don't exist, -1 for keys without an expiry
+long long remaining_ms(const std::string_view key)
 {
-    if (resp.array.size() < 5)
+    const Key_entry* entry = find_key(key);
+    if (!entry)
     {
-        return bad_cmd;
+        return -2;
     }
+    if (!entry->has_expiry())
+    {
+        return -1;
+    }
+    return entry->expiry_ms() - unix_millis_now();
+}
 
-    const std::string key = resp.array[1].string;
+void ttl(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    const long long ms = remaining_ms(resp[1]);
+    out.integer(ms < 0 ? ms : (ms + 500) / 1000);
+}
+
+void pttl(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    out.integer(remaining_ms(resp[1]));
+}
+
+void persist(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    Key_entry* entry = find_key(resp[1]);
+    if (!entry || !entry->has_expiry())
+    {
+        data.repeat = false;
+        return out.integer(0);
+    }
+    data.repeat = true;
+    clear_expiry(resp[1], *entry);
+    out.integer(1);
+}
+
+void xadd(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    if (resp.size() < 5)
+    {
+        return out.raw(bad_cmd);
+    }
+
+    bool wrong;
+    Stream* stream = find_value<Stream>(resp[1], wrong);
+    if (wrong)
+    {
+        return out.raw(wrong_type);
+    }
     unsigned long ref_millis = 0;
     unsigned int ref_sequence = 0;
-    if (stream_exists(key))
+    if (stream && !stream->empty())
     {
-        if (!stream_empty(key))
-        {
-            const Stream_entry temp = stream_top(key);
-            ref_millis = temp.milliseconds_time;
-            ref_sequence = temp.sequence_number;
-        }
+        ref_millis = stream->back().milliseconds_time;
+        ref_sequence = stream->back().sequence_number;
     }
 
     Stream_entry se{};
 
-    if (const std::string id = resp.array[2].string; id == "*")
+    if (const std::string id(resp[2]); id == "*")
     {
-        se.milliseconds_time = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count();
+        se.milliseconds_time = unix_millis_now();
         if (se.milliseconds_time == ref_millis)
         {
             se.sequence_number = ref_sequence + 1;
@@ -376,34 +945,42 @@ std::string xadd(const RESP_data& resp, Rel_data& data)
 
     if (se.milliseconds_time == 0 && se.sequence_number == 0)
     {
-        return simple_error("ERR The ID specified in XADD must be greater than 0-0");
+        return out.error("ERR The ID specified in XADD must be greater than 0-0");
     }
     if (se.milliseconds_time < ref_millis || (se.sequence_number <= ref_sequence && se.milliseconds_time == ref_millis))
     {
-        return simple_error("ERR The ID specified in XADD is equal or smaller than the target stream top item");
+        return out.error("ERR The ID specified in XADD is equal or smaller than the target stream top item");
     }
 
     data.repeat = true;
     constexpr size_t start = 3;
-    const size_t n = (resp.array.size() - start) / 2;
+    const size_t n = (resp.size() - start) / 2;
     se.key_vals.reserve(n);
     for (size_t i = 0; i < n; i++)
     {
-        se.key_vals[resp.array[start + i * 2].string] = resp.array[start + i * 2 + 1].string;
+        se.key_vals.emplace(resp[start + i * 2], resp[start + i * 2 + 1]);
     }
 
-    stream_add(key, se);
+    if (!stream)
+    {
+        stream = find_or_add<Stream>(resp[1]);
+    }
+    stream->push_back(std::move(se));
 
-    return se.id_bulk();
+    stream->back().write_id(out);
 }
 
-std::string stream_range_arr(const std::string& key, const std::string& start, const std::string& end,
-                             const size_t first = 0, const bool exclude = false)
+void stream_range_arr(Resp_writer& out, const std::string& key, const std::string& start, const std::string& end,
+                      const size_t first = 0, const bool exclude = false)
 {
-    if (!stream_exists(key))
+    const Shard_guard guard(shard_of(key));
+    bool wrong;
+    const Stream* found = find_value<Stream>(key, wrong);
+    if (!found)
     {
-        return null_array;
+        return out.raw(null_array);
     }
+    const Stream& stream = *found;
 
     // needs exception handling
     size_t pos = 1;
@@ -411,72 +988,65 @@ std::string stream_range_arr(const std::string& key, const std::string& start, c
                                            ? 0
                                            : start == "$"
                                             // hacky and will segfault on bad input
-                                           ? streams[key][first - 1].milliseconds_time
+                                           ? stream[first - 1].milliseconds_time
                                            : std::stol(start, &pos);
     const unsigned int start_seq = start == "$"
-                                       ? streams[key][first - 1].sequence_number
+                                       ? stream[first - 1].sequence_number
                                        : pos < start.length()
                                        ? std::stol(start.substr(pos + 1))
                                        : 0;
     const unsigned long end_millis = end == "+" ? -1 : std::stol(end, &pos);
     const unsigned int end_seq = pos < end.length() ? std::stol(end.substr(pos + 1)) : -1;
 
-    std::vector<std::string> res;
+    auto in_range = [&](const Stream_entry& se)
     {
-        const std::lock_guard lock(streams_lock);
-
-        const std::vector<Stream_entry>& stream = streams[key];
-        for (size_t i = first; i < stream.size(); i++)
+        if (se.milliseconds_time < start_millis || se.milliseconds_time > end_millis)
         {
-            if (stream[i].milliseconds_time < start_millis || stream[i].milliseconds_time > end_millis)
-            {
-                continue;
-            }
-            if (stream[i].milliseconds_time == start_millis && (stream[i].sequence_number < start_seq || stream[i].sequence_number ==
-                start_seq && exclude) || stream[i].milliseconds_time == end_millis && stream[i].sequence_number > end_seq)
-            {
-                continue;
-            }
-            std::vector<std::string> entry_repr;
-            std::vector<std::string> data_repr;
-            for (const auto& [fst, snd] : stream[i].key_vals)
-            {
-                data_repr.push_back(bulk_string(fst));
-                data_repr.push_back(bulk_string(snd));
-            }
-            entry_repr.push_back(stream[i].id_bulk());
-            entry_repr.push_back(array(data_repr));
-            res.push_back(array(entry_repr));
+            return false;
+        }
+        return !(se.milliseconds_time == start_millis && (se.sequence_number < start_seq || se.sequence_number ==
+            start_seq && exclude) || se.milliseconds_time == end_millis && se.sequence_number > end_seq);
+    };
+
+    // the header needs the count before any entry is written
+    auto entries = stream | std::views::drop(first) | std::views::filter(in_range);
+    out.array_header(std::ranges::distance(entries));
+    for (const Stream_entry& se : entries)
+    {
+        out.array_header(2);
+        se.write_id(out);
+        out.array_header(se.key_vals.size() * 2);
+        for (const auto& [fst, snd] : se.key_vals)
+        {
+            out.bulk_string(fst);
+            out.bulk_string(snd);
         }
     }
-
-    return array(res);
 }
 
-std::string xrange(const RESP_data& resp, Rel_data& data)
+void xrange(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 4)
+    if (resp.size() < 4)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::string key = resp.array[1].string;
-
-    if (!stream_exists(key))
+    bool wrong;
+    if (!find_value<Stream>(resp[1], wrong))
     {
-        return null_array;
+        return out.raw(wrong ? wrong_type : null_array);
     }
 
-    return stream_range_arr(key, resp.array[2].string, resp.array[3].string);
+    stream_range_arr(out, std::string(resp[1]), std::string(resp[2]), std::string(resp[3]));
 }
 
-std::string xread(const RESP_data& resp, Rel_data& data)
+void xread(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 4)
+    if (resp.size() < 4)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
     std::vector<std::string> keys;
@@ -484,235 +1054,356 @@ std::string xread(const RESP_data& resp, Rel_data& data)
     unsigned int timeout = 0;
     bool do_timeout = false;
     bool load_keys = false, load_ids = false, load_timeout = false;
-    for (const auto& param : resp.array)
+    for (const std::string_view param : resp)
     {
-        std::string option = param.string;
-        to_upper(option);
         if (load_ids)
         {
-            ids.push_back(param.string);
+            ids.emplace_back(param);
         }
         // currently does not support keys starting with digits
-        else if ((isdigit(param.string[0]) || param.string == "$") && !load_timeout)
+        else if ((isdigit(param[0]) || param == "$") && !load_timeout)
         {
             load_ids = true;
-            ids.push_back(param.string);
+            ids.emplace_back(param);
         }
         else if (load_keys)
         {
-            keys.push_back(param.string);
+            keys.emplace_back(param);
         }
-        else if (option == "STREAMS")
+        else if (is_option(param, "STREAMS"))
         {
             load_keys = true;
         }
         else if (load_timeout)
         {
-            timeout = std::stol(param.string);
+            timeout = std::stol(std::string(param));
             load_timeout = false;
             do_timeout = true;
         }
-        else if (option == "BLOCK")
+        else if (is_option(param, "BLOCK"))
         {
             load_timeout = true;
         }
     }
     if (keys.size() != ids.size())
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
+    // the streams can be on different shards of this reactor, each is locked while it is read
     std::vector<size_t> firsts;
     for (const auto & key : keys)
     {
-        if (stream_exists(key))
+        const Shard_guard guard(shard_of(key));
+        bool wrong;
+        const Stream* stream = find_value<Stream>(key, wrong);
+        if (wrong)
         {
-            firsts.push_back(do_timeout ? streams[key].size() : 0);
-        }
-        else
-        {
-            firsts.push_back(0);
+            return out.raw(wrong_type);
         }
+        firsts.push_back(stream && do_timeout ? stream->size() : 0);
     }
 
-    if (do_timeout)
+    auto read_streams = [keys, ids, firsts](Resp_writer& out)
     {
-        if (timeout)
+        // streams without new entries are left out of the reply
+        auto has_entries = [&](const size_t i)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+            const Shard_guard guard(shard_of(keys[i]));
+            bool wrong;
+            const Stream* stream = find_value<Stream>(keys[i], wrong);
+            return !stream || stream->size() != firsts[i];
+        };
+        auto readable = std::views::iota(size_t{0}, keys.size()) | std::views::filter(has_entries);
+        const auto n = std::ranges::distance(readable);
+        if (n == 0)
+        {
+            return out.raw(null_bulk_string);
         }
-        else
+
+        out.array_header(n);
+        for (const size_t i : readable)
+        {
+            out.array_header(2);
+            out.bulk_string(keys[i]);
+            stream_range_arr(out, keys[i], ids[i], "+", firsts[i], true);
+        }
+    };
+
+    if (!do_timeout)
+    {
+        return read_streams(out);
+    }
+
+    data.blocked = Blocking{
+        [keys, firsts, read_streams](const bool timed_out, Resp_writer& out)
         {
-            bool wait = true;
-            while (wait)
+            if (timed_out)
             {
-                for (size_t i = 0; i < keys.size(); i++)
+                read_streams(out);
+                return true;
+            }
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                const Shard_guard guard(shard_of(keys[i]));
+                bool wrong;
+                if (const Stream* stream = find_value<Stream>(keys[i], wrong); stream && stream->size() > firsts[i])
                 {
-                    if (stream_exists(keys[i]))
-                    {
-                        if (streams[keys[i]].size() > firsts[i])
-                        {
-                            wait = false;
-                            break;
-                        }
-                    }
+                    read_streams(out);
+                    return true;
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
             }
+            return false;
         }
+    };
+    if (timeout)
+    {
+        data.blocked->deadline = steady_now() + std::chrono::milliseconds(timeout);
     }
+}
 
-    std::vector<std::string> res;
-    for (size_t i = 0; i < keys.size(); i++)
+void incr_by(const Request resp, Rel_data& data, Resp_writer& out, const long long by)
+{
+    data.repeat = false;
+    bool inserted;
+    Key_entry& entry = upsert_key(resp[1], inserted);
+    if (!entry.holds<std::string>())
     {
-        std::vector<std::string> stream_repr;
-        stream_repr.push_back(bulk_string(keys[i]));
-        if (!stream_exists(keys[i]))
-        {
-            stream_repr.push_back(null_array);
-        }
-        else
-        {
-            if (streams[keys[i]].size() == firsts[i])
-            {
-                continue;
-            }
-            stream_repr.push_back(stream_range_arr(keys[i], ids[i], "+", firsts[i], true));
-        }
-        res.push_back(array(stream_repr));
+        return out.raw(wrong_type);
+    }
+    long long value = 0;
+    if (!inserted && !entry.integer_value(value))
+    {
+        return out.error("ERR value is not an integer or out of range");
+    }
+    if (__builtin_add_overflow(value, by, &value))
+    {
+        return out.error("ERR increment or decrement would overflow");
     }
+    entry.set_integer(value);
+    publish_key(resp[1], &entry);
+    data.repeat = true;
+
+    out.integer(value);
+}
+
+void incr(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    incr_by(resp, data, out, 1);
+}
+
+void decr(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    incr_by(resp, data, out, -1);
+}
+
+void incrby(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    long long by;
+    if (!parse_integer(resp[2], by))
+    {
+        return out.error("ERR value is not an integer or out of range");
+    }
+    incr_by(resp, data, out, by);
+}
 
-    if (res.empty())
+void decrby(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    long long by;
+    if (!parse_integer(resp[2], by) || by == std::numeric_limits<long long>::min())
     {
-        return null_bulk_string;
+        return out.error("ERR value is not an integer or out of range");
     }
-    return array(res);
+    incr_by(resp, data, out, -by);
 }
 
-std::string incr(const RESP_data& resp, Rel_data& data)
+void object_encoding(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 2)
+    const Key_entry* entry = find_key(resp[2]);
+    if (!entry)
     {
-        return bad_cmd;
+        return out.raw(null_bulk_string);
     }
+    out.bulk_string(entry->encoding());
+}
 
-    data.repeat = true;
-    const std::string key = resp.array[1].string;
-    long long value = 1;
-    if (key_vals().contains(key))
+constexpr Command_spec object_subcommands[] = {
+    {"ENCODING", object_encoding, 3, Cmd_readonly, 2, 2, 1}
+};
+
+void memory_usage(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    // like Redis, containers are estimated from 5 of their elements unless told otherwise
+    long long samples = 5;
+    if (resp.size() == 5 && is_option(resp[3], "SAMPLES"))
     {
-        try
-        {
-            value = std::stoll(key_vals()[key]) + 1;
-        }
-        catch (const std::invalid_argument& e)
+        if (!parse_integer(resp[4], samples) || samples < 0)
         {
-            return simple_error("ERR value is not an integer or out of range");
-        }
-        catch (const std::out_of_range& e)
-        {
-            return simple_error("ERR value is not an integer or out of range");
+            return out.error("ERR value is not an integer or out of range");
         }
     }
-    key_vals()[key] = std::to_string(value);
-
-    return integer(value);
+    else if (resp.size() != 3)
+    {
+        return out.error("ERR syntax error");
+    }
+    const size_t bytes = key_memory(resp[2], samples);
+    if (bytes == 0)
+    {
+        return out.raw(null_bulk_string);
+    }
+    out.integer(static_cast<long long>(bytes));
 }
 
-std::string multi(const RESP_data& resp, Rel_data& data)
+void memory_stats(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    data.repeat = false;
-    data.queue_commands = true;
-    data.transaction_responses.clear();
-    return OK_simple;
+    const Memory_stats stats;
+    const std::pair<std::string_view, size_t> counts[] = {
+        {"peak.allocated", stats.peak},
+        {"total.allocated", stats.used},
+        {"startup.allocated", stats.startup},
+        {"overhead.total", stats.overhead},
+        {"keys.count", stats.keys},
+        {"keys.bytes-per-key", stats.keys ? (stats.used - std::min(stats.startup, stats.used)) / stats.keys : 0},
+        {"dataset.bytes", stats.dataset},
+        {"dataset.keyspace", used_memory(Use_keyspace)},
+        {"dataset.strings", used_memory(Use_strings)},
+        {"dataset.lists", used_memory(Use_lists)},
+        {"dataset.zsets", used_memory(Use_zsets)},
+        {"dataset.streams", used_memory(Use_streams)},
+        {"allocator.resident", stats.rss}
+    };
+    out.array_header(2 * (std::size(counts) + 3));
+    for (const auto& [name, count] : counts)
+    {
+        out.bulk_string(name);
+        out.integer(static_cast<long long>(count));
+    }
+    out.bulk_string("dataset.percentage");
+    out.bulk_string(std::format("{:.2f}", stats.dataset_percentage()));
+    out.bulk_string("peak.percentage");
+    out.bulk_string(std::format("{:.2f}", stats.peak ? 100.0 * stats.used / stats.peak : 0));
+    out.bulk_string("fragmentation");
+    out.bulk_string(std::format("{:.2f}", stats.fragmentation()));
 }
 
-std::string exec(const RESP_data& resp, Rel_data& data)
+constexpr Command_spec memory_subcommands[] = {
+    {"USAGE", memory_usage, -3, Cmd_readonly, 2, 2, 1},
+    {"STATS", memory_stats, 2, Cmd_readonly}
+};
+
+void memory(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (!data.queue_commands)
+    const Command_spec* spec = find_subcommand(memory_subcommands, resp[1]);
+    if (!spec || (spec->arity > 0 ? resp.size() != spec->arity : resp.size() < -spec->arity))
     {
-        return simple_error("ERR EXEC without MULTI");
+        return out.raw(bad_cmd);
     }
-    data.queue_commands = false;
+    spec->handler(resp, data, out);
+}
 
-    while (!data.transaction_queue.empty())
+void object(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    const Command_spec* spec = find_subcommand(object_subcommands, resp[1]);
+    if (!spec || resp.size() < 3)
     {
-        data.transaction_responses.push_back(process_command(data.transaction_queue.front(), data));
-        data.transaction_queue.pop();
+        return out.raw(bad_cmd);
     }
+    spec->handler(resp, data, out);
+}
+
+void multi(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    data.queue_commands = true;
+    out.raw(OK_simple);
+}
 
-    return array(data.transaction_responses);
+void exec(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    // the queued commands are run by the connection, on the shards owning their keys
+    data.repeat = false;
+    out.error("ERR EXEC without MULTI");
 }
 
-std::string discard(const RESP_data& resp, Rel_data& data)
+void discard(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
     if (!data.queue_commands)
     {
-        return simple_error("ERR DISCARD without MULTI");
+        return out.error("ERR DISCARD without MULTI");
     }
     data.queue_commands = false;
 
-    std::queue<RESP_data> empty_queue;
+    std::queue<Owned_request> empty_queue;
     std::swap(data.transaction_queue, empty_queue);
 
-    return OK_simple;
+    out.raw(OK_simple);
 }
 
-std::string rpush(const RESP_data& resp, Rel_data& data)
+void rpush(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    data.repeat = true;
-    const std::lock_guard lock(lists_lock);
-    std::list<std::string>& list = lists[resp.array[1].string];
-    for (int i = 2; i < resp.array.size(); i++)
+    data.repeat = false;
+    List* list = find_or_add<List>(resp[1]);
+    if (!list)
+    {
+        return out.raw(wrong_type);
+    }
+    for (int i = 2; i < resp.size(); i++)
     {
-        list.push_back(resp.array[i].string);
+        list->emplace_back(resp[i]);
     }
+    data.repeat = true;
 
-    return integer(static_cast<long>(list.size()));
+    out.integer(static_cast<long>(list->size()));
 }
 
-std::string lpush(const RESP_data& resp, Rel_data& data)
+void lpush(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    data.repeat = true;
-    const std::lock_guard lock(lists_lock);
-    std::list<std::string>& list = lists[resp.array[1].string];
-    for (int i = 2; i < resp.array.size(); i++)
+    data.repeat = false;
+    List* list = find_or_add<List>(resp[1]);
+    if (!list)
+    {
+        return out.raw(wrong_type);
+    }
+    for (int i = 2; i < resp.size(); i++)
     {
-        list.push_front(resp.array[i].string);
+        list->emplace_front(resp[i]);
     }
+    data.repeat = true;
 
-    return integer(static_cast<long>(list.size()));
+    out.integer(static_cast<long>(list->size()));
 }
 
-std::string lrange(const RESP_data& resp, Rel_data& data)
+void lrange(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 4)
+    if (resp.size() < 4)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::lock_guard lock(lists_lock);
-    if (!lists.contains(resp.array[1].string))
+    bool wrong;
+    const List* found = find_value<List>(resp[1], wrong);
+    if (!found)
     {
-        return empty_array;
+        return out.raw(wrong ? wrong_type : empty_array);
     }
-    const std::list<std::string>& list = lists[resp.array[1].string];
+    const List& list = *found;
     const long list_len = static_cast<long>(list.size());
 
-    long start = std::stoll(resp.array[2].string), end = std::stoll(resp.array[3].string);
+    long start = std::stoll(std::string(resp[2])), end = std::stoll(std::string(resp[3]));
     if (start < 0)
     {
         start += list_len;
@@ -725,87 +1416,84 @@ std::string lrange(const RESP_data& resp, Rel_data& data)
     {
         end += list_len;
     }
-    if (end > list_len)
+    if (end >= list_len)
     {
-        end = list_len;
+        end = list_len - 1;
     }
 
     if (start > end || start >= list_len || end < 0)
     {
-        return empty_array;
+        return out.raw(empty_array);
     }
 
-    std::vector<std::string> res;
-    size_t i = 0;
-    for (auto & it : list)
+    out.array_header(end - start + 1);
+    for (const auto& it : list | std::views::drop(start) | std::views::take(end - start + 1))
     {
-        if (i < start)
-        {
-            i++;
-            continue;
-        }
-        if (i > end)
-        {
-            break;
-        }
-        res.push_back(bulk_string(it));
-        i++;
+        out.bulk_string(it);
     }
-
-    return array(res);
 }
 
-std::string llen(const RESP_data& resp, Rel_data& data)
+void llen(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::lock_guard lock(lists_lock);
-    if (!lists.contains(resp.array[1].string))
+    bool wrong;
+    const List* list = find_value<List>(resp[1], wrong);
+    if (wrong)
     {
-        return integer(0);
+        return out.raw(wrong_type);
     }
-    const std::list<std::string>& list = lists[resp.array[1].string];
 
-    return integer(static_cast<long>(list.size()));
+    out.integer(list ? static_cast<long>(list->size()) : 0);
 }
 
-std::string lpop(const RESP_data& resp, Rel_data& data)
+void lpop(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    data.repeat = true;
-    const std::lock_guard lock(lists_lock);
-    if (!lists.contains(resp.array[1].string))
+    long long count = 1;
+    if (resp.size() > 2 && (!parse_integer(resp[2], count) || count < 0))
     {
-        return null_bulk_string;
+        return out.error("ERR value is out of range, must be positive");
     }
-    std::list<std::string>& list = lists[resp.array[1].string];
-    if (list.empty())
+
+    data.repeat = false;
+    bool wrong;
+    List* list = find_value<List>(resp[1], wrong);
+    if (!list)
     {
-        return null_bulk_string;
+        return out.raw(wrong ? wrong_type : null_bulk_string);
     }
 
-    if (resp.array.size() > 2)
+    if (resp.size() > 2)
     {
-        std::vector<std::string> res;
-        const size_t n = std::stoll(resp.array[2].string);
+        const size_t n = std::min(static_cast<size_t>(count), list->size());
+        out.array_header(n);
         for (size_t i = 0; i < n; i++)
         {
-            res.push_back(bulk_string(list.front()));
-            list.pop_front();
+            out.bulk_string(list->front());
+            list->pop_front();
         }
-        return array(res);
+        data.repeat = n > 0;
+    }
+    else
+    {
+        out.bulk_string(list->front());
+        list->pop_front();
+        data.repeat = true;
+    }
+    // emptied lists don't exist
+    if (list->empty())
+    {
+        remove_key(resp[1]);
     }
-    const std::string ret = list.front();
-    list.pop_front();
-    return bulk_string(ret);
 }
 
 size_t blpop_counter = 0, blpop_current = 0;
@@ -827,175 +1515,192 @@ void done()
     blpop_current++;
 }
 
-std::string blpop(const RESP_data& resp, Rel_data& data)
+void blpop(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
+    {
+        return out.raw(bad_cmd);
+    }
+
+    bool wrong;
+    find_value<List>(resp[1], wrong);
+    if (wrong)
     {
-        return bad_cmd;
+        return out.raw(wrong_type);
     }
 
     data.repeat = true;
     const size_t turn = request_pop();
-    const std::string key = resp.array[1].string;
+    const std::string key(resp[1]);
 
-    lists_lock.lock();
-    std::list<std::string>& list = lists[key];
-    lists_lock.unlock();
+    const double timeout = std::stod(std::string(resp[2]));
 
-    const double timeout = std::stod(resp.array[2].string);
-
-    const auto millis = std::chrono::milliseconds(static_cast<int>(timeout * 1000));
-    const auto start = std::chrono::system_clock::now();
-    while (timeout == 0 ? true : std::chrono::system_clock::now() - start < millis)
-    {
-        if (!is_turn(turn))
-        {
-            std::this_thread::yield();
-            continue;
-        }
-        if (list.empty())
+    // the list is looked up on every poll, it may be deleted or replaced while the command waits
+    data.blocked = Blocking{
+        [key, turn](const bool timed_out, Resp_writer& out)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            continue;
+            bool wrong_now;
+            if (List* list = find_value<List>(key, wrong_now); is_turn(turn) && list)
+            {
+                out.array_header(2);
+                out.bulk_string(key);
+                out.bulk_string(list->front());
+                list->pop_front();
+                if (list->empty())
+                {
+                    remove_key(key);
+                }
+                done();
+                return true;
+            }
+            if (timed_out)
+            {
+                done();
+                out.raw(null_bulk_string);
+                return true;
+            }
+            return false;
         }
-        const std::lock_guard lock(lists_lock);
-        const std::string ret = list.front();
-        list.pop_front();
-        done();
-        return array({bulk_string(key), bulk_string(ret)});
+    };
+    if (timeout != 0)
+    {
+        data.blocked->deadline = steady_now() + std::chrono::milliseconds(static_cast<int>(timeout * 1000));
     }
-
-    done();
-    return null_bulk_string;
 }
 
-std::string sub(const RESP_data& resp, Rel_data& data)
+void sub(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    if (!data.subscribed)
-    {
-        data.set_nonblocking = true;
-    }
     data.subscribed = true;
-    const std::string ch = bulk_string(resp.array[1].string);
+    const std::string ch = bulk_string(std::string(resp[1]));
     if (!data.subscribed_channels.contains(ch))
     {
         subscribe(ch);
         data.subscribed_channels.insert(ch);
     }
 
-    return array({
-        subscribe_bulk, ch, integer(static_cast<long>(data.subscribed_channels.size()))
-    });
+    out.array_header(3);
+    out.raw(subscribe_bulk);
+    out.raw(ch);
+    out.integer(static_cast<long>(data.subscribed_channels.size()));
 }
 
-std::string pub(const RESP_data& resp, Rel_data& data)
+void pub(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
     data.repeat = true;
-    const std::string ch = bulk_string(resp.array[1].string);
-    publish(ch, bulk_string(resp.array[2].string));
-    return integer(static_cast<long>(n_subscribers(ch)));
+    const std::string ch = bulk_string(std::string(resp[1]));
+    publish(ch, bulk_string(std::string(resp[2])));
+    out.integer(static_cast<long>(n_subscribers(ch)));
 }
 
-std::string unsub(const RESP_data& resp, Rel_data& data)
+void unsub(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bulk_string("not supported yet :)");
+        return out.bulk_string("not supported yet :)");
     }
 
-    const std::string ch = bulk_string(resp.array[1].string);
+    const std::string ch = bulk_string(std::string(resp[1]));
     if (data.subscribed_channels.contains(ch))
     {
         unsubscribe(ch);
         data.subscribed_channels.erase(ch);
     }
 
-    return array({
-        unsubscribe_bulk, ch, integer(static_cast<long>(data.subscribed_channels.size()))
-    });
+    out.array_header(3);
+    out.raw(unsubscribe_bulk);
+    out.raw(ch);
+    out.integer(static_cast<long>(data.subscribed_channels.size()));
 }
 
-std::string zadd(const RESP_data& resp, Rel_data& data)
+void zadd(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 4)
+    if (resp.size() < 4)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    data.repeat = true;
-    const std::lock_guard lock(zsets_lock);
-    auto& [set, map] = zsets[resp.array[1].string];
+    data.repeat = false;
+    Sorted_set* zset = find_or_add<Sorted_set>(resp[1]);
+    if (!zset)
+    {
+        return out.raw(wrong_type);
+    }
+    auto& [set, map] = *zset;
     int n = 0;
-    for (int i = 2; i < resp.array.size() - 1; i += 2)
+    for (int i = 2; i < resp.size() - 1; i += 2)
     {
-        const std::string key = resp.array[i + 1].string;
-        const double score = std::stod(resp.array[i].string);
-        if (map.contains(key))
+        const std::string_view member = resp[i + 1];
+        const double score = std::stod(std::string(resp[i]));
+        if (const auto [it, added] = map.try_emplace(member, score); !added)
         {
-            set.erase({map[key], key});
+            set.erase({it->value, Counted_string<Use_zsets>(member)});
+            it->value = score;
             n--;
         }
-        set.emplace(score, key);
-        map[key] = score;
+        set.emplace(score, Counted_string<Use_zsets>(member));
         n++;
     }
+    // a new score for a member already there is a change too
+    data.repeat = true;
 
-    return integer(n);
+    out.integer(n);
 }
 
-std::string zrank(const RESP_data& resp, Rel_data& data)
+void zrank(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::lock_guard lock(zsets_lock);
-    if (!zsets.contains(resp.array[1].string))
+    bool wrong;
+    Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (!zset)
     {
-        return null_bulk_string;
+        return out.raw(wrong ? wrong_type : null_bulk_string);
     }
-    auto& [set, map] = zsets[resp.array[1].string];
+    auto& [set, map] = *zset;
 
-    const std::string key = resp.array[2].string;
-    if (!map.contains(key))
+    const auto it = map.find(resp[2]);
+    if (it == map.end())
     {
-        return null_bulk_string;
+        return out.raw(null_bulk_string);
     }
-    const auto elem = set.find({map[key], key});
+    const auto elem = set.find({it->value, Counted_string<Use_zsets>(resp[2])});
     // is unfortunately linear
-    return integer(std::distance(set.begin(), elem));
+    out.integer(std::distance(set.begin(), elem));
 }
 
-std::string zrange(const RESP_data& resp, Rel_data& data)
+void zrange(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 4)
+    if (resp.size() < 4)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::lock_guard lock(zsets_lock);
-    if (!zsets.contains(resp.array[1].string))
+    bool wrong;
+    const Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (!zset)
     {
-        return empty_array;
+        return out.raw(wrong ? wrong_type : empty_array);
     }
-    const auto& [set, map] = zsets[resp.array[1].string];
+    const auto& [set, map] = *zset;
     const long set_len = static_cast<long>(map.size());
 
-    long start = std::stoll(resp.array[2].string), end = std::stoll(resp.array[3].string);
+    long start = std::stoll(std::string(resp[2])), end = std::stoll(std::string(resp[3]));
     if (start < 0)
     {
         start += set_len;
@@ -1008,166 +1713,580 @@ std::string zrange(const RESP_data& resp, Rel_data& data)
     {
         end += set_len;
     }
-    if (end > set_len)
+    if (end >= set_len)
     {
-        end = set_len;
+        end = set_len - 1;
     }
 
     if (start > end || start >= set_len || end < 0)
     {
-        return empty_array;
+        return out.raw(empty_array);
     }
 
-    std::vector<std::string> res;
-    size_t i = 0;
-    for (const auto & [score, member] : set)
+    out.array_header(end - start + 1);
+    for (const auto& element : set | std::views::drop(start) | std::views::take(end - start + 1))
     {
-        if (i < start)
-        {
-            i++;
-            continue;
-        }
-        if (i > end)
-        {
-            break;
-        }
-        res.push_back(bulk_string(member));
-        i++;
+        out.bulk_string(element.member);
     }
-
-    return array(res);
 }
 
-std::string zcard(const RESP_data& resp, Rel_data& data)
+void zcard(const Request resp, Rel_data& data, Resp_writer& out)
 {
     data.repeat = false;
-    if (resp.array.size() < 2)
+    if (resp.size() < 2)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    const std::lock_guard lock(zsets_lock);
-    if (!zsets.contains(resp.array[1].string))
+    bool wrong;
+    const Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (wrong)
     {
-        return integer(0);
+        return out.raw(wrong_type);
     }
-    const auto& [set, map] = zsets[resp.array[1].string];
 
-    return integer(static_cast<long>(map.size()));
+    out.integer(zset ? static_cast<long>(zset->scores.size()) : 0);
 }
 
-std::string zscore(const RESP_data& resp, Rel_data& data)
+void zscore(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    if (resp.size() < 3)
     {
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
     data.repeat = false;
-    const std::lock_guard lock(zsets_lock);
-    if (!zsets.contains(resp.array[1].string))
+    bool wrong;
+    Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (!zset)
     {
-        return null_bulk_string;
+        return out.raw(wrong ? wrong_type : null_bulk_string);
     }
-    auto& [set, map] = zsets[resp.array[1].string];
+    auto& [set, map] = *zset;
 
-    const std::string key = resp.array[2].string;
-    if (!map.contains(key))
+    const auto it = map.find(resp[2]);
+    if (it == map.end())
     {
-        return null_bulk_string;
+        return out.raw(null_bulk_string);
     }
-    return bulk_string(std::format("{}" ,map[key]));
+    out.bulk_string(std::format("{}", it->value));
 }
 
-std::string zrem(const RESP_data& resp, Rel_data& data)
+void zscan(const Request resp, Rel_data& data, Resp_writer& out)
 {
-    if (resp.array.size() < 3)
+    data.repeat = false;
+    unsigned long long cursor;
+    if (!parse_cursor(resp[2], cursor))
+    {
+        return out.error("ERR invalid cursor");
+    }
+    Scan_options options;
+    if (!parse_scan_options(resp, 3, false, options, out))
     {
-        return bad_cmd;
+        return;
     }
 
-    data.repeat = true;
-    const std::lock_guard lock(zsets_lock);
-    auto& [set, map] = zsets[resp.array[1].string];
+    bool wrong;
+    const Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (!zset)
+    {
+        if (wrong)
+        {
+            return out.raw(wrong_type);
+        }
+        out.array_header(2);
+        out.bulk_string("0");
+        return out.raw(empty_array);
+    }
+    std::vector<const Zset_score::Node*> members;
+    const size_t next = scan_steps(zset->scores, cursor, options, members, [&](const Zset_score::Node& node)
+    {
+        if (!options.match || options.match->matches(node.key()))
+        {
+            members.push_back(&node);
+        }
+    });
+    out.array_header(2);
+    out.bulk_string(std::to_string(next));
+    out.array_header(2 * members.size());
+    for (const Zset_score::Node* node : members)
+    {
+        out.bulk_string(node->key());
+        out.bulk_string(std::format("{}", node->value));
+    }
+}
+
+void zrem(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    if (resp.size() < 3)
+    {
+        return out.raw(bad_cmd);
+    }
+
+    data.repeat = false;
+    bool wrong;
+    Sorted_set* zset = find_value<Sorted_set>(resp[1], wrong);
+    if (!zset)
+    {
+        return wrong ? out.raw(wrong_type) : out.integer(0);
+    }
+    auto& [set, map] = *zset;
     int n = 0;
-    for (int i = 2; i < resp.array.size(); i++)
+    for (int i = 2; i < resp.size(); i++)
     {
-        if (const std::string key = resp.array[i].string; map.contains(key))
+        if (const auto it = map.find(resp[i]); it != map.end())
         {
-            set.erase({map[key], key});
-            map.erase(key);
+            set.erase({it->value, Counted_string<Use_zsets>(it->key())});
+            map.erase(it);
             n++;
         }
     }
+    if (map.empty())
+    {
+        remove_key(resp[1]);
+    }
+    data.repeat = n > 0;
+
+    out.integer(n);
+}
 
-    return integer(n);
-}
-
-const std::unordered_map<std::string, Cmd> cmd_map = {
-    {"PING", ping},
-    {"ECHO", echo},
-    {"SET", set},
-    {"GET", get},
-    {"CONFIG", config},
-    {"KEYS", keys},
-    {"INFO", info},
-    {"REPLCONF", replconf},
-    {"PSYNC", psync},
-    {"WAIT", wait},
-    {"TYPE", type},
-    {"XADD", xadd},
-    {"XRANGE", xrange},
-    {"XREAD", xread},
-    {"INCR", incr},
-    {"MULTI", multi},
-    {"EXEC", exec},
-    {"DISCARD", discard},
-    {"RPUSH", rpush},
-    {"LRANGE", lrange},
-    {"LPUSH", lpush},
-    {"LLEN", llen},
-    {"LPOP", lpop},
-    {"BLPOP", blpop},
-    {"SUBSCRIBE", sub},
-    {"PUBLISH", pub},
-    {"ZADD", zadd},
-    {"ZRANK", zrank},
-    {"ZRANGE", zrange},
-    {"ZCARD", zcard},
-    {"ZSCORE", zscore},
-    {"ZREM", zrem}
+void command_list(Request resp, Rel_data& data, Resp_writer& out);
+
+constexpr Command_spec commands[] = {
+    {"PING", ping, -1, Cmd_subscribed},
+    {"ECHO", echo, 2, 0},
+    {"SET", set, -3, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"GET", get, 2, Cmd_readonly, 1, 1, 1},
+    {"MGET", mget, -2, Cmd_readonly | Cmd_split_keys, 1, -1, 1},
+    {"MSET", mset, -3, Cmd_write | Cmd_denyoom | Cmd_split_keys, 1, -1, 2},
+    {"MSETNX", msetnx, -3, Cmd_write | Cmd_denyoom, 1, -1, 2},
+    {"CONFIG", config, -2, Cmd_admin},
+    {"KEYS", keys, 2, Cmd_readonly},
+    {"SCAN", scan, -2, Cmd_readonly},
+    {"INFO", info, -1, 0},
+    {"SAVE", save_db, 1, Cmd_admin},
+    {"BGSAVE", bgsave, 1, Cmd_admin},
+    {"REPLCONF", replconf, -2, Cmd_admin},
+    {"PSYNC", psync, -3, Cmd_admin},
+    {"WAIT", wait, 3, Cmd_blocking},
+    {"TYPE", type, 2, Cmd_readonly, 1, 1, 1},
+    {"XADD", xadd, -5, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"XRANGE", xrange, -4, Cmd_readonly, 1, 1, 1},
+    {"XREAD", xread, -4, Cmd_readonly | Cmd_blocking | Cmd_movable_keys},
+    {"INCR", incr, 2, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"DECR", decr, 2, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"INCRBY", incrby, 3, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"DECRBY", decrby, 3, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"OBJECT", object, -2, Cmd_readonly, 2, 2, 1},
+    {"MEMORY", memory, -2, Cmd_readonly, 2, 2, 1},
+    {"MULTI", multi, 1, 0},
+    {"EXEC", exec, 1, 0},
+    {"DISCARD", discard, 1, 0},
+    {"RPUSH", rpush, -3, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"LRANGE", lrange, 4, Cmd_readonly, 1, 1, 1},
+    {"LPUSH", lpush, -3, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"LLEN", llen, 2, Cmd_readonly, 1, 1, 1},
+    {"LPOP", lpop, -2, Cmd_write, 1, 1, 1},
+    {"BLPOP", blpop, 3, Cmd_write | Cmd_blocking, 1, 1, 1},
+    {"SUBSCRIBE", sub, -2, Cmd_pubsub | Cmd_subscribed},
+    {"UNSUBSCRIBE", unsub, -1, Cmd_pubsub | Cmd_subscribed},
+    {"PUBLISH", pub, 3, Cmd_pubsub},
+    {"ZADD", zadd, -4, Cmd_write | Cmd_denyoom, 1, 1, 1},
+    {"ZRANK", zrank, 3, Cmd_readonly, 1, 1, 1},
+    {"ZRANGE", zrange, -4, Cmd_readonly, 1, 1, 1},
+    {"ZCARD", zcard, 2, Cmd_readonly, 1, 1, 1},
+    {"ZSCORE", zscore, 3, Cmd_readonly, 1, 1, 1},
+    {"ZREM", zrem, -3, Cmd_write, 1, 1, 1},
+    {"ZSCAN", zscan, -3, Cmd_readonly, 1, 1, 1},
+    {"DEL", del, -2, Cmd_write | Cmd_split_keys, 1, -1, 1},
+    {"UNLINK", del, -2, Cmd_write | Cmd_split_keys, 1, -1, 1},
+    {"EXISTS", exists, -2, Cmd_readonly | Cmd_split_keys, 1, -1, 1},
+    {"EXPIRE", expire, -3, Cmd_write, 1, 1, 1},
+    {"PEXPIRE", pexpire, -3, Cmd_write, 1, 1, 1},
+    {"EXPIREAT", expireat, -3, Cmd_write, 1, 1, 1},
+    {"PEXPIREAT", pexpireat, -3, Cmd_write, 1, 1, 1},
+    {"TTL", ttl, 2, Cmd_readonly, 1, 1, 1},
+    {"PTTL", pttl, 2, Cmd_readonly, 1, 1, 1},
+    {"PERSIST", persist, 2, Cmd_write, 1, 1, 1},
+    {"COMMAND", command_list, -1, 0}
 };
 
-const std::unordered_map<std::string, Cmd> subscribed_cmd_map = {
-    {"SUBSCRIBE", sub},
-    {"PING", ping},
-    {"UNSUBSCRIBE", unsub}
+constexpr char ascii_upper(const char c)
+{
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+// FNV-1a over the upper cased name, the seed picks the function of the family
+constexpr uint32_t name_hash(const std::string_view name, const uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (const char c : name)
+    {
+        h ^= static_cast<unsigned char>(ascii_upper(c));
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// about ten times the number of commands, so a seed without collisions turns up within a few tries
+constexpr size_t dispatch_size = 512;
+static_assert(std::size(commands) < dispatch_size && std::size(commands) < 256);
+
+// slot i holds the index + 1 of the only command hashing to it, or 0
+struct Dispatch_table
+{
+    uint32_t seed;
+    std::array<uint8_t, dispatch_size> slots;
 };
 
-std::string process_command(const RESP_data& resp, Rel_data& data)
+// tries seeds until no two commands share a slot, at compile time
+constexpr Dispatch_table make_dispatch_table()
+{
+    for (uint32_t seed = 0;; seed++)
+    {
+        Dispatch_table table{seed, {}};
+        bool collision = false;
+        for (size_t i = 0; i < std::size(commands) && !collision; i++)
+        {
+            uint8_t& slot = table.slots[name_hash(commands[i].name, seed) % dispatch_size];
+            collision = slot != 0;
+            slot = static_cast<uint8_t>(i + 1);
+        }
+        if (!collision)
+        {
+            return table;
+        }
+    }
+}
+
+constexpr Dispatch_table dispatch_table = make_dispatch_table();
+
+const Command_spec* find_command(const std::string_view name)
+{
+    const uint8_t slot = dispatch_table.slots[name_hash(name, dispatch_table.seed) % dispatch_size];
+    if (slot == 0 || !is_option(name, commands[slot - 1].name))
+    {
+        return nullptr;
+    }
+    return &commands[slot - 1];
+}
+
+std::string lower_name(const std::string_view name)
 {
-    std::string cmd = resp.array[0].string;
-    to_upper(cmd);
+    std::string res(name);
+    std::ranges::transform(res, res.begin(), tolower);
+    return res;
+}
 
-    if (data.subscribed)
+void write_command_info(Resp_writer& out, const Command_spec& spec, const std::string& name)
+{
+    constexpr std::pair<Command_flag, std::string_view> flag_names[] = {
+        {Cmd_write, "write"},
+        {Cmd_readonly, "readonly"},
+        {Cmd_blocking, "blocking"},
+        {Cmd_pubsub, "pubsub"},
+        {Cmd_admin, "admin"},
+        {Cmd_movable_keys, "movablekeys"},
+        {Cmd_denyoom, "denyoom"}
+    };
+
+    // name, arity, flags, first key, last key, step, then acl categories, tips, key specs and subcommands
+    out.array_header(10);
+    out.bulk_string(name);
+    out.integer(spec.arity);
+    out.array_header(std::ranges::count_if(flag_names, [&spec](const auto& flag) { return spec.flags & flag.first; }));
+    for (const auto& [flag, flag_name] : flag_names)
+    {
+        if (spec.flags & flag)
+        {
+            out.simple_string(flag_name);
+        }
+    }
+    out.integer(spec.first_key);
+    out.integer(spec.last_key);
+    out.integer(spec.key_step);
+    out.raw(empty_array);
+    out.raw(empty_array);
+    out.raw(empty_array);
+
+    std::span<const Command_spec> subcommands;
+    if (spec.name == "CONFIG")
+    {
+        subcommands = config_subcommands;
+    }
+    else if (spec.name == "OBJECT")
+    {
+        subcommands = object_subcommands;
+    }
+    else if (spec.name == "MEMORY")
+    {
+        subcommands = memory_subcommands;
+    }
+    else if (spec.name == "REPLCONF")
+    {
+        subcommands = replconf_subcommands;
+    }
+    out.array_header(subcommands.size());
+    for (const Command_spec& sub_spec : subcommands)
+    {
+        write_command_info(out, sub_spec, name + "|" + lower_name(sub_spec.name));
+    }
+}
+
+void command_list(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    data.repeat = false;
+    if (resp.size() == 1)
+    {
+        out.array_header(std::size(commands));
+        for (const Command_spec& spec : commands)
+        {
+            write_command_info(out, spec, lower_name(spec.name));
+        }
+        return;
+    }
+    if (is_option(resp[1], "COUNT"))
+    {
+        return out.integer(std::size(commands));
+    }
+    if (is_option(resp[1], "INFO"))
+    {
+        out.array_header(resp.size() - 2);
+        for (const std::string_view name : resp.subspan(2))
+        {
+            if (const Command_spec* spec = find_command(name))
+            {
+                write_command_info(out, *spec, lower_name(spec->name));
+                continue;
+            }
+            out.raw(null_array);
+        }
+        return;
+    }
+    if (is_option(resp[1], "DOCS"))
+    {
+        return out.raw(empty_array);
+    }
+    out.error("ERR unknown subcommand '" + std::string(resp[1]) + "'");
+}
+
+// the command locks each key's shard itself, the keys only have to be on the same reactor
+Route keys_route(const Request resp, const size_t first, const size_t last, const size_t step)
+{
+    const size_t shard = shard_of(resp[first]);
+    for (size_t i = first + step; i <= last; i += step)
+    {
+        if (shard_owner(shard_of(resp[i])) != shard_owner(shard))
+        {
+            return {Cross_shard};
+        }
+    }
+    return {Single_shard, shard};
+}
+
+Route route_command(const Request resp, const Rel_data& data)
+{
+    const Command_spec* spec = find_command(resp[0]);
+    if (data.queue_commands)
+    {
+        return {spec && spec->handler == exec ? Each_queued : Anywhere};
+    }
+    if (data.subscribed || !spec)
+    {
+        return {Anywhere};
+    }
+    if (spec->handler == keys)
     {
-        if (!subscribed_cmd_map.contains(cmd))
+        return {All_shards};
+    }
+    if (spec->handler == scan)
+    {
+        // a cursor that doesn't parse gets its error wherever
+        unsigned long long cursor;
+        if (resp.size() < 2 || !parse_cursor(resp[1], cursor))
+        {
+            return {Anywhere};
+        }
+        return {Single_shard, cursor_shard(cursor)};
+    }
+    if ((spec->handler == get || spec->handler == type) && lockfree_reads())
+    {
+        // reads the published value, which needs neither the shard lock nor its reactor
+        return {Anywhere};
+    }
+    if (spec->flags & Cmd_movable_keys)
+    {
+        // XREAD, the keys are the first half of the arguments after STREAMS
+        size_t start = resp.size();
+        for (size_t i = 1; i < resp.size(); i++)
+        {
+            if (is_option(resp[i], "STREAMS"))
+            {
+                start = i + 1;
+                break;
+            }
+        }
+        const size_t n = (resp.size() - start) / 2;
+        if (n == 0)
+        {
+            return {Anywhere};
+        }
+        return keys_route(resp, start, start + n - 1, 1);
+    }
+    if (spec->flags & Cmd_split_keys && (resp.size() - spec->first_key) % spec->key_step)
+    {
+        // a key without its value gets its error wherever, before any part of the command runs
+        return {Anywhere};
+    }
+    if (spec->first_key > 0 && resp.size() > spec->first_key)
+    {
+        // a negative last key counts from the end
+        const size_t last = spec->last_key < 0 ? resp.size() + spec->last_key : spec->last_key;
+        const Route route = keys_route(resp, spec->first_key, std::min(last, resp.size() - 1), spec->key_step);
+        return route.type == Cross_shard && spec->flags & Cmd_split_keys ? Route{Split_keys} : route;
+    }
+    return {Anywhere};
+}
+
+Key_split split_keys(const Request resp)
+{
+    const Command_spec* spec = find_command(resp[0]);
+    Key_split split;
+    constexpr size_t none = -1;
+    // the request of each reactor, by its index
+    std::vector<size_t> request_of(shard_count(), none);
+    for (size_t i = spec->first_key; i < resp.size(); i += spec->key_step)
+    {
+        const size_t shard = shard_of(resp[i]);
+        size_t& request = request_of[shard_owner(shard)];
+        if (request == none)
+        {
+            request = split.requests.size();
+            split.requests.push_back({resp[0]});
+            split.shards.push_back(shard);
+        }
+        std::vector<std::string_view>& args = split.requests[request];
+        split.positions.emplace_back(request, (args.size() - 1) / spec->key_step);
+        args.insert(args.end(), resp.begin() + i, resp.begin() + i + spec->key_step);
+    }
+    return split;
+}
+
+std::string merge_replies(const Request resp, const Key_split& split, const std::vector<std::string>& replies)
+{
+    if (const auto error = std::ranges::find_if(replies, [](const std::string& reply) { return reply.starts_with('-'); });
+        error != replies.end())
+    {
+        return *error;
+    }
+    std::string merged;
+    Resp_writer out(merged);
+    const Command_spec* spec = find_command(resp[0]);
+    if (spec->handler == mget)
+    {
+        std::vector<std::vector<std::string_view>> values;
+        for (const std::string& reply : replies)
+        {
+            values.push_back(array_elements(reply));
+        }
+        out.array_header(split.positions.size());
+        for (const auto [request, position] : split.positions)
+        {
+            out.raw(values[request][position]);
+        }
+        return merged;
+    }
+    if (spec->handler == mset)
+    {
+        return OK_simple;
+    }
+    // the counts of DEL, UNLINK and EXISTS
+    long long n = 0;
+    for (const std::string& reply : replies)
+    {
+        n += std::stoll(reply.substr(1));
+    }
+    out.integer(n);
+    return merged;
+}
+
+std::string absolute_expiry(const Request resp)
+{
+    const Command_spec* spec = find_command(resp[0]);
+    std::string rewritten;
+    Resp_writer out(rewritten);
+    long long n;
+    if (spec->handler == set && resp.size() > 4 && (is_option(resp[3], "EX") || is_option(resp[3], "PX")) &&
+        parse_integer(resp[4], n))
+    {
+        const std::chrono::milliseconds unit = is_option(resp[3], "EX") ? std::chrono::seconds(1)
+                                                                         : std::chrono::milliseconds(1);
+        out.array_header(resp.size());
+        for (const std::string_view arg : resp.first(3))
+        {
+            out.bulk_string(arg);
+        }
+        out.bulk_string("PXAT");
+        out.bulk_string(std::to_string(expiry_time(n, unit, false)));
+        for (const std::string_view arg : resp.subspan(5))
+        {
+            out.bulk_string(arg);
+        }
+    }
+    else if ((spec->handler == expire || spec->handler == pexpire) && parse_integer(resp[2], n))
+    {
+        const std::chrono::milliseconds unit = spec->handler == expire ? std::chrono::seconds(1)
+                                                                       : std::chrono::milliseconds(1);
+        out.array_header(resp.size());
+        out.bulk_string("PEXPIREAT");
+        out.bulk_string(resp[1]);
+        out.bulk_string(std::to_string(expiry_time(n, unit, false)));
+        for (const std::string_view arg : resp.subspan(3))
         {
-            return simple_error("ERR Can't execute '" + cmd + "' when one or more subscriptions exist");
+            out.bulk_string(arg);
         }
-        return subscribed_cmd_map.at(cmd)(resp, data);
+    }
+    return rewritten;
+}
+
+void process_command(const Request resp, Rel_data& data, Resp_writer& out)
+{
+    const Command_spec* spec = find_command(resp[0]);
+
+    if (data.subscribed && !(spec && spec->flags & Cmd_subscribed))
+    {
+        std::string cmd(resp[0]);
+        to_upper(cmd);
+        return out.error("ERR Can't execute '" + cmd + "' when one or more subscriptions exist");
     }
 
-    if (!cmd_map.contains(cmd))
+    if (!spec)
     {
         // temp value
-        return bad_cmd;
+        return out.raw(bad_cmd);
     }
 
-    if (data.queue_commands && cmd != "EXEC" && cmd != "DISCARD")
+    if (spec->arity > 0 ? resp.size() != spec->arity : resp.size() < -spec->arity)
+    {
+        data.repeat = false;
+        return out.error("ERR wrong number of arguments for '" + lower_name(spec->name) + "' command");
+    }
+
+    if (data.queue_commands && spec->handler != exec && spec->handler != discard)
+    {
+        data.transaction_queue.emplace(resp);
+        return out.simple_string("QUEUED");
+    }
+
+    // commands from the master are let through, the replica doesn't evict
+    if (spec->flags & Cmd_write && !data.is_replica && !make_room() && spec->flags & Cmd_denyoom)
+    {
+        data.repeat = false;
+        return out.error("OOM command not allowed when used memory > 'maxmemory'.");
+    }
+    spec->handler(resp, data, out);
+    if (data.repeat)
     {
-        data.transaction_queue.push(resp);
-        return simple_string("QUEUED");
+        count_change();
     }
-    return cmd_map.at(cmd)(resp, data);
 }
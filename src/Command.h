@@ -1,28 +1,114 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include <chrono>
+#include <functional>
+#include <optional>
 #include <set>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "Replication.h"
 #include "Resp.h"
 
+// commands that have to wait (BLPOP, XREAD BLOCK, WAIT) hand the connection a poll function instead of
+// sleeping on the event loop; it is retried until it writes the response and returns true, or called
+// once more with timed_out set after the deadline (which must then write the response)
+struct Blocking
+{
+    std::function<bool(bool timed_out, Resp_writer& out)> poll;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
 struct Rel_data
 {
     bool send_rdb = false;
+    // the replica said REPLCONF capa eof
+    bool replica_eof = false;
     bool client_is_replica = false;
     bool repeat = false;
     size_t local_offset = top_offset();
     bool is_replica = false;
     bool respond = false;
     bool queue_commands = false;
-    std::queue<RESP_data> transaction_queue;
-    std::vector<std::string> transaction_responses;
+    std::queue<Owned_request> transaction_queue;
     std::set<std::string> subscribed_channels;
     bool subscribed = false;
-    bool set_nonblocking = false;
+    std::optional<Blocking> blocked;
+};
+
+typedef void (*Cmd)(Request, Rel_data&, Resp_writer&);
+
+enum Command_flag : unsigned
+{
+    Cmd_write = 1 << 0,
+    Cmd_readonly = 1 << 1,
+    Cmd_blocking = 1 << 2,
+    Cmd_pubsub = 1 << 3,
+    Cmd_admin = 1 << 4,
+    Cmd_movable_keys = 1 << 5,  // the keys aren't at fixed positions, see route_command
+    Cmd_subscribed = 1 << 6,    // allowed while the connection is subscribed
+    Cmd_denyoom = 1 << 7,       // refused when over maxmemory with nothing left to evict
+    Cmd_split_keys = 1 << 8     // keys on several reactors are split among them, see Key_split
+};
+
+// a command as COMMAND reports it; a negative arity is a minimum argument count, both count the
+// command name, and the key positions are what routing uses
+struct Command_spec
+{
+    std::string_view name;
+    Cmd handler;
+    int arity;
+    unsigned flags;
+    int first_key = 0;
+    int last_key = 0;
+    int key_step = 0;
+};
+
+// case insensitive, without allocating; nullptr for unknown commands
+const Command_spec* find_command(std::string_view name);
+
+enum Route_type
+{
+    Anywhere,
+    Single_shard,
+    All_shards,     // run on every shard, the array replies are concatenated
+    Each_queued,    // EXEC, every queued command is routed on its own
+    Split_keys,     // keys live on shards of different reactors, each runs the command on its own keys
+    Cross_shard     // keys live on shards of different reactors, which the command can't handle
+};
+
+struct Route
+{
+    Route_type type;
+    size_t shard = 0;
 };
 
-std::string process_command(const RESP_data& resp, Rel_data& data);
+// tells the connection which shard has to run the command
+Route route_command(Request resp, const Rel_data& data);
+
+// a command routed to Split_keys (MGET, MSET, DEL, UNLINK, EXISTS) runs as a command per reactor, with
+// the keys (and their values) the reactor owns, and their replies are merged back into one. Every part
+// is atomic on its own, the command as a whole isn't
+struct Key_split
+{
+    // name and arguments; they point into the original request
+    std::vector<std::vector<std::string_view>> requests;
+    // a shard of each request's reactor, to route it by
+    std::vector<size_t> shards;
+    // the request and the position in its reply of each of the command's keys, in order
+    std::vector<std::pair<size_t, size_t>> positions;
+};
+
+Key_split split_keys(Request resp);
+std::string merge_replies(Request resp, const Key_split& split, const std::vector<std::string>& replies);
+void process_command(Request resp, Rel_data& data, Resp_writer& out);
+
+// a write as the AOF keeps it: an expiry counted from now (SET EX/PX, EXPIRE, PEXPIRE) is written as the
+// unix time it came to when the command ran, on the same reactor just before, or replaying the file
+// would start it over. Empty when the command is kept as it is
+std::string absolute_expiry(Request resp);
 
 #endif //COMMAND_H
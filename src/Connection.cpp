@@ -0,0 +1,59 @@
+#include "Connection.h"
+
+#include <cstring>
+#include <iostream>
+
+#include "Database.h"
+#include "Uring.h"
+
+Socket_connection::Socket_connection(asio::ip::tcp::socket socket) : socket(std::move(socket))
+{
+}
+
+asio::awaitable<size_t> Socket_connection::read_some(const asio::mutable_buffer buffer)
+{
+    co_return co_await socket.async_read_some(buffer, asio::use_awaitable);
+}
+
+asio::awaitable<void> Socket_connection::write(const asio::const_buffer buffer)
+{
+    co_await asio::async_write(socket, buffer, asio::use_awaitable);
+}
+
+void Socket_connection::close()
+{
+    asio::error_code ec;
+    socket.close(ec);
+}
+
+int Socket_connection::native_handle()
+{
+    return socket.native_handle();
+}
+
+void init_io_backend(const asio::any_io_executor& executor)
+{
+    if (get_config("io-backend") != "uring")
+    {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (const int err = init_uring(executor); err != 0)
+    {
+        std::cerr << "io_uring not available, falling back to asio sockets:\n" << strerror(err) << "\n";
+    }
+#else
+    std::cerr << "Built without io_uring support, falling back to asio sockets\n";
+#endif
+}
+
+std::unique_ptr<Connection> make_connection(asio::ip::tcp::socket socket)
+{
+#ifdef HAVE_IO_URING
+    if (uring_active())
+    {
+        return std::make_unique<Uring_connection>(socket.release());
+    }
+#endif
+    return std::make_unique<Socket_connection>(std::move(socket));
+}
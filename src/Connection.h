@@ -0,0 +1,39 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <memory>
+#include <asio.hpp>
+
+// the byte stream a Rel talks through; both backends signal a closed peer by throwing asio::error::eof
+class Connection
+{
+public:
+    virtual ~Connection() = default;
+
+    virtual asio::awaitable<size_t> read_some(asio::mutable_buffer buffer) = 0;
+    // writes the whole buffer
+    virtual asio::awaitable<void> write(asio::const_buffer buffer) = 0;
+    virtual void close() = 0;
+    // the socket's descriptor, for a forked child that writes a snapshot to it while the connection waits
+    virtual int native_handle() = 0;
+};
+
+class Socket_connection final : public Connection
+{
+    asio::ip::tcp::socket socket;
+
+public:
+    explicit Socket_connection(asio::ip::tcp::socket socket);
+
+    asio::awaitable<size_t> read_some(asio::mutable_buffer buffer) override;
+    asio::awaitable<void> write(asio::const_buffer buffer) override;
+    void close() override;
+    int native_handle() override;
+};
+
+// sets up the backend picked with --io-backend (asio or uring) for the calling reactor thread;
+// uring falls back to asio when the kernel or the build doesn't support it
+void init_io_backend(const asio::any_io_executor& executor);
+std::unique_ptr<Connection> make_connection(asio::ip::tcp::socket socket);
+
+#endif //CONNECTION_H
@@ -1,274 +1,1078 @@
 #include "Database.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
 #include <unordered_map>
 #include <string>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <utility>
+#include "Clock.h"
+#include "Epoch.h"
+#include "Expiry.h"
+#include "Memory.h"
+#include "Replication.h"
 #include "Resp.h"
 
-std::unordered_map<std::string, std::string> key_vals_map;
-std::unordered_map<std::string, Timestamp> key_expiry_map;
-std::unordered_map<std::string, std::string> config_key_vals_map = {
-    {"port", "6379"}
+// a shard's keys as readers see them without taking its lock (lockfree-reads): their type, expiry
+// and string value. Only the shard's writer changes it, under the shard lock; published nodes are
+// never modified, a new value replaces the node, and replaced nodes and outgrown bucket arrays are
+// retired to the epochs
+class Published_keys
+{
+public:
+    Published_keys() : buckets(new Buckets(min_bits))
+    {
+    }
+
+    ~Published_keys()
+    {
+        delete buckets.load();
+    }
+
+    Published_keys(const Published_keys&) = delete;
+    Published_keys& operator=(const Published_keys&) = delete;
+
+    // value is empty for all but strings
+    void publish(const std::string_view key, const size_t type, const std::string_view value,
+                 const long long expiry_ms)
+    {
+        Buckets* b = buckets.load(std::memory_order_relaxed);
+        const size_t hash = String_hash{}(key);
+        std::atomic<Node*>* link = &b->head(hash);
+        Node* found = find(link, hash, key);
+        Node* node = Node::make(hash, type, key, value, expiry_ms);
+        node->next.store(found ? found->next.load(std::memory_order_relaxed) : link->load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+        link->store(node, std::memory_order_release);
+        if (found)
+        {
+            retire(found, Node::destroy);
+            return;
+        }
+        if (++count > b->size())
+        {
+            grow(b);
+        }
+    }
+
+    void unpublish(const std::string_view key)
+    {
+        Buckets* b = buckets.load(std::memory_order_relaxed);
+        const size_t hash = String_hash{}(key);
+        std::atomic<Node*>* link = &b->head(hash);
+        if (Node* found = find(link, hash, key))
+        {
+            link->store(found->next.load(std::memory_order_relaxed), std::memory_order_release);
+            retire(found, Node::destroy);
+            count--;
+        }
+    }
+
+    // safe on any thread, without the shard lock; calls f with the key's type and value, unless the key
+    // isn't there or has expired
+    template <typename F>
+    bool read(const std::string_view key, const long long now_ms, F&& f) const
+    {
+        const Epoch_guard pin;
+        const size_t hash = String_hash{}(key);
+        const Node* node = buckets.load(std::memory_order_acquire)->head(hash).load(std::memory_order_acquire);
+        for (; node != nullptr; node = node->next.load(std::memory_order_acquire))
+        {
+            if (node->hash == hash && node->key() == key)
+            {
+                if (node->expiry_ms != 0 && node->expiry_ms < now_ms)
+                {
+                    return false;
+                }
+                f(node->type, node->value());
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    // the key and value are stored right behind the node, in the same allocation
+    struct Node
+    {
+        std::atomic<Node*> next{nullptr};
+        size_t hash;
+        size_t type;
+        long long expiry_ms;
+        size_t key_len;
+        size_t value_len;
+
+        static Node* make(const size_t hash, const size_t type, const std::string_view key,
+                          const std::string_view value, const long long expiry_ms)
+        {
+            void* mem = ::operator new(sizeof(Node) + key.size() + value.size());
+            Node* node = new (mem) Node{{nullptr}, hash, type, expiry_ms, key.size(), value.size()};
+            std::ranges::copy(key, node->data());
+            std::ranges::copy(value, node->data() + key.size());
+            return node;
+        }
+
+        static void destroy(void* ptr)
+        {
+            static_cast<Node*>(ptr)->~Node();
+            ::operator delete(ptr);
+        }
+
+        char* data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+
+        const char* data() const
+        {
+            return reinterpret_cast<const char*>(this + 1);
+        }
+
+        std::string_view key() const
+        {
+            return {data(), key_len};
+        }
+
+        std::string_view value() const
+        {
+            return {data() + key_len, value_len};
+        }
+    };
+
+    // a power of two number of chains, picked by the hash's top bits since the shard took the bottom ones
+    struct Buckets
+    {
+        int bits;
+        std::unique_ptr<std::atomic<Node*>[]> heads;
+
+        explicit Buckets(const int bits) : bits(bits), heads(new std::atomic<Node*>[size_t{1} << bits]())
+        {
+        }
+
+        // owns the nodes still linked into it
+        ~Buckets()
+        {
+            for (size_t i = 0; i < size(); i++)
+            {
+                for (Node* node = heads[i].load(); node != nullptr;)
+                {
+                    Node* next = node->next.load();
+                    Node::destroy(node);
+                    node = next;
+                }
+            }
+        }
+
+        size_t size() const
+        {
+            return size_t{1} << bits;
+        }
+
+        std::atomic<Node*>& head(const size_t hash) const
+        {
+            return heads[hash >> (64 - bits)];
+        }
+    };
+
+    static constexpr int min_bits = 4;
+
+    std::atomic<Buckets*> buckets;
+    size_t count = 0;
+
+    // leaves link pointing at the pointer to the node
+    static Node* find(std::atomic<Node*>*& link, const size_t hash, const std::string_view key)
+    {
+        for (Node* node = link->load(std::memory_order_relaxed); node != nullptr;
+             node = link->load(std::memory_order_relaxed))
+        {
+            if (node->hash == hash && node->key() == key)
+            {
+                return node;
+            }
+            link = &node->next;
+        }
+        return nullptr;
+    }
+
+    // readers may still be walking the old chains, so the nodes are copied instead of relinked
+    void grow(Buckets* old)
+    {
+        auto* grown = new Buckets(old->bits + 1);
+        for (size_t i = 0; i < old->size(); i++)
+        {
+            for (const Node* node = old->heads[i].load(std::memory_order_relaxed); node != nullptr;
+                 node = node->next.load(std::memory_order_relaxed))
+            {
+                Node* copy = Node::make(node->hash, node->type, node->key(), node->value(), node->expiry_ms);
+                std::atomic<Node*>& head = grown->head(node->hash);
+                copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head.store(copy, std::memory_order_relaxed);
+            }
+        }
+        buckets.store(grown, std::memory_order_release);
+        retire(old);
+    }
 };
 
-std::mutex key_vals_lock;
-std::mutex key_expiry_lock;
-std::mutex config_key_vals_lock;
+struct Shard
+{
+    std::recursive_mutex lock;
+    Key_table entries;
+    // written under the lock, read without it
+    std::atomic<size_t> keys = 0;
+    Expiry_wheel expiring;
+    Published_keys published;
+};
 
-std::unordered_map<std::string, std::vector<Stream_entry>> streams;
+// more shards than reactors keeps the tables small and the keys evenly spread when the reactor count
+// isn't a power of two
+constexpr size_t shards_per_reactor = 16;
 
-std::mutex streams_lock;
+class Keyspace
+{
+public:
+    explicit Keyspace(const size_t n_reactors)
+        : n_reactors(n_reactors), mask(std::bit_ceil(n_reactors * shards_per_reactor) - 1),
+          shards(std::make_unique<Shard[]>(mask + 1))
+    {
+    }
+
+    size_t size() const
+    {
+        return mask + 1;
+    }
 
-std::unordered_map<std::string, std::list<std::string>> lists;
-std::mutex lists_lock;
+    size_t shard_of(const std::string_view key) const
+    {
+        return std::hash<std::string_view>{}(key) & mask;
+    }
 
-std::unordered_map<std::string, std::pair<Zset, Zset_score>> zsets;
-std::mutex zsets_lock;
+    size_t owner(const size_t shard) const
+    {
+        return shard % n_reactors;
+    }
+
+    Shard& shard(const size_t i)
+    {
+        return shards[i];
+    }
 
-enum Special_type
+    size_t index_of(const Shard* shard) const
+    {
+        return shard - shards.get();
+    }
+
+    size_t reactors() const
+    {
+        return n_reactors;
+    }
+
+private:
+    size_t n_reactors;
+    size_t mask;
+    std::unique_ptr<Shard[]> shards;
+};
+
+auto keyspace = std::make_unique<Keyspace>(1);
+bool publish_keys = false;
+
+std::atomic<size_t> expired_total = 0;
+std::atomic<size_t> expired_rate = 0;
+size_t sampled_total = 0;
+std::chrono::steady_clock::time_point sampled_at = std::chrono::steady_clock::now();
+// the shard of the innermost Shard_guard on this thread
+thread_local Shard* current_shard = nullptr;
+
+enum Eviction_policy
 {
-    None,
-    Byte,
-    TwoByte,
-    FourByte,
-    Compressed
+    No_eviction,
+    Allkeys_lru,
+    Allkeys_lfu,
+    Volatile_lru,
+    Volatile_lfu,
+    Volatile_ttl
+};
+
+constexpr std::pair<std::string_view, Eviction_policy> policy_names[] = {
+    {"noeviction", No_eviction},
+    {"allkeys-lru", Allkeys_lru},
+    {"allkeys-lfu", Allkeys_lfu},
+    {"volatile-lru", Volatile_lru},
+    {"volatile-lfu", Volatile_lfu},
+    {"volatile-ttl", Volatile_ttl}
 };
 
-Special_type read_length(std::basic_istream<char>& file, unsigned int& val)
-{
-    char byte;
-    file.read(&byte, 1);
-    switch (byte & 0xC0)
-    {
-    case 0x00:
-        val = byte & 0x3F;
-        return None;
-    case 0x80:
-        unsigned int ret;
-        file.read(reinterpret_cast<std::istream::char_type*>(&ret), 4);
-        val = __builtin_bswap32(ret);
-        return None;
-    case 0x40:
-        unsigned char byte2;
-        file.read(reinterpret_cast<std::istream::char_type*>(&byte2), 1);
-        val = byte2 + ((byte & 0x3F) << 8);
-        return None;
-    case 0xC0:
-        switch (byte & 0x3F)
-        {
-        case 0:
-            val = 1;
-            return Byte;
-        case 1:
-            val = 2;
-            return TwoByte;
-        case 2:
-            val = 4;
-            return FourByte;
-        case 3:
-            read_length(file, val);
-            return Compressed;
-        default:
-            return None;
+size_t max_memory = 0;
+Eviction_policy eviction_policy = No_eviction;
+size_t eviction_samples = 5;
+std::atomic<size_t> evicted_total = 0;
+
+String_map<std::string> config_map = {
+    {"port", "6379"},
+    {"threads", "1"},
+    {"io-backend", "asio"},
+    {"lockfree-reads", "no"},
+    {"maxmemory", "0"},
+    {"maxmemory-policy", "noeviction"},
+    {"maxmemory-samples", "5"},
+    // "seconds changes" pairs; a BGSAVE starts once that many writes were made in that many seconds
+    {"save", ""},
+    // seconds a full resync waits for other replicas to share its snapshot; fractions are allowed
+    {"repl-diskless-sync-delay", "0"},
+    // snapshots LZF compress their strings longer than the threshold, in bytes, as Redis does past 20
+    {"rdbcompression", "yes"},
+    {"rdb-compression-threshold", "20"},
+    // the append only file, in dir; appendfsync is always, everysec or no
+    {"appendonly", "no"},
+    {"appendfilename", "appendonly.aof"},
+    {"appendfsync", "everysec"}
+};
+
+std::mutex config_lock;
+
+// a byte count, with Redis's units: k is 1000 and kb 1024, and the same for m(b) and g(b)
+bool parse_memory(const std::string& str, size_t& bytes)
+{
+    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), bytes);
+    if (ec != std::errc())
+    {
+        return false;
+    }
+    std::string unit(end, str.data() + str.size());
+    std::ranges::transform(unit, unit.begin(), [](const unsigned char c) { return std::tolower(c); });
+    constexpr std::pair<std::string_view, size_t> units[] = {
+        {"", 1}, {"k", 1000}, {"kb", 1024}, {"m", 1000 * 1000}, {"mb", 1024 * 1024},
+        {"g", 1000 * 1000 * 1000}, {"gb", 1024 * 1024 * 1024}
+    };
+    const auto it = std::ranges::find(units, std::string_view(unit), &std::pair<std::string_view, size_t>::first);
+    if (it == std::end(units))
+    {
+        return false;
+    }
+    bytes *= it->second;
+    return true;
+}
+
+void init_keyspace(const size_t n_reactors)
+{
+    keyspace = std::make_unique<Keyspace>(n_reactors);
+    publish_keys = get_config("lockfree-reads") == "yes";
+
+    if (!parse_memory(get_config("maxmemory"), max_memory))
+    {
+        std::cerr << "Invalid maxmemory, not limiting memory\n";
+        max_memory = 0;
+        set_config("maxmemory", "0");
+    }
+    const std::string policy = get_config("maxmemory-policy");
+    const auto it = std::ranges::find(policy_names, std::string_view(policy),
+                                      &std::pair<std::string_view, Eviction_policy>::first);
+    if (it == std::end(policy_names))
+    {
+        std::cerr << "Invalid maxmemory-policy, using noeviction\n";
+        set_config("maxmemory-policy", "noeviction");
+    }
+    eviction_policy = it == std::end(policy_names) ? No_eviction : it->second;
+    eviction_samples = std::max(1, std::atoi(get_config("maxmemory-samples").c_str()));
+}
+
+size_t shard_count()
+{
+    return keyspace->size();
+}
+
+size_t shard_of(const std::string_view key)
+{
+    return keyspace->shard_of(key);
+}
+
+size_t shard_owner(const size_t shard)
+{
+    return keyspace->owner(shard);
+}
+
+Shard_guard::Shard_guard(const size_t shard) : previous(current_shard)
+{
+    Shard& locked = keyspace->shard(shard);
+    lock = std::unique_lock(locked.lock);
+    current_shard = &locked;
+}
+
+Shard_guard::~Shard_guard()
+{
+    current_shard = previous;
+}
+
+constexpr std::string_view type_names[] = {"string", "list", "zset", "stream"};
+
+std::string_view Key_entry::type_name() const
+{
+    return type_names[type()];
+}
+
+std::string_view Key_entry::encoding() const
+{
+    // the role each container has in Redis
+    constexpr std::string_view encodings[] = {"int", "embstr", "raw", "linkedlist", "skiplist", "stream"};
+    return encodings[value.index()];
+}
+
+void Key_entry::set_string(const std::string_view str)
+{
+    // only the canonical form of an integer is held as one, so the value reads back unchanged
+    long long n;
+    if (str.size() <= std::tuple_size_v<Digits> &&
+        std::from_chars(str.data(), str.data() + str.size(), n).ptr == str.data() + str.size())
+    {
+        Digits digits;
+        if (std::string_view(digits.data(), std::to_chars(digits.begin(), digits.end(), n).ptr) == str)
+        {
+            return set_integer(n);
         }
+    }
+    if (str.size() <= Embedded_string::capacity)
+    {
+        Embedded_string& embedded = value.emplace<Embedded_string>();
+        std::ranges::copy(str, embedded.data);
+        embedded.size = static_cast<unsigned char>(str.size());
+        return;
+    }
+    // overwriting a long string reuses its buffer
+    if (auto* raw = std::get_if<Box<Raw_string>>(&value))
+    {
+        (*raw)->assign(str);
+        return;
+    }
+    value.emplace<Box<Raw_string>>(make_box<Raw_string>(str));
+}
+
+void Key_entry::set_integer(const long long n)
+{
+    value.emplace<long long>(n);
+}
+
+std::string_view Key_entry::string_value(Digits& digits) const
+{
+    switch (value.index())
+    {
+    case 0:
+        return {digits.data(), std::to_chars(digits.begin(), digits.end(), std::get<long long>(value)).ptr};
+    case 1:
+        return std::get<Embedded_string>(value).view();
     default:
-        return None;
+        return *std::get<Box<Raw_string>>(value);
     }
 }
 
-std::string read_string(std::basic_istream<char>& file)
+bool Key_entry::integer_value(long long& n) const
 {
-    std::string str;
-    switch (unsigned int len; read_length(file, len))
+    if (const auto* integer = std::get_if<long long>(&value))
     {
-    case None:
-        str = std::string(len, '\0');
-        file.read(&str[0], len);
-        return str;
-    case Byte:
-    case TwoByte:
-    case FourByte:
-        unsigned int fourByte;
-        file.read(reinterpret_cast<std::istream::char_type*>(&fourByte), len);
-        return std::to_string(fourByte);
-    case Compressed:
-        unsigned int compressedLen;
-        read_length(file, compressedLen);
-        unsigned int uncompressedLen;
-        read_length(file, uncompressedLen);
-        // we don't deal with compressed strings yet
-        file.ignore(compressedLen);
-        return str;
+        n = *integer;
+        return true;
     }
-    return str;
+    // strings that aren't in canonical form, like "007"
+    Digits digits;
+    const std::string_view str = string_value(digits);
+    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), n);
+    return ec == std::errc() && !str.empty() && end == str.data() + str.size();
+}
+
+Key_table& entries()
+{
+    return current_shard->entries;
 }
 
-std::string read_key_val(std::basic_istream<char>& file, const unsigned char byte)
+size_t key_count()
 {
-    std::string key = read_string(file);
-    switch (byte)
+    size_t n = 0;
+    for (size_t i = 0; i < keyspace->size(); i++)
     {
-    case 0:
-        key_vals()[key] = read_string(file);
-        break;
+        n += keyspace->shard(i).keys.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+// the heap block of a string, when it doesn't fit in the string itself
+template <typename String>
+size_t string_memory(const String& str)
+{
+    return str.capacity() > String().capacity() ? block_size(str.data()) : 0;
+}
+
+// a node of std::list, std::set and std::unordered_map (which keeps the hash of the key in its nodes)
+template <typename T>
+constexpr size_t list_node = 2 * sizeof(void*) + sizeof(T);
+template <typename T>
+constexpr size_t tree_node = 4 * sizeof(void*) + sizeof(T);
+template <typename T>
+constexpr size_t hash_node = sizeof(void*) + sizeof(T) + sizeof(size_t);
+
+template <typename Map>
+size_t buckets_memory(const Map& map)
+{
+    return map.bucket_count() > 1 ? allocation_size(map.bucket_count() * sizeof(void*)) : 0;
+}
+
+// the memory of a container's elements, summed or estimated from the first samples of them
+template <typename Container, typename F>
+size_t elements_memory(const Container& container, const size_t samples, F element_memory)
+{
+    size_t sum = 0;
+    size_t n = 0;
+    for (const auto& element : container)
+    {
+        if (samples != 0 && n == samples)
+        {
+            return sum * container.size() / n;
+        }
+        sum += element_memory(element);
+        n++;
+    }
+    return sum;
+}
+
+size_t value_memory(const Key_entry& entry, const size_t samples)
+{
+    switch (entry.value.index())
+    {
+    case 2:
+        {
+            const Box<Raw_string>& raw = std::get<Box<Raw_string>>(entry.value);
+            return block_size(raw.get()) + string_memory(*raw);
+        }
+    case 3:
+        {
+            const Box<List>& list = std::get<Box<List>>(entry.value);
+            return block_size(list.get()) + elements_memory(*list, samples, [](const auto& element)
+            {
+                return allocation_size(list_node<Counted_string<Use_lists>>) + string_memory(element);
+            });
+        }
+    case 4:
+        {
+            const Box<Sorted_set>& zset = std::get<Box<Sorted_set>>(entry.value);
+            // every member is in the tree and the hash table, whose slots are in its own array
+            return block_size(zset.get()) + zset->scores.allocated() + elements_memory(zset->set, samples,
+                [](const ZElement& element)
+                {
+                    return allocation_size(tree_node<ZElement>) + 2 * string_memory(element.member);
+                });
+        }
+    case 5:
+        {
+            const Box<Stream>& stream = std::get<Box<Stream>>(entry.value);
+            return block_size(stream.get()) + (stream->capacity() ? block_size(stream->data()) : 0) +
+                elements_memory(*stream, samples, [](const Stream_entry& stream_entry)
+                {
+                    size_t bytes = buckets_memory(stream_entry.key_vals);
+                    for (const auto& [field, value] : stream_entry.key_vals)
+                    {
+                        bytes += allocation_size(hash_node<decltype(stream_entry.key_vals)::value_type>) +
+                            string_memory(field) + string_memory(value);
+                    }
+                    return bytes;
+                });
+        }
     default:
-        std::cerr << "Value type not supported" << std::endl;
-        break;
+        // held in the entry
+        return 0;
     }
-    return key;
 }
 
-std::unordered_map<std::string, std::string>& key_vals()
+size_t key_memory(const std::string_view key, const size_t samples)
 {
-    const std::lock_guard lock(key_vals_lock);
-    return key_vals_map;
+    const Key_entry* entry = find_key(key);
+    if (!entry)
+    {
+        return 0;
+    }
+    const auto it = current_shard->entries.find(key);
+    return Key_table::slot_size + block_size(&*it) + value_memory(*entry, samples);
 }
 
-std::unordered_map<std::string, Timestamp>& key_expiry()
+size_t dataset_memory()
 {
-    const std::lock_guard lock(key_expiry_lock);
-    return key_expiry_map;
+    size_t bytes = 0;
+    for (const Memory_use use : {Use_keyspace, Use_strings, Use_lists, Use_zsets, Use_streams})
+    {
+        bytes += used_memory(use);
+    }
+    return bytes;
 }
 
-std::unordered_map<std::string, std::string>& config_key_vals()
+// only the shard's writer changes its count, so this needn't be atomic as a whole
+void count_keys(const long long n)
 {
-    const std::lock_guard lock(config_key_vals_lock);
-    return config_key_vals_map;
+    current_shard->keys.store(current_shard->keys.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
 }
 
-std::string Stream_entry::id_bulk() const
+bool expired(const Key_entry& entry, const long long now_ms)
 {
-    return bulk_string(std::to_string(milliseconds_time) + "-" + std::to_string(sequence_number));
+    return entry.has_expiry() && entry.expiry_ms() < now_ms;
 }
 
-void stream_add(const std::string& stream_key, const Stream_entry& se)
+// the access field holds the LRU clock, seconds modulo 2^24, or for LFU the minute the counter was
+// last decayed (modulo 2^16) above a logarithmic use counter (8 bits)
+constexpr unsigned long long lru_mask = (1 << 24) - 1;
+constexpr unsigned long long lfu_initial = 5;
+constexpr double lfu_log_factor = 10;
+// minutes for the counter to lose one
+constexpr unsigned long long lfu_decay_minutes = 1;
+
+bool uses_lfu()
 {
-    const std::lock_guard lock(streams_lock);
-    streams[stream_key].push_back(se);
+    return eviction_policy == Allkeys_lfu || eviction_policy == Volatile_lfu;
 }
 
-bool stream_exists(const std::string& stream_key)
+bool uses_lru()
 {
-    const std::lock_guard lock(streams_lock);
-    return streams.contains(stream_key);
+    return eviction_policy == Allkeys_lru || eviction_policy == Volatile_lru;
 }
 
-const Stream_entry& stream_top(const std::string& stream_key)
+unsigned long long lfu_minutes(const long long now_ms)
 {
-    const std::lock_guard lock(streams_lock);
-    return streams[stream_key].back();
+    return (now_ms / 60000) & 0xFFFF;
 }
 
-bool stream_empty(const std::string& stream_key)
+unsigned long long lfu_counter(const Key_entry& entry, const long long now_ms)
 {
-    const std::lock_guard lock(streams_lock);
-    return streams[stream_key].empty();
+    const unsigned long long counter = entry.access & 0xFF;
+    const unsigned long long periods = ((lfu_minutes(now_ms) - (entry.access >> 8)) & 0xFFFF) / lfu_decay_minutes;
+    return periods >= counter ? 0 : counter - periods;
 }
 
-void read_rdb(std::basic_istream<char>* s)
+thread_local std::minstd_rand random_engine(std::random_device{}());
+
+// records a use of the key, for the policies that look at it
+void touch(Key_entry& entry, const long long now_ms, const bool created)
 {
-    std::ifstream* file = nullptr;
-    if (s == nullptr)
+    if (uses_lru())
+    {
+        entry.access = (now_ms / 1000) & lru_mask;
+    }
+    else if (uses_lfu())
     {
-        if (!config_key_vals().contains("dir") || !config_key_vals().contains("dbfilename"))
+        unsigned long long counter = created ? lfu_initial : lfu_counter(entry, now_ms);
+        // a Morris counter: the more uses it has counted, the less likely another one is to count
+        const double odds = 1.0 / ((counter > lfu_initial ? counter - lfu_initial : 0) * lfu_log_factor + 1);
+        if (!created && counter < 255 && std::uniform_real_distribution<double>()(random_engine) < odds)
         {
-            std::cout << "Database file not loaded\n";
-            return;
+            counter++;
         }
-        file = new std::ifstream(config_key_vals()["dir"] + "/" + config_key_vals()["dbfilename"], std::ios::binary);
+        entry.access = lfu_minutes(now_ms) << 8 | counter;
+    }
+}
 
-        if (not file->is_open()) {
-            std::cerr << "Unable to open rdb file\n";
-            delete file;
-            return;
-        }
-        s = file;
+// keys deleted by expiry or eviction are deleted on the replicas and in the AOF with a DEL, sent the way
+// a command's write is
+void propagate_deletion(const std::string_view key)
+{
+    const std::string_view del[] = {"DEL", key};
+    propagate(del);
+}
+
+Key_entry* find_key(const std::string_view key)
+{
+    const auto it = current_shard->entries.find(key);
+    if (it == current_shard->entries.end())
+    {
+        return nullptr;
+    }
+    const long long now = unix_millis_now();
+    if (expired(it->value, now))
+    {
+        expire_key(key);
+        return nullptr;
     }
+    touch(it->value, now, false);
+    return &it->value;
+}
 
-    char read_buffer[6];
+Key_entry& upsert_key(const std::string_view key, bool& inserted)
+{
+    const auto [it, added] = current_shard->entries.try_emplace(key);
+    const long long now = unix_millis_now();
+    if (added)
+    {
+        count_keys(1);
+    }
+    else if (expired(it->value, now))
+    {
+        // dropped and created again, as far as anyone can tell
+        propagate_deletion(key);
+        expired_total.fetch_add(1, std::memory_order_relaxed);
+        it->value = Key_entry();
+    }
+    else
+    {
+        inserted = false;
+        touch(it->value, now, false);
+        return it->value;
+    }
+    inserted = true;
+    touch(it->value, now, true);
+    return it->value;
+}
 
-    s->read(read_buffer, 5);
-    read_buffer[5] = '\0';
-    if (std::string(read_buffer) != "REDIS")
+void reserve_keys(const size_t keys)
+{
+    // the keys spread over the shards by their hash, a little unevenly
+    const size_t share = keys / keyspace->size();
+    for (size_t i = 0; i < keyspace->size(); i++)
     {
-        std::cerr << "Supplied file is not an RDB file\n";
-        if (file != nullptr)
+        const Shard_guard guard(i);
+        current_shard->entries.reserve(share + share / 16 + 16);
+    }
+}
+
+bool remove_key(const std::string_view key)
+{
+    const auto it = current_shard->entries.find(key);
+    if (it == current_shard->entries.end())
+    {
+        return false;
+    }
+    const bool live = !expired(it->value, unix_millis_now());
+    current_shard->entries.erase(it);
+    count_keys(-1);
+    publish_key(key, nullptr);
+    return live;
+}
+
+bool lockfree_reads()
+{
+    return publish_keys;
+}
+
+void publish_key(const std::string_view key, const Key_entry* entry)
+{
+    if (!publish_keys)
+    {
+        return;
+    }
+    if (entry == nullptr)
+    {
+        return current_shard->published.unpublish(key);
+    }
+    Digits digits;
+    const Key_type type = entry->type();
+    current_shard->published.publish(key, type, type == Type_string ? entry->string_value(digits) : std::string_view(),
+                                     entry->expiry_ms());
+}
+
+bool write_published_string(const std::string_view key, Resp_writer& out)
+{
+    const long long now = unix_millis_now();
+    return keyspace->shard(shard_of(key)).published.read(key, now, [&out](const size_t type, const std::string_view value)
+    {
+        if (type != Type_string)
+        {
+            return out.raw(wrong_type);
+        }
+        out.bulk_string(value);
+    });
+}
+
+std::string_view published_type(const std::string_view key)
+{
+    const long long now = unix_millis_now();
+    std::string_view name = "none";
+    keyspace->shard(shard_of(key)).published.read(key, now, [&name](const size_t type, std::string_view)
+    {
+        name = type_names[type];
+    });
+    return name;
+}
+
+void set_expiry(const std::string_view key, Key_entry& entry, const long long when)
+{
+    entry.set_expiry_ms(when);
+    // a millisecond late, so the key has surely expired when its slot comes up
+    current_shard->expiring.add(std::string(key), when + 1);
+    publish_key(key, &entry);
+}
+
+void clear_expiry(const std::string_view key, Key_entry& entry)
+{
+    entry.clear_expiry_ms();
+    publish_key(key, &entry);
+}
+
+void expire_key(const std::string_view key)
+{
+    remove_key(key);
+    propagate_deletion(key);
+    expired_total.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool expire_shard(const size_t shard, const std::chrono::steady_clock::time_point deadline)
+{
+    const Shard_guard guard(shard);
+    const long long now = unix_millis_now();
+    return current_shard->expiring.advance(now, [now](const std::string& key)
+    {
+        // the entry is stale when the key was deleted or given another expiry since
+        if (const auto it = current_shard->entries.find(std::string_view(key)); it != current_shard->entries.end() && expired(it->value, now))
         {
-            file->close();
-            delete file;
+            expire_key(key);
         }
+    }, [deadline] { return std::chrono::steady_clock::now() >= deadline; });
+}
+
+void rehash_keys(const size_t reactor, const std::chrono::steady_clock::time_point deadline)
+{
+    for (size_t shard = reactor; shard < shard_count(); shard += keyspace->reactors())
+    {
+        const Shard_guard guard(shard);
+        while (current_shard->entries.rehash(1024))
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                return;
+            }
+        }
+    }
+}
+
+void sample_expiry_stats()
+{
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - sampled_at).count();
+    if (elapsed < 1000)
+    {
         return;
     }
+    const size_t total = expired_total.load(std::memory_order_relaxed);
+    expired_rate.store((total - sampled_total) * 1000 / elapsed, std::memory_order_relaxed);
+    sampled_total = total;
+    sampled_at = now;
+}
+
+size_t expired_keys()
+{
+    return expired_total.load(std::memory_order_relaxed);
+}
 
-    s->read(read_buffer, 4);
-    read_buffer[4] = '\0';
-    const int version = std::stoi(read_buffer);
+size_t expired_keys_per_sec()
+{
+    return expired_rate.load(std::memory_order_relaxed);
+}
 
-    std::string aux_key;
-    std::string aux_val;
-    while (not s->eof())
+// how good a victim the key is, higher is better
+unsigned long long eviction_score(const Key_entry& entry, const long long now_ms)
+{
+    if (uses_lru())
+    {
+        return ((now_ms / 1000) - entry.access) & lru_mask;
+    }
+    if (uses_lfu())
     {
-        unsigned char byte;
-        s->read(reinterpret_cast<std::istream::char_type*>(&byte), 1);
+        return 255 - lfu_counter(entry, now_ms);
+    }
+    // volatile-ttl, the sooner the key expires the better
+    return ~0ULL - entry.expiry_offset;
+}
 
-        switch (byte)
+struct Eviction_candidate
+{
+    unsigned long long score;
+    size_t shard;
+    std::string key;
+};
+
+constexpr size_t eviction_pool_size = 16;
+// the most time a write spends evicting before it runs
+constexpr auto eviction_step = std::chrono::microseconds(500);
+
+// each reactor keeps the best candidates it has sampled from its shards, by ascending score
+thread_local std::vector<Eviction_candidate> eviction_pool;
+// which of the reactor's shards is sampled next
+thread_local size_t next_sampled = 0;
+
+void add_candidate(const unsigned long long score, const size_t shard, const std::string_view key)
+{
+    if (eviction_pool.size() == eviction_pool_size && score <= eviction_pool.front().score)
+    {
+        return;
+    }
+    if (std::ranges::any_of(eviction_pool, [&](const Eviction_candidate& c) { return c.shard == shard && c.key == key; }))
+    {
+        return;
+    }
+    const auto at = std::ranges::upper_bound(eviction_pool, score, {}, &Eviction_candidate::score);
+    eviction_pool.insert(at, {score, shard, std::string(key)});
+    if (eviction_pool.size() > eviction_pool_size)
+    {
+        eviction_pool.erase(eviction_pool.begin());
+    }
+}
+
+// adds maxmemory-samples keys from a random spot of the shard's table to the pool
+void sample_shard(const size_t shard, const long long now_ms)
+{
+    const Shard_guard guard(shard);
+    const Key_table& table = current_shard->entries;
+    if (table.empty())
+    {
+        return;
+    }
+    const bool volatile_only = eviction_policy >= Volatile_lru;
+    const size_t n_slots = table.capacity();
+    // bounds the walk when few keys have an expiry
+    const size_t max_slots = std::min(n_slots, eviction_samples * 64);
+    const size_t start = random_engine() % n_slots;
+    size_t sampled = 0;
+    for (size_t i = 0; i < max_slots && sampled < eviction_samples; i++)
+    {
+        const Key_table::value_type* element = table.at_slot((start + i) % n_slots);
+        if (!element || (volatile_only && !element->value.has_expiry()))
         {
-        case 0xFF:
-            unsigned long long crc64;
-            s->read(reinterpret_cast<std::istream::char_type*>(&crc64), 8);
-            // won't bother with checking yet
-            if (file != nullptr)
+            continue;
+        }
+        add_candidate(eviction_score(element->value, now_ms), shard, element->key());
+        sampled++;
+    }
+}
+
+// false when none of the reactor's shards has a key the policy may evict
+bool evict_one(const size_t reactor)
+{
+    const size_t n_reactors = keyspace->reactors();
+    const size_t owned = (shard_count() - reactor + n_reactors - 1) / n_reactors;
+    const long long now = unix_millis_now();
+    for (size_t tries = 0; tries < owned; tries++)
+    {
+        next_sampled = (next_sampled + 1) % owned;
+        sample_shard(reactor + next_sampled * n_reactors, now);
+        while (!eviction_pool.empty())
+        {
+            const Eviction_candidate victim = std::move(eviction_pool.back());
+            eviction_pool.pop_back();
+            const Shard_guard guard(victim.shard);
+            // candidates go stale as keys are deleted or lose their expiry
+            const auto it = current_shard->entries.find(std::string_view(victim.key));
+            if (it == current_shard->entries.end() || (eviction_policy >= Volatile_lru && !it->value.has_expiry()))
             {
-                file->close();
-                delete file;
+                continue;
             }
-            return;
-        case 0xFE:
-            unsigned int db_sel;
-            read_length(*s, db_sel);
-            // we currently ignore this as there is only one database present
-            break;
-        case 0xFD:
-            unsigned int expire_sec;
-            s->read(reinterpret_cast<std::istream::char_type*>(&expire_sec), 4);
-            s->read(reinterpret_cast<std::istream::char_type*>(&byte), 1);
-            key_expiry()[read_key_val(*s, byte)] = Timestamp(std::chrono::seconds(expire_sec));
-            break;
-        case 0xFC:
-            unsigned long long expire_msec;
-            s->read(reinterpret_cast<std::istream::char_type*>(&expire_msec), 8);
-            s->read(reinterpret_cast<std::istream::char_type*>(&byte), 1);
-            key_expiry()[read_key_val(*s, byte)] = Timestamp(std::chrono::milliseconds(expire_msec));
-            break;
-        case 0xFB:
-            unsigned int key_val_size;
-            read_length(*s, key_val_size);
-            unsigned int expiry_size;
-            read_length(*s, expiry_size);
-            // could use these to reserve space in the db; not used yet
+            remove_key(victim.key);
+            evicted_total.fetch_add(1, std::memory_order_relaxed);
+            propagate_deletion(victim.key);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t memory_limit()
+{
+    return max_memory;
+}
+
+bool over_maxmemory()
+{
+    // replicas leave eviction to their master, which sends them the DELs
+    return max_memory != 0 && used_memory() > max_memory && !is_slave();
+}
+
+bool make_room()
+{
+    if (!over_maxmemory() || !current_shard)
+    {
+        return !over_maxmemory();
+    }
+    if (eviction_policy == No_eviction)
+    {
+        return false;
+    }
+    // whatever is left over after a step is evicted between commands, by evict_keys
+    const size_t reactor = keyspace->owner(keyspace->index_of(current_shard));
+    const auto deadline = std::chrono::steady_clock::now() + eviction_step;
+    bool evicted = false;
+    for (size_t n = 0; over_maxmemory(); n++)
+    {
+        if (n % 16 == 15 && std::chrono::steady_clock::now() >= deadline)
+        {
             break;
-        case 0xFA:
-            aux_key = read_string(*s);
-            aux_val = read_string(*s);
-            // currently do nothing with this
+        }
+        if (!evict_one(reactor))
+        {
             break;
-        default:
-            read_key_val(*s, byte);
+        }
+        evicted = true;
+    }
+    return evicted || !over_maxmemory();
+}
+
+bool evict_keys(const size_t reactor, const std::chrono::steady_clock::time_point deadline)
+{
+    if (eviction_policy == No_eviction)
+    {
+        return true;
+    }
+    for (size_t n = 0; over_maxmemory(); n++)
+    {
+        if (n % 16 == 15 && std::chrono::steady_clock::now() >= deadline)
+        {
+            return false;
+        }
+        if (!evict_one(reactor))
+        {
             break;
         }
     }
+    return true;
+}
+
+size_t evicted_keys()
+{
+    return evicted_total.load(std::memory_order_relaxed);
+}
 
-    std::cerr << "Supplied file is broken\n";
-    if (file != nullptr)
+void set_config(const std::string& key, const std::string& value)
+{
+    const std::lock_guard lock(config_lock);
+    config_map[key] = value;
+}
+
+bool has_config(const std::string_view key)
+{
+    const std::lock_guard lock(config_lock);
+    return config_map.contains(key);
+}
+
+std::string get_config(const std::string_view key)
+{
+    const std::lock_guard lock(config_lock);
+    const auto it = config_map.find(key);
+    return it == config_map.end() ? std::string() : it->second;
+}
+
+void Stream_entry::write_id(Resp_writer& out) const
+{
+    // room for both numbers at their longest and the dash between them, which to_chars is held to
+    char buf[48];
+    std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf) - 1, milliseconds_time);
+    if (result.ec == std::errc())
     {
-        file->close();
-        delete file;
+        *result.ptr = '-';
+        result = std::to_chars(result.ptr + 1, buf + sizeof(buf), sequence_number);
     }
+    if (result.ec != std::errc())
+    {
+        return out.bulk_string(std::to_string(milliseconds_time) + "-" + std::to_string(sequence_number));
+    }
+    out.bulk_string({buf, result.ptr});
 }
 
+
 bool ZElement::operator<(const ZElement& rhs) const
 {
     if (score < rhs.score)
@@ -1,53 +1,331 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <algorithm>
+#include <array>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <chrono>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <set>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
-typedef std::chrono::time_point<std::chrono::system_clock> Timestamp;
+#include "Hash_table.h"
+#include "Memory.h"
+#include "Resp.h"
 
-std::unordered_map<std::string, std::string>& key_vals();
-std::unordered_map<std::string, Timestamp>& key_expiry();
-std::unordered_map<std::string, std::string>& config_key_vals();
+// lets the keyspace be searched with a string_view, without building a std::string for the key
+struct String_hash
+{
+    using is_transparent = void;
+
+    size_t operator()(const std::string_view str) const
+    {
+        return std::hash<std::string_view>{}(str);
+    }
+};
+
+template <typename T>
+using String_map = std::unordered_map<std::string, T, String_hash, std::equal_to<>>;
+
+// the data is allocated through the allocators of its use, so the memory each use holds is known
+// without walking anything
+template <Memory_use Use>
+using Counted_string = std::basic_string<char, std::char_traits<char>, Use_allocator<char, Use>>;
+
+template <typename K, typename V, Memory_use Use>
+using Counted_map = std::unordered_map<K, V, String_hash, std::equal_to<>, Use_allocator<std::pair<const K, V>, Use>>;
 
 struct Stream_entry
 {
     unsigned long milliseconds_time;
     unsigned int sequence_number;
-    std::unordered_map<std::string, std::string> key_vals;
+    Counted_map<Counted_string<Use_streams>, Counted_string<Use_streams>, Use_streams> key_vals;
 
-    std::string id_bulk() const;
+    void write_id(Resp_writer& out) const;
 };
 
-void stream_add(const std::string& stream_key, const Stream_entry& se);
-bool stream_exists(const std::string& stream_key);
-const Stream_entry& stream_top(const std::string& stream_key);
-bool stream_empty(const std::string& stream_key);
+struct ZElement
+{
+    double score;
+    Counted_string<Use_zsets> member;
 
-extern std::mutex streams_lock;
-extern std::unordered_map<std::string, std::vector<Stream_entry>> streams;
+    bool operator<(const ZElement& rhs) const;
+};
 
-extern std::unordered_map<std::string, std::list<std::string>> lists;
-extern std::mutex lists_lock;
+typedef std::set<ZElement, std::less<>, Use_allocator<ZElement, Use_zsets>> Zset;
+typedef Hash_table<double, Use_zsets> Zset_score;
 
-void read_rdb(std::basic_istream<char>* s = nullptr);
+typedef std::list<Counted_string<Use_lists>, Use_allocator<Counted_string<Use_lists>, Use_lists>> List;
+typedef std::vector<Stream_entry, Use_allocator<Stream_entry, Use_streams>> Stream;
+typedef Counted_string<Use_strings> Raw_string;
 
-struct ZElement
+struct Sorted_set
 {
-    double score;
-    std::string member;
+    Zset set;
+    Zset_score scores;
+};
 
-    bool operator<(const ZElement& rhs) const;
+enum Key_type
+{
+    Type_string,
+    Type_list,
+    Type_zset,
+    Type_stream
+};
+
+// the memory use each boxed value type is counted under
+template <typename T>
+constexpr Memory_use use_of = Use_strings;
+template <>
+constexpr Memory_use use_of<List> = Use_lists;
+template <>
+constexpr Memory_use use_of<Sorted_set> = Use_zsets;
+template <>
+constexpr Memory_use use_of<Stream> = Use_streams;
+
+template <typename T>
+struct Box_delete
+{
+    void operator()(T* ptr) const noexcept
+    {
+        ptr->~T();
+        deallocate(use_of<T>, ptr);
+    }
+};
+
+// a value that lives on the heap, allocated for its use like the data inside it
+template <typename T>
+using Box = std::unique_ptr<T, Box_delete<T>>;
+
+template <typename T, typename... Args>
+Box<T> make_box(Args&&... args)
+{
+    return Box<T>(new (allocate(use_of<T>, sizeof(T))) T(std::forward<Args>(args)...));
+}
+
+// a string value short enough to live inside its entry
+struct Embedded_string
+{
+    static constexpr size_t capacity = 22;
+
+    char data[capacity];
+    unsigned char size = 0;
+
+    std::string_view view() const
+    {
+        return {data, size};
+    }
 };
 
-typedef std::set<ZElement> Zset;
-typedef std::unordered_map<std::string, double> Zset_score;
+// the digits of a string value held as an integer
+typedef std::array<char, 20> Digits;
+
+// a key's value, of any type, and its metadata. Strings are held as integers when they're the canonical
+// form of one, inside the entry when they're short and on the heap otherwise; the containers are boxed
+// too, so every entry is small
+struct Key_entry
+{
+    std::variant<long long, Embedded_string, Box<Raw_string>, Box<List>, Box<Sorted_set>, Box<Stream>> value;
+    // milliseconds since expiry_epoch, 0 for keys that don't expire; shares a word with access
+    unsigned long long expiry_offset : 40 = 0;
+    // how recently (LRU) or how often (LFU) the key was used, for eviction
+    unsigned long long access : 24 = 0;
+
+    // 2020-01-01 in unix milliseconds, 40 bits from it last until 2054
+    static constexpr long long expiry_epoch = 1577836800000;
+
+    // unix milliseconds, 0 for keys that don't expire
+    long long expiry_ms() const
+    {
+        return expiry_offset ? static_cast<long long>(expiry_offset) + expiry_epoch : 0;
+    }
+
+    bool has_expiry() const
+    {
+        return expiry_offset != 0;
+    }
+
+    // times out of range are clamped, the ones before the epoch are all long past
+    void set_expiry_ms(const long long ms)
+    {
+        expiry_offset = std::clamp(ms - expiry_epoch, 1LL, (1LL << 40) - 1);
+    }
+
+    void clear_expiry_ms()
+    {
+        expiry_offset = 0;
+    }
+
+    Key_type type() const
+    {
+        return value.index() <= 2 ? Type_string : static_cast<Key_type>(value.index() - 2);
+    }
+
+    // std::string stands for a string value in any encoding
+    template <typename T>
+    bool holds() const
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            return type() == Type_string;
+        }
+        else
+        {
+            return std::holds_alternative<Box<T>>(value);
+        }
+    }
+
+    template <typename T>
+    T& as()
+    {
+        return *std::get<Box<T>>(value);
+    }
+
+    template <typename T>
+    const T& as() const
+    {
+        return *std::get<Box<T>>(value);
+    }
+
+    // replaces the value with an empty T
+    template <typename T>
+    void emplace()
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            value.emplace<Embedded_string>();
+        }
+        else
+        {
+            value.emplace<Box<T>>(make_box<T>());
+        }
+    }
+
+    // replaces the value with a string, in the smallest encoding that holds it
+    void set_string(std::string_view str);
+    void set_integer(long long n);
+    // a string value's bytes, integers are formatted into digits
+    std::string_view string_value(Digits& digits) const;
+    // false for strings that aren't integers
+    bool integer_value(long long& n) const;
+
+    // as TYPE names it
+    std::string_view type_name() const;
+    // as OBJECT ENCODING names it
+    std::string_view encoding() const;
+};
+
+// the keyspace is hash partitioned into a power of two number of shards, each with its own table and
+// lock. Every shard belongs to one reactor thread, which runs the commands for its keys, so the locks
+// are only contended by work from outside the reactors (like loading a snapshot)
+void init_keyspace(size_t n_reactors);
+size_t shard_count();
+size_t shard_of(std::string_view key);
+size_t shard_owner(size_t shard);
+
+struct Shard;
+
+// holds a shard's lock for as long as it lives and points the functions below at it. Guards nest: a
+// command whose keys are on several shards of one reactor takes a guard per key on top of its own
+class Shard_guard
+{
+public:
+    explicit Shard_guard(size_t shard);
+    ~Shard_guard();
+
+    Shard_guard(const Shard_guard&) = delete;
+    Shard_guard& operator=(const Shard_guard&) = delete;
+
+private:
+    std::unique_lock<std::recursive_mutex> lock;
+    Shard* previous;
+};
+
+typedef Hash_table<Key_entry, Use_keyspace> Key_table;
+
+// every key of the shard, expired ones included
+Key_table& entries();
+// the keys in every shard, without locking them
+size_t key_count();
+// the bytes a key and its value take up; containers with more than samples elements (and samples
+// isn't 0) are estimated from their first few. Missing keys take up 0
+size_t key_memory(std::string_view key, size_t samples);
+// the keys and values of every shard
+size_t dataset_memory();
+// one hash lookup; an expired key is dropped and reported missing
+Key_entry* find_key(std::string_view key);
+// the key's entry, a new one holding an empty string when the key is missing or expired
+Key_entry& upsert_key(std::string_view key, bool& inserted);
+bool remove_key(std::string_view key);
+// makes room in every shard for its share of that many keys, before loading them
+void reserve_keys(size_t keys);
+
+// expiry is lazy (commands drop the expired keys they come across) and active: every reactor frees the
+// expired keys of its shards in short slices, off a timing wheel per shard. Either way the key is deleted
+// on the replicas and in the AOF with a DEL
+// when is in unix milliseconds
+void set_expiry(std::string_view key, Key_entry& entry, long long when);
+void clear_expiry(std::string_view key, Key_entry& entry);
+void expire_key(std::string_view key);
+// false when the deadline cut it short
+bool expire_shard(size_t shard, std::chrono::steady_clock::time_point deadline);
+// the shard tables grow incrementally, moving slots over as keys are added; this moves the rest over
+// between commands, so tables that stopped growing don't hold on to two arrays
+void rehash_keys(size_t reactor, std::chrono::steady_clock::time_point deadline);
+// called about once a second from a single thread, updates the rate
+void sample_expiry_stats();
+size_t expired_keys();
+size_t expired_keys_per_sec();
+
+// with maxmemory set, keys are evicted by maxmemory-policy once the memory used goes over it. Victims
+// are picked from a pool of the best candidates among random samples, and evicted in steps short
+// enough not to hold up the reactor; evictions are sent to replicas as DELs
+bool over_maxmemory();
+// 0 when there's no limit
+size_t memory_limit();
+// evicts from the shards of the current shard's reactor, for a write about to run on it; false when
+// the memory is over the limit and nothing could be evicted
+bool make_room();
+// continues for a reactor what the writes left over; false when the deadline cut it short
+bool evict_keys(size_t reactor, std::chrono::steady_clock::time_point deadline);
+size_t evicted_keys();
+
+// with lockfree-reads set, every key is also published where GET and TYPE can read it from any thread
+// without the shard lock (and without handing the command to the shard's reactor): string values in
+// full, other types by their type. Whatever creates or removes a key, changes a string value or an
+// expiry republishes it, with the shard locked
+bool lockfree_reads();
+// nullptr unpublishes the key
+void publish_key(std::string_view key, const Key_entry* entry);
+// GET's reply: the value or WRONGTYPE; false when the key doesn't exist
+bool write_published_string(std::string_view key, Resp_writer& out);
+std::string_view published_type(std::string_view key);
+
+// the key's value, created empty when the key doesn't exist; nullptr when it holds another type
+template <typename T>
+T* find_or_add(const std::string_view key)
+{
+    bool inserted;
+    Key_entry& entry = upsert_key(key, inserted);
+    if (inserted)
+    {
+        entry.emplace<T>();
+        publish_key(key, &entry);
+        return &entry.as<T>();
+    }
+    return entry.holds<T>() ? &entry.as<T>() : nullptr;
+}
 
-extern std::unordered_map<std::string, std::pair<Zset, Zset_score>> zsets;
-extern std::mutex zsets_lock;
+// settings are only written while the arguments are processed, before any other thread starts
+void set_config(const std::string& key, const std::string& value);
+bool has_config(std::string_view key);
+// empty for settings that aren't set
+std::string get_config(std::string_view key);
 
 #endif //DATABASE_H
@@ -0,0 +1,145 @@
+#include "Epoch.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// every thread that reads or retires gets a slot for the epoch it has pinned, 0 when it hasn't
+constexpr size_t max_threads = 256;
+// how many retired objects a thread collects before it tries to move the epoch on and free them
+constexpr size_t retire_batch = 64;
+
+struct alignas(64) Thread_slot
+{
+    std::atomic<uint64_t> pinned{0};
+    std::atomic<bool> used{false};
+};
+
+Thread_slot slots[max_threads];
+std::atomic<uint64_t> global_epoch{1};
+
+struct Retired
+{
+    void* ptr;
+    void (*free)(void*);
+    uint64_t epoch;
+};
+
+// what threads left behind when they exited, freed by whoever collects next
+std::vector<Retired> orphans;
+std::mutex orphans_lock;
+
+// the epoch only moves on once every pinned reader has seen the current one, so memory retired in
+// epoch e is unreachable once the global epoch is e + 2
+void try_advance()
+{
+    uint64_t epoch = global_epoch.load();
+    for (const Thread_slot& slot : slots)
+    {
+        if (const uint64_t pinned = slot.pinned.load(); pinned != 0 && pinned != epoch)
+        {
+            return;
+        }
+    }
+    global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void free_unreachable(std::vector<Retired>& retired)
+{
+    const uint64_t epoch = global_epoch.load();
+    std::erase_if(retired, [epoch](const Retired& r)
+    {
+        if (r.epoch + 2 > epoch)
+        {
+            return false;
+        }
+        r.free(r.ptr);
+        return true;
+    });
+}
+
+class Thread_state
+{
+public:
+    Thread_state()
+    {
+        for (Thread_slot& s : slots)
+        {
+            if (bool expected = false; s.used.compare_exchange_strong(expected, true))
+            {
+                slot = &s;
+                return;
+            }
+        }
+        throw std::runtime_error("too many threads for epoch reclamation");
+    }
+
+    ~Thread_state()
+    {
+        {
+            const std::lock_guard lock(orphans_lock);
+            orphans.insert(orphans.end(), retired.begin(), retired.end());
+        }
+        slot->pinned.store(0);
+        slot->used.store(false);
+    }
+
+    void pin()
+    {
+        if (depth++ == 0)
+        {
+            slot->pinned.store(global_epoch.load());
+            // the pin has to be visible before the reader loads any pointer it protects
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void unpin()
+    {
+        if (--depth == 0)
+        {
+            slot->pinned.store(0, std::memory_order_release);
+        }
+    }
+
+    void retire(void* ptr, void (*free)(void*))
+    {
+        retired.push_back({ptr, free, global_epoch.load()});
+        if (++since_collect < retire_batch)
+        {
+            return;
+        }
+        since_collect = 0;
+        try_advance();
+        free_unreachable(retired);
+        if (const std::unique_lock lock(orphans_lock, std::try_to_lock); lock && !orphans.empty())
+        {
+            free_unreachable(orphans);
+        }
+    }
+
+private:
+    Thread_slot* slot = nullptr;
+    size_t depth = 0;
+    size_t since_collect = 0;
+    std::vector<Retired> retired;
+};
+
+thread_local Thread_state state;
+
+Epoch_guard::Epoch_guard()
+{
+    state.pin();
+}
+
+Epoch_guard::~Epoch_guard()
+{
+    state.unpin();
+}
+
+void retire(void* ptr, void (*free)(void*))
+{
+    state.retire(ptr, free);
+}
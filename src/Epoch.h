@@ -0,0 +1,26 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// epoch based reclamation for data that is read without locks: readers pin the global epoch while
+// they hold pointers into the data, and memory a writer unlinked is only freed once every reader
+// that could still see it has let go
+class Epoch_guard
+{
+public:
+    Epoch_guard();
+    ~Epoch_guard();
+
+    Epoch_guard(const Epoch_guard&) = delete;
+    Epoch_guard& operator=(const Epoch_guard&) = delete;
+};
+
+// frees unlinked memory once no reader can reach it any more
+void retire(void* ptr, void (*free)(void*));
+
+template <typename T>
+void retire(T* ptr)
+{
+    retire(ptr, [](void* p) { delete static_cast<T*>(p); });
+}
+
+#endif //EPOCH_H
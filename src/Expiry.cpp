@@ -0,0 +1,102 @@
+#include "Expiry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <utility>
+
+Expiry_wheel::Expiry_wheel()
+    : current(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count())
+{
+}
+
+void Expiry_wheel::add(std::string key, const long long when)
+{
+    place({std::move(key), when});
+    count++;
+}
+
+bool Expiry_wheel::advance(const long long now, const std::function<void(const std::string&)>& expire,
+                           const std::function<bool()>& out_of_time)
+{
+    size_t steps = 0;
+    while (true)
+    {
+        while (!due.empty())
+        {
+            if (++steps % 16 == 0 && out_of_time())
+            {
+                return false;
+            }
+            const Entry entry = std::move(due.back());
+            due.pop_back();
+            count--;
+            expire(entry.key);
+        }
+        if (current >= now)
+        {
+            return true;
+        }
+        if (count == 0)
+        {
+            current = now;
+            return true;
+        }
+        if (++steps % 16 == 0 && out_of_time())
+        {
+            return false;
+        }
+        tick();
+    }
+}
+
+size_t Expiry_wheel::size() const
+{
+    return count;
+}
+
+void Expiry_wheel::place(Entry entry)
+{
+    // anything already due goes into the next millisecond's slot
+    const long long when = std::max(entry.when, current + 1);
+    const long long delta = when - current;
+    for (int level = 0; level < levels; level++)
+    {
+        const int shift = slot_bits * level;
+        if (delta < 1LL << (shift + slot_bits) || level == levels - 1)
+        {
+            // keys past the top level's range wait in its farthest slot and are placed again from there
+            const long long slot_time = std::min(when, current + (1LL << (shift + slot_bits)) - 1);
+            wheel[level][(slot_time >> shift) & (slots - 1)].push_back(std::move(entry));
+            return;
+        }
+    }
+}
+
+void Expiry_wheel::tick()
+{
+    current++;
+    // a coarser slot is spread over the finer levels when the finer ones wrap around to it
+    for (int level = levels - 1; level > 0; level--)
+    {
+        const int shift = slot_bits * level;
+        if ((current & ((1LL << shift) - 1)) != 0)
+        {
+            continue;
+        }
+        std::vector<Entry> cascading = std::move(wheel[level][(current >> shift) & (slots - 1)]);
+        for (Entry& entry : cascading)
+        {
+            place(std::move(entry));
+        }
+    }
+    std::vector<Entry>& slot = wheel[0][current & (slots - 1)];
+    if (due.empty())
+    {
+        std::swap(due, slot);
+        return;
+    }
+    std::ranges::move(slot, std::back_inserter(due));
+    slot.clear();
+}
@@ -0,0 +1,47 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <array>
+#include <functional>
+#include <string>
+#include <vector>
+
+// hierarchical timing wheel of keys by expiry time (unix milliseconds). Level 0 has a slot per
+// millisecond, every level above is 64 times coarser; keys cascade down a level as their time comes
+// closer, so adding a key and expiring it are both constant time
+class Expiry_wheel
+{
+public:
+    Expiry_wheel();
+
+    void add(std::string key, long long when);
+    // hands every key due by now to expire; out_of_time is checked every few keys and ends the slice
+    // early, false is returned and the next call picks up where this one stopped
+    bool advance(long long now, const std::function<void(const std::string&)>& expire,
+                 const std::function<bool()>& out_of_time);
+    // keys are added again when their expiry changes, the old entries stay until their time
+    size_t size() const;
+
+private:
+    static constexpr int slot_bits = 6;
+    static constexpr size_t slots = 1 << slot_bits;
+    static constexpr int levels = 4;
+
+    struct Entry
+    {
+        std::string key;
+        long long when;
+    };
+
+    std::array<std::array<std::vector<Entry>, slots>, levels> wheel;
+    // entries whose time has come but that a cut off slice didn't get to
+    std::vector<Entry> due;
+    // the last millisecond the wheel has moved past
+    long long current;
+    size_t count = 0;
+
+    void place(Entry entry);
+    void tick();
+};
+
+#endif //EXPIRY_H
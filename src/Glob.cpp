@@ -0,0 +1,180 @@
+#include "Glob.h"
+
+#include <algorithm>
+#include <cstring>
+
+Glob::Glob(const std::string_view pattern)
+{
+    const auto add_literal = [this](const char c)
+    {
+        if (tokens.empty() || tokens.back().type != Token_literal)
+        {
+            tokens.push_back({Token_literal});
+        }
+        tokens.back().literal += c;
+    };
+
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        switch (pattern[i])
+        {
+        case '*':
+            if (tokens.empty() || tokens.back().type != Token_star)
+            {
+                tokens.push_back({Token_star});
+            }
+            has_star = true;
+            break;
+        case '?':
+            tokens.push_back({Token_any});
+            break;
+        case '[':
+            {
+                // as in Redis: an unterminated set ends with the pattern, and [] matches nothing
+                std::array<uint64_t, 4> set{};
+                const auto add = [&set](const unsigned char c) { set[c >> 6] |= 1ULL << (c & 63); };
+                const bool negated = i + 1 < pattern.size() && pattern[i + 1] == '^';
+                for (i += negated ? 2 : 1; i < pattern.size() && pattern[i] != ']'; i++)
+                {
+                    if (pattern[i] == '\\' && i + 1 < pattern.size())
+                    {
+                        add(pattern[++i]);
+                    }
+                    else if (i + 2 < pattern.size() && pattern[i + 1] == '-')
+                    {
+                        const auto a = static_cast<unsigned char>(pattern[i]);
+                        const auto b = static_cast<unsigned char>(pattern[i + 2]);
+                        for (unsigned c = std::min(a, b); c <= std::max(a, b); c++)
+                        {
+                            add(static_cast<unsigned char>(c));
+                        }
+                        i += 2;
+                    }
+                    else
+                    {
+                        add(pattern[i]);
+                    }
+                }
+                if (negated)
+                {
+                    for (uint64_t& word : set)
+                    {
+                        word = ~word;
+                    }
+                }
+                tokens.push_back({Token_set, {}, sets.size()});
+                sets.push_back(set);
+                break;
+            }
+        case '\\':
+            // a trailing backslash stands for itself
+            add_literal(i + 1 < pattern.size() ? pattern[++i] : '\\');
+            break;
+        default:
+            add_literal(pattern[i]);
+        }
+    }
+
+    for (const Token& token : tokens)
+    {
+        min_size += token_size(token);
+    }
+}
+
+bool Glob::matches_all() const
+{
+    return tokens.size() == 1 && tokens[0].type == Token_star;
+}
+
+size_t Glob::token_size(const Token& token)
+{
+    switch (token.type)
+    {
+    case Token_literal:
+        return token.literal.size();
+    case Token_star:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+bool Glob::matches_token(const Token& token, const std::string_view str) const
+{
+    switch (token.type)
+    {
+    case Token_literal:
+        return std::memcmp(str.data(), token.literal.data(), token.literal.size()) == 0;
+    case Token_set:
+        {
+            const auto c = static_cast<unsigned char>(str[0]);
+            return sets[token.set][c >> 6] >> (c & 63) & 1;
+        }
+    default:
+        return true;
+    }
+}
+
+bool Glob::matches(const std::string_view str) const
+{
+    if (str.size() < min_size || (!has_star && str.size() != min_size))
+    {
+        return false;
+    }
+    if (has_star && tokens.back().type == Token_literal && !str.ends_with(tokens.back().literal))
+    {
+        return false;
+    }
+
+    // the tokens are matched in order; on a mismatch the last star takes one more byte and the tokens
+    // after it are tried again. Every other token matches a fixed number of bytes, so that finds a match
+    // whenever there is one
+    constexpr size_t none = -1;
+    size_t t = 0;
+    size_t at = 0;
+    size_t star = none;
+    size_t star_at = 0;
+    while (true)
+    {
+        if (t < tokens.size())
+        {
+            const Token& token = tokens[t];
+            if (token.type == Token_star)
+            {
+                if (t + 1 == tokens.size())
+                {
+                    return true;
+                }
+                star = t++;
+                star_at = at;
+                continue;
+            }
+            if (star != none && t == star + 1 && token.type == Token_literal)
+            {
+                // what follows a star can only start where its literal bytes are found
+                const size_t found = str.find(token.literal, at);
+                if (found == std::string_view::npos)
+                {
+                    return false;
+                }
+                at = star_at = found;
+            }
+            if (str.size() - at >= token_size(token) && matches_token(token, str.substr(at)))
+            {
+                at += token_size(token);
+                t++;
+                continue;
+            }
+        }
+        else if (at == str.size())
+        {
+            return true;
+        }
+        if (star == none || star_at == str.size())
+        {
+            return false;
+        }
+        at = ++star_at;
+        t = star + 1;
+    }
+}
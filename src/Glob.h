@@ -0,0 +1,53 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// a glob-style pattern, as KEYS and the MATCH option of SCAN take: * matches any run of bytes, ? any
+// one byte, [abc], [a-z] and [^...] a byte of (or not of) a set, and \ makes the next byte literal.
+// The pattern is compiled once per command into runs of literal bytes, one byte wildcards and stars.
+// Runs are compared with memcmp and a run after a star is looked for with string_view::find (memchr),
+// which glibc vectorizes; sets are 256 bit maps. Most keys are then ruled out by the length, the
+// literal prefix or the literal suffix before anything is matched byte by byte
+class Glob
+{
+public:
+    explicit Glob(std::string_view pattern);
+
+    bool matches(std::string_view str) const;
+    // a pattern that's only stars
+    bool matches_all() const;
+
+private:
+    enum Token_type
+    {
+        Token_literal,
+        Token_any,
+        Token_set,
+        Token_star
+    };
+
+    struct Token
+    {
+        Token_type type;
+        // literal bytes, or the index of the set
+        std::string literal;
+        size_t set = 0;
+    };
+
+    std::vector<Token> tokens;
+    std::vector<std::array<uint64_t, 4>> sets;
+    // the bytes a match takes up at least, more only with a star
+    size_t min_size = 0;
+    bool has_star = false;
+
+    // the token matches at the start of str, which is at least as long as the token
+    bool matches_token(const Token& token, std::string_view str) const;
+    static size_t token_size(const Token& token);
+};
+
+#endif //GLOB_H
@@ -0,0 +1,691 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Memory.h"
+
+// an open addressing table of string keys in the style of Swiss tables. Every slot has a control byte
+// holding 7 bits of its key's hash (or marking it empty or deleted), and a probe compares a group of 16
+// control bytes at once, so looking up a missing key rarely touches a slot. Slots also keep the low 32
+// bits of their hash, which rule out most key comparisons and let the table grow without hashing the
+// keys again.
+// A slot points to its element, which holds the value with the key right after it in one allocation
+// for the table's use. That takes less memory than keeping the elements in the slots would (a slot is
+// 13 bytes, and up to half of them are free after the table grows), and elements never move.
+// The table grows incrementally: the slots move to the new array a few at a time, on every insert and
+// whenever rehash() is called, and until they're all moved lookups search both arrays
+template <typename V, Memory_use Use>
+class Hash_table
+{
+public:
+    struct Node
+    {
+        V value;
+
+        // the key's length follows the value as a varint, then the key's bytes
+        std::string_view key() const
+        {
+            const auto* bytes = reinterpret_cast<const unsigned char*>(this + 1);
+            size_t size = 0;
+            for (int shift = 0;; shift += 7)
+            {
+                size |= static_cast<size_t>(*bytes & 0x7f) << shift;
+                if (!(*bytes++ & 0x80))
+                {
+                    break;
+                }
+            }
+            return {reinterpret_cast<const char*>(bytes), size};
+        }
+    };
+
+    using value_type = Node;
+
+    // iterates over the new array's slots, then the old one's. Inserts invalidate iterators, since they
+    // move slots from the old array and may start growing the table
+    template <bool Const>
+    class Iterator
+    {
+    public:
+        using iterator_concept = std::forward_iterator_tag;
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Hash_table::value_type;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::conditional_t<Const, const value_type&, value_type&>;
+        using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+        using Table = std::conditional_t<Const, const Hash_table, Hash_table>;
+
+        Iterator() = default;
+
+        Iterator(Table* table, const size_t slot) : table(table), slot(slot)
+        {
+        }
+
+        // iterators convert to const ones
+        operator Iterator<true>() const requires (!Const)
+        {
+            return {table, slot};
+        }
+
+        reference operator*() const
+        {
+            return *table->node(slot);
+        }
+
+        pointer operator->() const
+        {
+            return table->node(slot);
+        }
+
+        Iterator& operator++()
+        {
+            slot = table->next_full(slot + 1);
+            return *this;
+        }
+
+        Iterator operator++(int)
+        {
+            Iterator copy = *this;
+            ++*this;
+            return copy;
+        }
+
+        bool operator==(const Iterator& rhs) const
+        {
+            return slot == rhs.slot;
+        }
+
+        // the slot the element is in, counting the new array's slots first
+        size_t index() const
+        {
+            return slot;
+        }
+
+    private:
+        Table* table = nullptr;
+        size_t slot = 0;
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    Hash_table() = default;
+
+    Hash_table(Hash_table&& other) noexcept
+    {
+        swap(other);
+    }
+
+    Hash_table& operator=(Hash_table&& other) noexcept
+    {
+        Hash_table(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~Hash_table()
+    {
+        current.destroy();
+        old.destroy();
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // the number of slots in both arrays, full or not
+    size_t capacity() const
+    {
+        return current.size + old.size;
+    }
+
+    bool rehashing() const
+    {
+        return old.size != 0;
+    }
+
+    // the bytes of the table's own arrays, not counting the elements
+    size_t allocated() const
+    {
+        return current.allocated() + old.allocated();
+    }
+
+    // what each element takes up in the array, at full load
+    static constexpr size_t slot_size = sizeof(Node*) + sizeof(uint32_t) + 1;
+
+    iterator begin()
+    {
+        return {this, next_full(0)};
+    }
+
+    iterator end()
+    {
+        return {this, capacity()};
+    }
+
+    const_iterator begin() const
+    {
+        return {this, next_full(0)};
+    }
+
+    const_iterator end() const
+    {
+        return {this, capacity()};
+    }
+
+    // the element in a slot, nullptr when the slot is empty
+    const Node* at_slot(const size_t slot) const
+    {
+        const Slots& slots = slot < current.size ? current : old;
+        const size_t i = slot < current.size ? slot : slot - current.size;
+        return is_full(slots.ctrl[i]) ? slots.nodes[i] : nullptr;
+    }
+
+    // a step of SCAN: calls f with the elements of the slots the cursor picks and returns the next
+    // cursor, 0 once the whole table has been covered. As in Redis the cursor counts in reverse binary,
+    // over the groups of 16 slots an element's hash starts probing from, so an array twice the size
+    // splits every group of the cursors already done in two that are done as well: elements that are
+    // there for the whole scan are all seen, across any number of growths, and some may be seen twice.
+    // While the table is growing a step covers the cursor's group in the smaller array and all the
+    // groups it splits into in the larger one
+    template <typename F>
+    size_t scan(size_t cursor, F&& f) const
+    {
+        if (!rehashing())
+        {
+            if (current.size == 0)
+            {
+                return 0;
+            }
+            current.scan_group(cursor & current.group_mask(), f);
+            return next_cursor(cursor, current.group_mask());
+        }
+        const Slots& small = old.size < current.size ? old : current;
+        const Slots& large = old.size < current.size ? current : old;
+        small.scan_group(cursor & small.group_mask(), f);
+        do
+        {
+            large.scan_group(cursor & large.group_mask(), f);
+            cursor = next_cursor(cursor, large.group_mask());
+        }
+        while (cursor & (small.group_mask() ^ large.group_mask()));
+        return cursor;
+    }
+
+    iterator find(const std::string_view key)
+    {
+        return {this, find_slot(key, std::hash<std::string_view>{}(key))};
+    }
+
+    const_iterator find(const std::string_view key) const
+    {
+        return {this, find_slot(key, std::hash<std::string_view>{}(key))};
+    }
+
+    // the value is constructed from args only when the key isn't there yet
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const std::string_view key, Args&&... args)
+    {
+        const size_t hash = std::hash<std::string_view>{}(key);
+        if (const size_t slot = find_slot(key, hash); slot != capacity())
+        {
+            return {{this, slot}, false};
+        }
+        if (growth_left == 0)
+        {
+            make_room();
+        }
+        else if (rehashing())
+        {
+            rehash(insert_steps);
+        }
+        const size_t slot = current.free_slot(static_cast<uint32_t>(hash));
+        current.nodes[slot] = make_node(key, std::forward<Args>(args)...);
+        if (current.ctrl[slot] == empty_slot)
+        {
+            growth_left--;
+        }
+        current.set(slot, fingerprint(hash));
+        current.hashes[slot] = static_cast<uint32_t>(hash);
+        count++;
+        return {{this, slot}, true};
+    }
+
+    // other iterators stay valid
+    void erase(const const_iterator it)
+    {
+        const size_t slot = it.index();
+        count--;
+        if (slot >= current.size)
+        {
+            // the old array only ever loses slots
+            free_node(old.nodes[slot - current.size]);
+            return old.set(slot - current.size, deleted_slot);
+        }
+        free_node(current.nodes[slot]);
+        if (current.was_never_full(slot))
+        {
+            current.set(slot, empty_slot);
+            growth_left++;
+        }
+        else
+        {
+            current.set(slot, deleted_slot);
+        }
+    }
+
+    // moves up to steps slots of the old array over, false once there are none left
+    bool rehash(const size_t steps)
+    {
+        const size_t from = moved;
+        const size_t end = std::min(old.size, moved + steps);
+        for (; moved < end; moved++)
+        {
+            if (!is_full(old.ctrl[moved]))
+            {
+                continue;
+            }
+            const size_t to = current.free_slot(old.hashes[moved]);
+            current.nodes[to] = old.nodes[moved];
+            current.set(to, old.ctrl[moved]);
+            current.hashes[to] = old.hashes[moved];
+            // probes of the old array still pass through the slot
+            old.set(moved, deleted_slot);
+        }
+        if (moved < old.size)
+        {
+            // nothing reads the hashes and nodes of the moved slots again, only their control bytes; the
+            // pages of big arrays go back as the move passes them, so freeing the array at the end doesn't
+            // stall on unmapping all of it
+            if (moved / release_step != from / release_step)
+            {
+                release_pages(old.hashes, old.hashes + moved);
+                release_pages(old.nodes, old.nodes + moved);
+            }
+            return true;
+        }
+        deallocate(Use, old.block);
+        old = Slots();
+        moved = 0;
+        return false;
+    }
+
+    // makes room for n elements, so inserting them doesn't grow the table; what's there moves over at once
+    void reserve(const size_t n)
+    {
+        size_t size = std::max(current.size, min_capacity);
+        while (max_load(size) < n)
+        {
+            size *= 2;
+        }
+        if (size == current.size)
+        {
+            return;
+        }
+        while (rehash(old.size))
+        {
+        }
+        old = current;
+        current = Slots::make(size);
+        growth_left = max_load(size) - count;
+        rehash(old.size);
+    }
+
+    void clear()
+    {
+        Hash_table().swap(*this);
+    }
+
+    void swap(Hash_table& other) noexcept
+    {
+        std::swap(current, other.current);
+        std::swap(old, other.old);
+        std::swap(moved, other.moved);
+        std::swap(count, other.count);
+        std::swap(growth_left, other.growth_left);
+    }
+
+private:
+    static constexpr size_t group_width = 16;
+    static constexpr size_t min_capacity = 16;
+    // the old array's slots moved along with an insert. A table that grows has room for 7/16 of its new
+    // size in inserts before it's full again, the old array is moved over long before that
+    static constexpr size_t insert_steps = 16;
+    // small arrays are moved over at once, it takes a few microseconds at most
+    static constexpr size_t small_size = 1024;
+    // how many moved slots the old array's pages are given back after, a syscall for every 64K slots
+    static constexpr size_t release_step = 65536;
+    // control bytes: full slots have the top bit set and hold 7 bits of the hash. Empty ones are 0, so a
+    // new array can come from calloc, whose big blocks are fresh pages the kernel zeroes as they're used
+    static constexpr int8_t empty_slot = 0;
+    static constexpr int8_t deleted_slot = 1;
+
+    // the control bytes of 16 slots in a row, with a bit set in the masks for every slot that matches
+    struct Group
+    {
+#ifdef __SSE2__
+        __m128i bytes;
+
+        explicit Group(const int8_t* ctrl) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)))
+        {
+        }
+
+        uint32_t match(const int8_t byte) const
+        {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(byte), bytes));
+        }
+
+        // empty or deleted
+        uint32_t match_free() const
+        {
+            return ~_mm_movemask_epi8(bytes) & 0xffff;
+        }
+#else
+        const int8_t* bytes;
+
+        explicit Group(const int8_t* ctrl) : bytes(ctrl)
+        {
+        }
+
+        uint32_t match(const int8_t byte) const
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < group_width; i++)
+            {
+                mask |= static_cast<uint32_t>(bytes[i] == byte) << i;
+            }
+            return mask;
+        }
+
+        uint32_t match_free() const
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < group_width; i++)
+            {
+                mask |= static_cast<uint32_t>(bytes[i] >= 0) << i;
+            }
+            return mask;
+        }
+#endif
+    };
+
+    static bool is_full(const int8_t byte)
+    {
+        return byte < 0;
+    }
+
+    static int8_t fingerprint(const size_t hash)
+    {
+        return static_cast<int8_t>(hash >> (8 * sizeof(size_t) - 7) | 0x80);
+    }
+
+    // an array of slots: one allocation holds the control bytes (with the first group's repeated at the
+    // end, so a group can be read from any slot), the hashes and the slots
+    struct Slots
+    {
+        void* block = nullptr;
+        int8_t* ctrl = nullptr;
+        uint32_t* hashes = nullptr;
+        Node** nodes = nullptr;
+        size_t size = 0;
+
+        static Slots make(const size_t size)
+        {
+            const size_t hashes_at = (size + group_width + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
+            const size_t nodes_at = (hashes_at + size * sizeof(uint32_t) + alignof(Node*) - 1) & ~(alignof(Node*) - 1);
+            char* bytes = static_cast<char*>(allocate_zeroed(Use, nodes_at + size * sizeof(Node*)));
+            return {bytes, reinterpret_cast<int8_t*>(bytes), reinterpret_cast<uint32_t*>(bytes + hashes_at),
+                    reinterpret_cast<Node**>(bytes + nodes_at), size};
+        }
+
+        size_t allocated() const
+        {
+            return block ? block_size(block) : 0;
+        }
+
+        void set(const size_t slot, const int8_t byte)
+        {
+            ctrl[slot] = byte;
+            if (slot < group_width)
+            {
+                ctrl[size + slot] = byte;
+            }
+        }
+
+        // probes go from the slot the low bits of the hash pick a group at a time, a group further every
+        // step, which visits every group of a power of two array. size when the key isn't there
+        size_t find(const std::string_view key, const size_t hash) const
+        {
+            if (size == 0)
+            {
+                return 0;
+            }
+            const size_t mask = size - 1;
+            const int8_t byte = fingerprint(hash);
+            const uint32_t low = static_cast<uint32_t>(hash);
+            size_t pos = low & mask;
+            for (size_t step = group_width;; step += group_width)
+            {
+                const Group group(ctrl + pos);
+                for (uint32_t match = group.match(byte); match; match &= match - 1)
+                {
+                    const size_t slot = (pos + std::countr_zero(match)) & mask;
+                    if (hashes[slot] == low && nodes[slot]->key() == key)
+                    {
+                        return slot;
+                    }
+                }
+                if (group.match(empty_slot))
+                {
+                    return size;
+                }
+                pos = (pos + step) & mask;
+            }
+        }
+
+        size_t free_slot(const uint32_t low) const
+        {
+            const size_t mask = size - 1;
+            size_t pos = low & mask;
+            for (size_t step = group_width;; step += group_width)
+            {
+                if (const uint32_t free = Group(ctrl + pos).match_free())
+                {
+                    return (pos + std::countr_zero(free)) & mask;
+                }
+                pos = (pos + step) & mask;
+            }
+        }
+
+        // a slot can only go back to empty when no probe could have passed it on the way to another key,
+        // that is when it was never in a group of 16 full slots
+        bool was_never_full(const size_t slot) const
+        {
+            const uint32_t empty_after = Group(ctrl + slot).match(empty_slot);
+            const uint32_t empty_before = Group(ctrl + ((slot - group_width) & (size - 1))).match(empty_slot);
+            return empty_after && empty_before &&
+                std::countr_zero(empty_after) + std::countl_zero(empty_before << (32 - group_width)) < group_width;
+        }
+
+        size_t group_mask() const
+        {
+            return size / group_width - 1;
+        }
+
+        // calls f with every element whose hash starts its probe in the group. Probes from its 16 slots
+        // cover 31 slots at every step, and one ends (as find() would) once the 16 it looks at hold an
+        // empty slot
+        template <typename F>
+        void scan_group(const size_t group, F& f) const
+        {
+            const size_t mask = size - 1;
+            std::vector<size_t> found;
+            // the probes that haven't ended, a bit for each slot of the group
+            uint32_t open = (1u << group_width) - 1;
+            for (size_t step = 0, offset = 0; open; step += group_width, offset += step)
+            {
+                const size_t start = (group * group_width + offset) & mask;
+                for (size_t i = 0; i < 2 * group_width - 1; i++)
+                {
+                    const size_t slot = (start + i) & mask;
+                    if (is_full(ctrl[slot]) && (hashes[slot] & mask) / group_width == group)
+                    {
+                        found.push_back(slot);
+                    }
+                }
+                const uint32_t empty = Group(ctrl + start).match(empty_slot) |
+                    Group(ctrl + ((start + group_width) & mask)).match(empty_slot) << group_width;
+                for (uint32_t left = open; left; left &= left - 1)
+                {
+                    const int home = std::countr_zero(left);
+                    if (empty >> home & ((1u << group_width) - 1))
+                    {
+                        open &= ~(1u << home);
+                    }
+                }
+            }
+            // probes of small arrays wrap around onto the slots they've already been through
+            std::ranges::sort(found);
+            const auto [first, last] = std::ranges::unique(found);
+            found.erase(first, last);
+            for (const size_t slot : found)
+            {
+                f(static_cast<const Node&>(*nodes[slot]));
+            }
+        }
+
+        size_t next_full(size_t slot) const
+        {
+            while (slot < size && !is_full(ctrl[slot]))
+            {
+                slot++;
+            }
+            return slot;
+        }
+
+        void destroy()
+        {
+            for (size_t slot = next_full(0); slot < size; slot = next_full(slot + 1))
+            {
+                free_node(nodes[slot]);
+            }
+            deallocate(Use, block);
+        }
+    };
+
+    Slots current;
+    // the array the table is growing out of, empty when it isn't growing
+    Slots old;
+    // the old array's slots before this one have been moved
+    size_t moved = 0;
+    size_t count = 0;
+    // inserts into empty slots left before the current array is 7/8 full
+    size_t growth_left = 0;
+
+    Node* node(const size_t slot) const
+    {
+        return slot < current.size ? current.nodes[slot] : old.nodes[slot - current.size];
+    }
+
+    size_t next_full(const size_t slot) const
+    {
+        if (slot < current.size)
+        {
+            if (const size_t next = current.next_full(slot); next < current.size)
+            {
+                return next;
+            }
+        }
+        return current.size + old.next_full(slot < current.size ? 0 : slot - current.size);
+    }
+
+    size_t find_slot(const std::string_view key, const size_t hash) const
+    {
+        if (const size_t slot = current.find(key, hash); slot != current.size)
+        {
+            return slot;
+        }
+        return rehashing() ? current.size + old.find(key, hash) : current.size;
+    }
+
+    // starts growing the table, or only clearing out the deleted slots when there are enough of them:
+    // keys that are deleted as others are added (as with eviction) then don't grow the table
+    void make_room()
+    {
+        // the last growth hasn't finished, which only happens when few inserts were spread over many slots
+        while (rehash(old.size))
+        {
+        }
+        const size_t size = current.size == 0 ? min_capacity :
+            count * 32 <= current.size * 25 ? current.size : 2 * current.size;
+        old = current;
+        current = Slots::make(size);
+        growth_left = max_load(size) - count;
+        rehash(old.size <= small_size ? old.size : insert_steps);
+    }
+
+    // the cursor after this one, counting up in reverse from the top bit of the mask
+    static size_t next_cursor(size_t cursor, const size_t mask)
+    {
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor) + 1;
+        return reverse_bits(cursor);
+    }
+
+    static uint64_t reverse_bits(uint64_t bits)
+    {
+        bits = (bits >> 1 & 0x5555555555555555) | (bits & 0x5555555555555555) << 1;
+        bits = (bits >> 2 & 0x3333333333333333) | (bits & 0x3333333333333333) << 2;
+        bits = (bits >> 4 & 0x0f0f0f0f0f0f0f0f) | (bits & 0x0f0f0f0f0f0f0f0f) << 4;
+        return std::byteswap(bits);
+    }
+
+    static size_t max_load(const size_t capacity)
+    {
+        return capacity - capacity / 8;
+    }
+
+    template <typename... Args>
+    static Node* make_node(const std::string_view key, Args&&... args)
+    {
+        unsigned char prefix[10];
+        size_t prefix_size = 0;
+        size_t size = key.size();
+        for (; size >= 0x80; size >>= 7)
+        {
+            prefix[prefix_size++] = static_cast<unsigned char>(size | 0x80);
+        }
+        prefix[prefix_size++] = static_cast<unsigned char>(size);
+        char* bytes = static_cast<char*>(allocate(Use, sizeof(Node) + prefix_size + key.size()));
+        Node* node = new (bytes) Node{V(std::forward<Args>(args)...)};
+        std::memcpy(bytes + sizeof(Node), prefix, prefix_size);
+        std::memcpy(bytes + sizeof(Node) + prefix_size, key.data(), key.size());
+        return node;
+    }
+
+    static void free_node(Node* node)
+    {
+        node->~Node();
+        deallocate(Use, node);
+    }
+};
+
+#endif //HASH_TABLE_H
@@ -0,0 +1,203 @@
+#include "Lzf.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+constexpr size_t max_literals = 32;
+constexpr size_t max_offset = 1 << 13;
+constexpr size_t max_reference = (1 << 8) + (1 << 3);
+constexpr unsigned hash_bits = 16;
+
+// the hash of the 3 bytes at a position picks a slot that remembers where they were last seen
+size_t hash_slot(const uint32_t bytes)
+{
+    return ((bytes >> (3 * 8 - hash_bits)) - bytes * 5) & ((1 << hash_bits) - 1);
+}
+
+size_t lzf_compress(const std::string_view in_view, char* out_chars, const size_t out_size)
+{
+    // the slots hold offsets into the input and aren't cleared between calls: a stale one is only used
+    // when its bytes match, so it can only find a match a clean table wouldn't have
+    thread_local const std::unique_ptr<uint32_t[]> last_seen = std::make_unique<uint32_t[]>(1 << hash_bits);
+    const auto* in = reinterpret_cast<const unsigned char*>(in_view.data());
+    auto* out = reinterpret_cast<unsigned char*>(out_chars);
+    const size_t in_size = in_view.size();
+    if (in_size < 3 || out_size == 0)
+    {
+        return 0;
+    }
+
+    // op is where the next byte goes; a literal run's length byte is written once the run ends
+    size_t ip = 0;
+    size_t op = 1;
+    size_t literals = 0;
+    const auto end_run = [&]
+    {
+        out[op - literals - 1] = static_cast<unsigned char>(literals - 1);
+    };
+    uint32_t bytes = in[0] << 8 | in[1];
+    while (ip < in_size - 2)
+    {
+        bytes = (bytes << 8 | in[ip + 2]) & 0xffffff;
+        uint32_t& seen = last_seen[hash_slot(bytes)];
+        const size_t ref = seen;
+        seen = static_cast<uint32_t>(ip);
+        if (ref < ip && ref > 0 && ip - ref - 1 < max_offset && std::memcmp(in + ref, in + ip, 3) == 0)
+        {
+            // a back reference takes 3 bytes at most, after the run before it
+            if (op + 3 + 1 >= out_size && op - !literals + 3 + 1 >= out_size)
+            {
+                return 0;
+            }
+            if (literals)
+            {
+                end_run();
+            }
+            else
+            {
+                op--;
+            }
+            const size_t max_len = std::min(in_size - ip, max_reference);
+            size_t len = 3;
+            while (len < max_len && in[ref + len] == in[ip + len])
+            {
+                len++;
+            }
+            const size_t offset = ip - ref - 1;
+            const size_t code = len - 2;
+            if (code < 7)
+            {
+                out[op++] = static_cast<unsigned char>((offset >> 8) + (code << 5));
+            }
+            else
+            {
+                out[op++] = static_cast<unsigned char>((offset >> 8) + (7 << 5));
+                out[op++] = static_cast<unsigned char>(code - 7);
+            }
+            out[op++] = static_cast<unsigned char>(offset);
+            // a new run starts
+            literals = 0;
+            op++;
+            ip += len;
+            if (ip >= in_size - 2)
+            {
+                break;
+            }
+            // the position before the next one goes in the table too, the next loop adds its own
+            bytes = in[ip - 1] << 16 | in[ip] << 8 | in[ip + 1];
+            last_seen[hash_slot(bytes)] = static_cast<uint32_t>(ip - 1);
+            bytes &= 0xffff;
+            continue;
+        }
+        if (op >= out_size)
+        {
+            return 0;
+        }
+        literals++;
+        out[op++] = in[ip++];
+        if (literals == max_literals)
+        {
+            end_run();
+            literals = 0;
+            op++;
+        }
+    }
+
+    if (op + 3 > out_size)
+    {
+        return 0;
+    }
+    while (ip < in_size)
+    {
+        literals++;
+        out[op++] = in[ip++];
+        if (literals == max_literals)
+        {
+            end_run();
+            literals = 0;
+            op++;
+        }
+    }
+    if (literals)
+    {
+        end_run();
+    }
+    else
+    {
+        op--;
+    }
+    return op;
+}
+
+bool lzf_decompress(const std::string_view in_view, char* out_chars, const size_t out_size)
+{
+    const auto* in = reinterpret_cast<const unsigned char*>(in_view.data());
+    auto* out = reinterpret_cast<unsigned char*>(out_chars);
+    const size_t in_size = in_view.size();
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < in_size)
+    {
+        const size_t control = in[ip++];
+        if (control < max_literals)
+        {
+            const size_t len = control + 1;
+            if (ip + len > in_size || op + len > out_size)
+            {
+                return false;
+            }
+            // short runs are copied 16 bytes at once while there's room, past the run's end
+            if (len <= 16 && ip + 16 <= in_size && op + 16 <= out_size)
+            {
+                std::memcpy(out + op, in + ip, 16);
+            }
+            else
+            {
+                std::memcpy(out + op, in + ip, len);
+            }
+            ip += len;
+            op += len;
+            continue;
+        }
+        size_t len = control >> 5;
+        if (len == 7)
+        {
+            if (ip >= in_size)
+            {
+                return false;
+            }
+            len += in[ip++];
+        }
+        if (ip >= in_size)
+        {
+            return false;
+        }
+        const size_t back = ((control & 0x1f) << 8 | in[ip++]) + 1;
+        len += 2;
+        if (back > op || op + len > out_size)
+        {
+            return false;
+        }
+        const unsigned char* ref = out + op - back;
+        if (back >= 8 && op + len + 8 <= out_size)
+        {
+            // 8 bytes at a time, each from before where it goes
+            for (size_t i = 0; i < len; i += 8)
+            {
+                std::memcpy(out + op + i, ref + i, 8);
+            }
+            op += len;
+            continue;
+        }
+        // a reference closer than its length repeats the last back bytes, a copy of them at a time
+        for (; len > back; len -= back)
+        {
+            std::memcpy(out + op, ref, back);
+            op += back;
+        }
+        std::memcpy(out + op, ref, len);
+        op += len;
+    }
+    return op == out_size;
+}
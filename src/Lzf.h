@@ -0,0 +1,16 @@
+#ifndef LZF_H
+#define LZF_H
+
+#include <cstddef>
+#include <string_view>
+
+// LZF, the compression Redis uses for the strings of RDB files, in the format of liblzf: runs of up to 32
+// literal bytes, and back references of 3 to 264 bytes up to 8 KB back. Both sides write into a buffer
+// the caller sized, and never past its end
+
+// the compressed size, 0 when the result doesn't fit in out_size bytes (as when in doesn't compress)
+size_t lzf_compress(std::string_view in, char* out, size_t out_size);
+// false unless in is well formed and decompresses to exactly out_size bytes
+bool lzf_decompress(std::string_view in, char* out, size_t out_size);
+
+#endif //LZF_H
@@ -0,0 +1,253 @@
+#include "Memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <malloc.h>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// how far a thread's count may drift before it's added to the total
+constexpr long long flush_threshold = 64 * 1024;
+
+std::atomic<long long> total_used{0};
+std::atomic<long long> peak_used{0};
+std::atomic<long long> total_use[Use_count];
+size_t startup_used = 0;
+thread_local long long unflushed = 0;
+thread_local long long unflushed_use[Use_count];
+
+void flush()
+{
+    const long long total = total_used.fetch_add(unflushed, std::memory_order_relaxed) + unflushed;
+    unflushed = 0;
+    // the peak only moves when a thread's difference is added, which is precise enough for it
+    long long peak = peak_used.load(std::memory_order_relaxed);
+    while (total > peak && !peak_used.compare_exchange_weak(peak, total, std::memory_order_relaxed))
+    {
+    }
+}
+
+void count(const long long bytes)
+{
+    unflushed += bytes;
+    if (unflushed > flush_threshold || unflushed < -flush_threshold)
+    {
+        flush();
+    }
+}
+
+void count(const Memory_use use, const long long bytes)
+{
+    count(bytes);
+    long long& pending = unflushed_use[use];
+    pending += bytes;
+    if (pending > flush_threshold || pending < -flush_threshold)
+    {
+        total_use[use].fetch_add(pending, std::memory_order_relaxed);
+        pending = 0;
+    }
+}
+
+void* allocate(const size_t size)
+{
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    count(static_cast<long long>(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void* allocate(const size_t size, const std::align_val_t align)
+{
+    void* ptr = std::aligned_alloc(static_cast<size_t>(align),
+                                   (size + static_cast<size_t>(align) - 1) & ~(static_cast<size_t>(align) - 1));
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    count(static_cast<long long>(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void deallocate(void* ptr) noexcept
+{
+    if (ptr)
+    {
+        count(-static_cast<long long>(malloc_usable_size(ptr)));
+        std::free(ptr);
+    }
+}
+
+void* allocate(const Memory_use use, const size_t size)
+{
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    count(use, static_cast<long long>(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void* allocate_zeroed(const Memory_use use, const size_t size)
+{
+    void* ptr = std::calloc(size ? size : 1, 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    count(use, static_cast<long long>(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void deallocate(const Memory_use use, void* ptr) noexcept
+{
+    if (ptr)
+    {
+        count(use, -static_cast<long long>(malloc_usable_size(ptr)));
+        std::free(ptr);
+    }
+}
+
+void release_pages(void* begin, void* end) noexcept
+{
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t from = (reinterpret_cast<uintptr_t>(begin) + page_size - 1) & ~(page_size - 1);
+    const uintptr_t to = reinterpret_cast<uintptr_t>(end) & ~(page_size - 1);
+    if (from < to)
+    {
+        madvise(reinterpret_cast<void*>(from), to - from, MADV_DONTNEED);
+    }
+}
+
+size_t used_memory()
+{
+    // this thread's own count is exact, so whoever frees memory sees it go down right away
+    const long long used = total_used.load(std::memory_order_relaxed) + unflushed;
+    return used > 0 ? static_cast<size_t>(used) : 0;
+}
+
+size_t used_memory(const Memory_use use)
+{
+    const long long used = total_use[use].load(std::memory_order_relaxed) + unflushed_use[use];
+    return used > 0 ? static_cast<size_t>(used) : 0;
+}
+
+size_t peak_memory()
+{
+    return std::max<size_t>(peak_used.load(std::memory_order_relaxed), used_memory());
+}
+
+void record_startup_memory()
+{
+    startup_used = used_memory();
+}
+
+size_t startup_memory()
+{
+    return startup_used;
+}
+
+size_t rss_memory()
+{
+    // the second field of statm is the resident page count
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t block_size(const void* ptr)
+{
+    return malloc_usable_size(const_cast<void*>(ptr));
+}
+
+size_t allocation_size(const size_t size)
+{
+    // glibc's chunks: the size and a header word rounded up to 16 bytes, at least 32, less the header
+    return std::max<size_t>(32, (size + sizeof(size_t) + 15) & ~size_t{15}) - sizeof(size_t);
+}
+
+void* operator new(const size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](const size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new(const size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](const size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void* operator new(const size_t size, const std::align_val_t align)
+{
+    return allocate(size, align);
+}
+
+void* operator new[](const size_t size, const std::align_val_t align)
+{
+    return allocate(size, align);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t, const std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t, const std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
@@ -0,0 +1,78 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <cstddef>
+#include <new>
+
+// bytes held through operator new, counted as malloc sizes the blocks. Threads keep a small running
+// difference of their own and only add it to the total once it passes a threshold, so the count can
+// be off by that much for every other thread
+size_t used_memory();
+size_t peak_memory();
+// the memory used once the server has started, before it holds any data
+void record_startup_memory();
+size_t startup_memory();
+// resident set size, as the kernel reports it
+size_t rss_memory();
+// what malloc would hand out for a request of size bytes, for sizing what isn't allocated on its own
+size_t allocation_size(size_t size);
+// the size of a block malloc handed out
+size_t block_size(const void* ptr);
+
+// what the memory holding the data is used for; each is counted on its own too, the same way
+enum Memory_use
+{
+    Use_keyspace,   // the shards' tables, with the keys and their entries
+    Use_strings,    // string values too long to be held in their entry
+    Use_lists,
+    Use_zsets,
+    Use_streams,
+    Use_count
+};
+
+size_t used_memory(Memory_use use);
+void* allocate(Memory_use use, size_t size);
+// zero filled, without touching the pages of big blocks
+void* allocate_zeroed(Memory_use use, size_t size);
+void deallocate(Memory_use use, void* ptr) noexcept;
+// gives the whole pages between begin and end back to the kernel, so freeing the block later is quick.
+// They read as zeros afterwards; the block stays counted until it's freed
+void release_pages(void* begin, void* end) noexcept;
+
+// an allocator for the containers of one use
+template <typename T, Memory_use Use>
+struct Use_allocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = Use_allocator<U, Use>;
+    };
+
+    Use_allocator() = default;
+
+    template <typename U>
+    Use_allocator(const Use_allocator<U, Use>&)
+    {
+    }
+
+    T* allocate(const size_t n)
+    {
+        return static_cast<T*>(::allocate(Use, n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) noexcept
+    {
+        ::deallocate(Use, ptr);
+    }
+
+    template <typename U>
+    bool operator==(const Use_allocator<U, Use>&) const
+    {
+        return true;
+    }
+};
+
+#endif //MEMORY_H
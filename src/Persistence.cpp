@@ -0,0 +1,1790 @@
+#include "Persistence.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Clock.h"
+#include "Database.h"
+#include "Lzf.h"
+#include "Memory.h"
+#include "Replication.h"
+
+enum Rdb_type : unsigned char
+{
+    Rdb_string = 0,
+    Rdb_list = 1,
+    Rdb_zset_2 = 5,
+    Rdb_stream_listpacks = 15,
+    Rdb_zset_listpack = 17,
+    Rdb_list_quicklist_2 = 18,
+    Rdb_stream_listpacks_2 = 19,
+    Rdb_stream_listpacks_3 = 21
+};
+
+enum Rdb_opcode : unsigned char
+{
+    Rdb_aux = 0xFA,
+    Rdb_resize_db = 0xFB,
+    Rdb_expiry_ms = 0xFC,
+    Rdb_expiry_sec = 0xFD,
+    Rdb_select_db = 0xFE,
+    Rdb_eof = 0xFF
+};
+
+// the flags of a stream entry
+constexpr long long stream_deleted = 1;
+constexpr long long stream_same_fields = 2;
+// entries per listpack of a stream, Redis's stream-node-max-entries
+constexpr size_t stream_node_entries = 100;
+
+// CRC-64/Jones, reflected, as Redis checksums its files with
+constexpr std::array<uint64_t, 256> crc_table = []
+{
+    std::array<uint64_t, 256> table{};
+    for (uint64_t i = 0; i < 256; i++)
+    {
+        uint64_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 1 ? crc >> 1 ^ 0x95ac9329ac4bc9b5 : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+uint64_t crc64(uint64_t crc, const std::string_view bytes)
+{
+    for (const char c : bytes)
+    {
+        crc = crc_table[(crc ^ static_cast<unsigned char>(c)) & 0xff] ^ crc >> 8;
+    }
+    return crc;
+}
+
+// signed, of 1 to 8 bytes
+long long read_little_endian(const unsigned char* bytes, const size_t size)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        n |= static_cast<uint64_t>(bytes[i]) << 8 * i;
+    }
+    const unsigned shift = 64 - 8 * size;
+    return static_cast<long long>(n << shift) >> shift;
+}
+
+uint64_t read_big_endian(const unsigned char* bytes, const size_t size)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        n = n << 8 | bytes[i];
+    }
+    return n;
+}
+
+// a listpack entry is followed by its own size, 7 bits to a byte, so the list can be walked backwards
+size_t back_length_size(const size_t entry_size)
+{
+    return entry_size <= 127 ? 1 : entry_size < 16383 ? 2 : entry_size < 2097151 ? 3 : entry_size < 268435455 ? 4 : 5;
+}
+
+// strings longer than this are compressed, unless rdbcompression is no
+size_t compression_threshold()
+{
+    static const size_t threshold = get_config("rdbcompression") == "no" ? SIZE_MAX :
+        std::strtoull(get_config("rdb-compression-threshold").c_str(), nullptr, 10);
+    return threshold;
+}
+
+// where a snapshot goes as it's written, a chunk at a time; false stops the writing
+typedef std::function<bool(std::string_view chunk)> Rdb_sink;
+
+// appends the encodings to a buffer, which is handed to the sink whenever it fills up
+class Rdb_writer
+{
+public:
+    explicit Rdb_writer(Rdb_sink sink) : sink(std::move(sink))
+    {
+    }
+
+    void byte(const unsigned char b)
+    {
+        buffer += static_cast<char>(b);
+    }
+
+    void bytes(const std::string_view b)
+    {
+        buffer += b;
+    }
+
+    void little_endian(const uint64_t n, const size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            byte(n >> 8 * i & 0xff);
+        }
+    }
+
+    // 6 or 14 bits, or a marker byte then 32 or 64 bits big endian
+    void length(const uint64_t n)
+    {
+        if (n < 1 << 6)
+        {
+            byte(n);
+        }
+        else if (n < 1 << 14)
+        {
+            byte(0x40 | n >> 8);
+            byte(n & 0xff);
+        }
+        else
+        {
+            const size_t size = n <= UINT32_MAX ? 4 : 8;
+            byte(size == 4 ? 0x80 : 0x81);
+            for (size_t i = size; i-- > 0;)
+            {
+                byte(n >> 8 * i & 0xff);
+            }
+        }
+    }
+
+    // LZF compressed as Redis does it, when it's longer than the threshold and that saves more than 4
+    // bytes: a marker, the compressed length, the length and the compressed bytes
+    void string(const std::string_view str)
+    {
+        if (str.size() > compress_above && str.size() > 4)
+        {
+            if (compressed_size < str.size())
+            {
+                compressed_size = str.size();
+                compressed = std::make_unique_for_overwrite<char[]>(compressed_size);
+            }
+            if (const size_t size = lzf_compress(str, compressed.get(), str.size() - 4))
+            {
+                byte(0xC3);
+                length(size);
+                length(str.size());
+                return bytes({compressed.get(), size});
+            }
+        }
+        length(str.size());
+        bytes(str);
+    }
+
+    // a string holding the integer: in 1, 2 or 4 bytes when it fits, as its digits otherwise
+    void integer(const long long n)
+    {
+        for (unsigned char encoding = 0; encoding < 3; encoding++)
+        {
+            const size_t size = 1 << encoding;
+            if (n >= -(1LL << (8 * size - 1)) && n < 1LL << (8 * size - 1))
+            {
+                byte(0xC0 | encoding);
+                return little_endian(n, size);
+            }
+        }
+        string(std::to_string(n));
+    }
+
+    // false once the sink failed
+    bool flush_if_full()
+    {
+        return buffer.size() < flush_size || flush();
+    }
+
+    // the end marker, then the checksum of everything before it
+    bool finish()
+    {
+        byte(Rdb_eof);
+        crc = crc64(crc, buffer);
+        little_endian(crc, 8);
+        return write_out();
+    }
+
+private:
+    static constexpr size_t flush_size = 64 * 1024;
+
+    Rdb_sink sink;
+    std::string buffer;
+    uint64_t crc = 0;
+    size_t compress_above = compression_threshold();
+    std::unique_ptr<char[]> compressed;
+    size_t compressed_size = 0;
+
+    bool flush()
+    {
+        crc = crc64(crc, buffer);
+        return write_out();
+    }
+
+    bool write_out()
+    {
+        const bool written = sink(buffer);
+        buffer.clear();
+        return written;
+    }
+};
+
+// a listpack, as streams are kept in: a header with the size in bytes and the number of elements, the
+// elements (each followed by its own size) and an end byte. Integers go in the smallest encoding of
+// 7, 13, 16, 24, 32 or 64 bits
+class Listpack
+{
+public:
+    void integer(const long long n)
+    {
+        const size_t start = bytes.size();
+        if (n >= 0 && n < 128)
+        {
+            bytes += static_cast<char>(n);
+        }
+        else if (n >= -4096 && n < 4096)
+        {
+            bytes += static_cast<char>(0xC0 | (n >> 8 & 0x1F));
+            bytes += static_cast<char>(n & 0xff);
+        }
+        else
+        {
+            constexpr std::pair<unsigned char, size_t> encodings[] = {{0xF1, 2}, {0xF2, 3}, {0xF3, 4}, {0xF4, 8}};
+            for (const auto& [encoding, size] : encodings)
+            {
+                if (size == 8 || (n >= -(1LL << (8 * size - 1)) && n < 1LL << (8 * size - 1)))
+                {
+                    bytes += static_cast<char>(encoding);
+                    for (size_t i = 0; i < size; i++)
+                    {
+                        bytes += static_cast<char>(static_cast<uint64_t>(n) >> 8 * i & 0xff);
+                    }
+                    break;
+                }
+            }
+        }
+        end_entry(start);
+    }
+
+    void string(const std::string_view str)
+    {
+        const size_t start = bytes.size();
+        if (str.size() < 64)
+        {
+            bytes += static_cast<char>(0x80 | str.size());
+        }
+        else if (str.size() < 4096)
+        {
+            bytes += static_cast<char>(0xE0 | str.size() >> 8);
+            bytes += static_cast<char>(str.size() & 0xff);
+        }
+        else
+        {
+            bytes += static_cast<char>(0xF0);
+            for (size_t i = 0; i < 4; i++)
+            {
+                bytes += static_cast<char>(str.size() >> 8 * i & 0xff);
+            }
+        }
+        bytes += str;
+        end_entry(start);
+    }
+
+    std::string finish()
+    {
+        bytes += static_cast<char>(0xFF);
+        for (size_t i = 0; i < 4; i++)
+        {
+            bytes[i] = static_cast<char>(bytes.size() >> 8 * i & 0xff);
+        }
+        // past 65534 elements the count is left unknown
+        const size_t stored = std::min<size_t>(count, 65535);
+        bytes[4] = static_cast<char>(stored & 0xff);
+        bytes[5] = static_cast<char>(stored >> 8);
+        return std::move(bytes);
+    }
+
+private:
+    std::string bytes = std::string(6, '\0');
+    size_t count = 0;
+
+    void end_entry(const size_t start)
+    {
+        const size_t size = bytes.size() - start;
+        const size_t n = back_length_size(size);
+        for (size_t i = 0; i < n; i++)
+        {
+            const size_t shift = 7 * (n - 1 - i);
+            bytes += static_cast<char>((size >> shift & 127) | (i > 0 ? 128 : 0));
+        }
+        count++;
+    }
+};
+
+// the elements of a listpack, integers as their digits; false when it's cut short or malformed
+bool read_listpack(const std::string_view lp, std::vector<std::string>& elements)
+{
+    elements.clear();
+    const auto* bytes = reinterpret_cast<const unsigned char*>(lp.data());
+    size_t at = 6;
+    while (at < lp.size() && bytes[at] != 0xFF)
+    {
+        const unsigned char b = bytes[at];
+        // the bytes before the data, and the integer's size (0 for strings)
+        size_t header = 1;
+        size_t int_size = 0;
+        if ((b & 0xE0) == 0xC0 || (b & 0xF0) == 0xE0)
+        {
+            header = 2;
+        }
+        else if (b == 0xF0)
+        {
+            header = 5;
+        }
+        else if (b >= 0xF1 && b <= 0xF4)
+        {
+            int_size = b == 0xF4 ? 8 : b - 0xEF;
+        }
+        else if (b > 0xF4)
+        {
+            return false;
+        }
+        if (at + header + int_size > lp.size())
+        {
+            return false;
+        }
+
+        const unsigned char* data = bytes + at + header;
+        size_t size = 0;
+        std::optional<long long> n;
+        if (b < 0x80)
+        {
+            n = b;
+        }
+        else if ((b & 0xC0) == 0x80)
+        {
+            size = b & 0x3F;
+        }
+        else if ((b & 0xE0) == 0xC0)
+        {
+            const long long v = (b & 0x1F) << 8 | bytes[at + 1];
+            n = v >= 1 << 12 ? v - (1 << 13) : v;
+        }
+        else if ((b & 0xF0) == 0xE0)
+        {
+            size = (b & 0x0F) << 8 | bytes[at + 1];
+        }
+        else if (b == 0xF0)
+        {
+            size = read_little_endian(bytes + at + 1, 4) & 0xffffffff;
+        }
+        else
+        {
+            n = read_little_endian(data, int_size);
+            size = int_size;
+        }
+        if (at + header + size > lp.size())
+        {
+            return false;
+        }
+        elements.push_back(n ? std::to_string(*n) : std::string(reinterpret_cast<const char*>(data), size));
+        at += header + size + back_length_size(header + size);
+    }
+    return at < lp.size();
+}
+
+// the bytes of a snapshot, with every read checked against the end. Either all of them are there (a
+// mapped file, or one record of it) or they're read off a stream as the parser asks for them, and then
+// kept until forget() so a whole record can be handed on. A read past the end returns nothing and
+// leaves the reader failed, which the parser checks once a record
+class Rdb_reader
+{
+public:
+    explicit Rdb_reader(const std::string_view bytes) : begin(bytes.data()), at(begin), end(begin + bytes.size())
+    {
+    }
+
+    explicit Rdb_reader(std::streambuf* stream) : stream(stream)
+    {
+    }
+
+    bool ok() const
+    {
+        return !failed;
+    }
+
+    // n bytes, valid until the next read of a stream; empty once the reader failed
+    std::string_view bytes(const size_t n)
+    {
+        if (failed)
+        {
+            return {};
+        }
+        if (stream)
+        {
+            return read_stream(n);
+        }
+        if (n > static_cast<size_t>(end - at))
+        {
+            failed = true;
+            at = end;
+            return {};
+        }
+        const std::string_view read(at, n);
+        at += n;
+        return read;
+    }
+
+    unsigned char byte()
+    {
+        const std::string_view read = bytes(1);
+        return read.empty() ? 0 : read[0];
+    }
+
+    // up to 8 bytes, zeros when there aren't that many
+    const unsigned char* fixed(const size_t n)
+    {
+        const std::string_view read = bytes(n);
+        return read.empty() ? zeros : reinterpret_cast<const unsigned char*>(read.data());
+    }
+
+    // where the next read starts, from the start of the bytes or, for a stream, the last forget()
+    size_t offset() const
+    {
+        return stream ? kept.size() : at - begin;
+    }
+
+    // what was read from offset on
+    std::string_view since(const size_t from) const
+    {
+        return stream ? std::string_view(kept).substr(from) : std::string_view(begin + from, at);
+    }
+
+    void forget()
+    {
+        kept.clear();
+    }
+
+    // for bytes that can't be read as what they should be
+    void fail()
+    {
+        failed = true;
+    }
+
+private:
+    static constexpr unsigned char zeros[8] = {};
+
+    const char* begin = nullptr;
+    const char* at = nullptr;
+    const char* end = nullptr;
+    std::streambuf* stream = nullptr;
+    std::string kept;
+    bool failed = false;
+
+    std::string_view read_stream(const size_t n)
+    {
+        // the size comes from the stream, so the buffer only grows as the bytes come in
+        const size_t from = kept.size();
+        while (kept.size() - from < n)
+        {
+            const size_t start = kept.size();
+            const size_t chunk = std::min<size_t>(n - (start - from), 1 << 20);
+            kept.resize(start + chunk);
+            if (stream->sgetn(kept.data() + start, static_cast<std::streamsize>(chunk)) !=
+                static_cast<std::streamsize>(chunk))
+            {
+                failed = true;
+                return {};
+            }
+        }
+        return std::string_view(kept).substr(from);
+    }
+};
+
+enum Special_type
+{
+    None,
+    Byte,
+    TwoByte,
+    FourByte,
+    Compressed
+};
+
+Special_type read_length(Rdb_reader& rdb, uint64_t& val)
+{
+    const unsigned char byte = rdb.byte();
+    switch (byte & 0xC0)
+    {
+    case 0x00:
+        val = byte & 0x3F;
+        return None;
+    case 0x80:
+        {
+            // 0x80 takes 32 bits, 0x81 64
+            const size_t size = byte == 0x81 ? 8 : 4;
+            val = read_big_endian(rdb.fixed(size), size);
+            return None;
+        }
+    case 0x40:
+        val = rdb.byte() + ((byte & 0x3F) << 8);
+        return None;
+    default:
+        switch (byte & 0x3F)
+        {
+        case 0:
+            val = 1;
+            return Byte;
+        case 1:
+            val = 2;
+            return TwoByte;
+        case 2:
+            val = 4;
+            return FourByte;
+        case 3:
+            // the compressed and the uncompressed lengths follow
+            val = 0;
+            return Compressed;
+        default:
+            val = 0;
+            rdb.fail();
+            return None;
+        }
+    }
+}
+
+// a back reference of 3 bytes stands for at most this many
+constexpr uint64_t max_lzf_ratio = 88;
+
+// a string's bytes; integers are formatted and compressed strings decompressed into buffer, which the
+// result then points to
+std::string_view read_string(Rdb_reader& rdb, std::string& buffer)
+{
+    switch (uint64_t len; read_length(rdb, len))
+    {
+    case None:
+        return rdb.bytes(len);
+    case Byte:
+    case TwoByte:
+    case FourByte:
+        buffer = std::to_string(read_little_endian(rdb.fixed(len), len));
+        return buffer;
+    case Compressed:
+        {
+            uint64_t compressed_len;
+            read_length(rdb, compressed_len);
+            read_length(rdb, len);
+            const std::string_view compressed = rdb.bytes(compressed_len);
+            // the length is checked before the buffer is sized for it
+            bool decompressed = rdb.ok() && len <= compressed_len * max_lzf_ratio;
+            if (decompressed)
+            {
+                buffer.resize(len);
+                decompressed = lzf_decompress(compressed, buffer.data(), len);
+            }
+            if (!decompressed)
+            {
+                rdb.fail();
+                return {};
+            }
+            return buffer;
+        }
+    }
+    return {};
+}
+
+// compressed strings aren't decompressed
+void skip_string(Rdb_reader& rdb)
+{
+    uint64_t len;
+    if (read_length(rdb, len) == Compressed)
+    {
+        read_length(rdb, len);
+        uint64_t skipped;
+        read_length(rdb, skipped);
+    }
+    rdb.bytes(len);
+}
+
+void add_member(Sorted_set& zset, const std::string_view member, const double score)
+{
+    if (zset.scores.try_emplace(member, score).second)
+    {
+        zset.set.emplace(score, Counted_string<Use_zsets>(member));
+    }
+}
+
+bool read_list(Rdb_reader& rdb, const unsigned char type, List& list)
+{
+    uint64_t n;
+    read_length(rdb, n);
+    std::string buffer;
+    std::vector<std::string> elements;
+    for (uint64_t i = 0; i < n && rdb.ok(); i++)
+    {
+        // a quicklist's nodes are listpacks (2), or single elements (1) too big for one
+        uint64_t container = 1;
+        if (type == Rdb_list_quicklist_2)
+        {
+            read_length(rdb, container);
+        }
+        if (container != 2)
+        {
+            list.emplace_back(read_string(rdb, buffer));
+        }
+        else if (read_listpack(read_string(rdb, buffer), elements))
+        {
+            list.insert(list.end(), elements.begin(), elements.end());
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return rdb.ok();
+}
+
+bool read_zset(Rdb_reader& rdb, const unsigned char type, Sorted_set& zset)
+{
+    std::string buffer;
+    if (type == Rdb_zset_listpack)
+    {
+        std::vector<std::string> elements;
+        if (!read_listpack(read_string(rdb, buffer), elements) || elements.size() % 2 != 0)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < elements.size(); i += 2)
+        {
+            add_member(zset, elements[i], std::strtod(elements[i + 1].c_str(), nullptr));
+        }
+        return rdb.ok();
+    }
+    uint64_t n;
+    read_length(rdb, n);
+    for (uint64_t i = 0; i < n && rdb.ok(); i++)
+    {
+        const std::string_view member = read_string(rdb, buffer);
+        add_member(zset, member, std::bit_cast<double>(read_little_endian(rdb.fixed(8), 8)));
+    }
+    return rdb.ok();
+}
+
+// the entries are in listpacks of up to stream_node_entries, keyed by the ID the entries' IDs are
+// relative to. Each starts with the entry count, the deleted count and the fields of its first entry
+// (the master entry), then every entry has its flags, its ID relative to the master, its fields (left
+// out when they're the master's) with their values, and the number of listpack elements it took
+bool read_stream(Rdb_reader& rdb, const unsigned char type, Stream& stream)
+{
+    uint64_t nodes;
+    read_length(rdb, nodes);
+    std::string buffer;
+    std::vector<std::string> lp;
+    for (uint64_t node = 0; node < nodes; node++)
+    {
+        const std::string master_id(read_string(rdb, buffer));
+        if (master_id.size() != 16 || !read_listpack(read_string(rdb, buffer), lp))
+        {
+            return false;
+        }
+        const auto* id = reinterpret_cast<const unsigned char*>(master_id.data());
+        const uint64_t master_ms = read_big_endian(id, 8);
+        const uint64_t master_seq = read_big_endian(id + 8, 8);
+        try
+        {
+            size_t at = 0;
+            const auto next = [&]() -> const std::string& { return lp.at(at++); };
+            const auto number = [&] { return std::stoll(next()); };
+            const long long count = number();
+            const long long deleted = number();
+            std::vector<std::string> master_fields(number());
+            for (std::string& field : master_fields)
+            {
+                field = next();
+            }
+            next();
+            for (long long i = 0; i < count + deleted; i++)
+            {
+                const long long flags = number();
+                Stream_entry entry{};
+                entry.milliseconds_time = master_ms + number();
+                entry.sequence_number = master_seq + number();
+                if (flags & stream_same_fields)
+                {
+                    for (const std::string& field : master_fields)
+                    {
+                        entry.key_vals.emplace(std::string_view(field), std::string_view(next()));
+                    }
+                }
+                else
+                {
+                    for (long long fields = number(); fields > 0; fields--)
+                    {
+                        const std::string& field = next();
+                        entry.key_vals.emplace(std::string_view(field), std::string_view(next()));
+                    }
+                }
+                next();
+                if (!(flags & stream_deleted))
+                {
+                    stream.push_back(std::move(entry));
+                }
+            }
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+
+    // the length and the last ID, which are the last entry's here; later versions add the first ID, the
+    // largest deleted one and the number of entries ever added. Consumer groups were turned down when
+    // the record was skimmed
+    uint64_t skipped;
+    for (int i = 0; i < (type == Rdb_stream_listpacks ? 3 : 8); i++)
+    {
+        read_length(rdb, skipped);
+    }
+    read_length(rdb, skipped);
+    return rdb.ok();
+}
+
+// moves past a value without building it, to find where the next record starts; false for the values
+// that can't be loaded, which leave the rest of the file unreadable too
+bool skip_value(Rdb_reader& rdb, const unsigned char type)
+{
+    uint64_t n;
+    switch (type)
+    {
+    case Rdb_string:
+    case Rdb_zset_listpack:
+        skip_string(rdb);
+        break;
+    case Rdb_list:
+    case Rdb_list_quicklist_2:
+        read_length(rdb, n);
+        for (uint64_t i = 0; i < n && rdb.ok(); i++)
+        {
+            uint64_t container;
+            if (type == Rdb_list_quicklist_2)
+            {
+                read_length(rdb, container);
+            }
+            skip_string(rdb);
+        }
+        break;
+    case Rdb_zset_2:
+        read_length(rdb, n);
+        for (uint64_t i = 0; i < n && rdb.ok(); i++)
+        {
+            skip_string(rdb);
+            rdb.bytes(8);
+        }
+        break;
+    case Rdb_stream_listpacks:
+    case Rdb_stream_listpacks_2:
+    case Rdb_stream_listpacks_3:
+        read_length(rdb, n);
+        for (uint64_t i = 0; i < n && rdb.ok(); i++)
+        {
+            skip_string(rdb);
+            skip_string(rdb);
+        }
+        for (int i = 0; i < (type == Rdb_stream_listpacks ? 3 : 8); i++)
+        {
+            read_length(rdb, n);
+        }
+        read_length(rdb, n);
+        if (n != 0)
+        {
+            std::cerr << "Consumer groups not supported\n";
+            return false;
+        }
+        break;
+    default:
+        std::cerr << "Value type not supported\n";
+        return false;
+    }
+    return rdb.ok();
+}
+
+// a key and its value, as they are in the snapshot
+struct Rdb_record
+{
+    size_t begin;
+    size_t end;
+    unsigned char type;
+    std::optional<long long> expiry;
+};
+
+// builds a record's value in the shard owning its key; false when the value is malformed
+bool load_record(const std::string_view bytes, const Rdb_record& record)
+{
+    Rdb_reader rdb(bytes.substr(record.begin, record.end - record.begin));
+    std::string key_buffer;
+    const std::string_view key = read_string(rdb, key_buffer);
+    const Shard_guard guard(shard_of(key));
+    bool inserted;
+    Key_entry& entry = upsert_key(key, inserted);
+    std::string buffer;
+    bool read;
+    switch (record.type)
+    {
+    case Rdb_string:
+        entry.set_string(read_string(rdb, buffer));
+        read = rdb.ok();
+        break;
+    case Rdb_list:
+    case Rdb_list_quicklist_2:
+        entry.emplace<List>();
+        read = read_list(rdb, record.type, entry.as<List>());
+        break;
+    case Rdb_zset_2:
+    case Rdb_zset_listpack:
+        entry.emplace<Sorted_set>();
+        read = read_zset(rdb, record.type, entry.as<Sorted_set>());
+        break;
+    default:
+        entry.emplace<Stream>();
+        read = read_stream(rdb, record.type, entry.as<Stream>());
+    }
+    if (!read)
+    {
+        remove_key(key);
+        return false;
+    }
+    if (record.expiry)
+    {
+        set_expiry(key, entry, *record.expiry);
+    }
+    else
+    {
+        clear_expiry(key, entry);
+    }
+    return true;
+}
+
+// builds the records' values on worker threads, each of which owns every n-th shard, so they don't wait
+// on each other's locks and the keys of a shard go in in the file's order. The records of a mapped file
+// are passed on as offsets into it, a stream's are copied. With a single core the parsing thread loads
+// every record as soon as it's read. The file's pages are given back as the records in them are loaded,
+// so the file doesn't stay resident alongside the keys built from it
+class Record_loader
+{
+public:
+    // mapped is the whole file, empty for a stream
+    explicit Record_loader(const std::string_view mapped) : mapped(mapped)
+    {
+        const size_t cores = std::thread::hardware_concurrency();
+        workers = std::vector<Worker>(std::min(cores > 1 ? cores - 1 : 0, shard_count()));
+        for (Worker& worker : workers)
+        {
+            worker.thread = std::thread([this, &worker] { run(worker); });
+        }
+    }
+
+    ~Record_loader()
+    {
+        finish();
+    }
+
+    // the record the reader has read since begin, whose key is in shard
+    void add(Rdb_reader& rdb, const size_t begin, const size_t shard, const unsigned char type,
+             const std::optional<long long> expiry)
+    {
+        if (workers.empty())
+        {
+            const std::string_view bytes = rdb.since(begin);
+            if (!load_record(bytes, {0, bytes.size(), type, expiry}))
+            {
+                failed = true;
+            }
+        }
+        else
+        {
+            Worker& worker = workers[shard % workers.size()];
+            Batch& batch = worker.filling;
+            if (mapped.empty())
+            {
+                const std::string_view bytes = rdb.since(begin);
+                batch.copied += bytes;
+                batch.records.push_back({batch.copied.size() - bytes.size(), batch.copied.size(), type, expiry});
+            }
+            else
+            {
+                batch.records.push_back({begin, rdb.offset(), type, expiry});
+            }
+            if (batch.records.size() == batch_size)
+            {
+                hand_over(worker);
+            }
+        }
+        if (!mapped.empty() && rdb.offset() - released >= release_step)
+        {
+            release_loaded(rdb.offset());
+        }
+    }
+
+    // waits for every record to be loaded; false when some were malformed
+    bool finish()
+    {
+        for (Worker& worker : workers)
+        {
+            hand_over(worker);
+            {
+                const std::lock_guard lock(worker.lock);
+                worker.done = true;
+            }
+            worker.changed.notify_all();
+            worker.thread.join();
+        }
+        workers.clear();
+        return !failed;
+    }
+
+private:
+    static constexpr size_t batch_size = 1024;
+    // the batches a worker may fall behind by, which is all a stream's records hold in memory
+    static constexpr size_t max_queued = 16;
+    static constexpr size_t release_step = 64 << 20;
+
+    struct Batch
+    {
+        std::string copied;
+        std::vector<Rdb_record> records;
+    };
+
+    struct Worker
+    {
+        std::thread thread;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<Batch> queue;
+        bool done = false;
+        Batch filling;
+        // the batches the worker has loaded; the parser keeps where each one it handed over starts
+        std::atomic<size_t> loaded = 0;
+        std::deque<size_t> starts;
+        size_t retired = 0;
+    };
+
+    std::string_view mapped;
+    std::vector<Worker> workers;
+    std::atomic<bool> failed = false;
+    size_t released = 0;
+
+    // no record that's waiting to be loaded starts before the offset this returns
+    size_t loaded_before(const size_t offset)
+    {
+        size_t before = offset;
+        for (Worker& worker : workers)
+        {
+            for (; !worker.starts.empty() && worker.retired < worker.loaded.load(); worker.retired++)
+            {
+                worker.starts.pop_front();
+            }
+            if (!worker.starts.empty())
+            {
+                before = std::min(before, worker.starts.front());
+            }
+            else if (!worker.filling.records.empty())
+            {
+                before = std::min(before, worker.filling.records.front().begin);
+            }
+        }
+        return before;
+    }
+
+    void release_loaded(const size_t offset)
+    {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t end = loaded_before(offset) / page * page;
+        if (end > released)
+        {
+            // the mapping is private and never written, so the pages are read from the file again if needed
+            madvise(const_cast<char*>(mapped.data()) + released, end - released, MADV_DONTNEED);
+            released = end;
+        }
+    }
+
+    void hand_over(Worker& worker)
+    {
+        if (worker.filling.records.empty())
+        {
+            return;
+        }
+        {
+            std::unique_lock lock(worker.lock);
+            worker.changed.wait(lock, [&] { return worker.queue.size() < max_queued; });
+            worker.starts.push_back(worker.filling.records.front().begin);
+            worker.queue.push_back(std::move(worker.filling));
+        }
+        worker.changed.notify_all();
+        worker.filling = Batch();
+    }
+
+    void run(Worker& worker)
+    {
+        while (true)
+        {
+            Batch batch;
+            {
+                std::unique_lock lock(worker.lock);
+                worker.changed.wait(lock, [&] { return worker.done || !worker.queue.empty(); });
+                if (worker.queue.empty())
+                {
+                    return;
+                }
+                batch = std::move(worker.queue.front());
+                worker.queue.pop_front();
+            }
+            worker.changed.notify_all();
+            const std::string_view bytes = mapped.empty() ? std::string_view(batch.copied) : mapped;
+            for (const Rdb_record& record : batch.records)
+            {
+                if (!load_record(bytes, record))
+                {
+                    failed = true;
+                }
+            }
+            worker.loaded++;
+        }
+    }
+};
+
+std::string rdb_path()
+{
+    const std::string dir = get_config("dir");
+    const std::string name = get_config("dbfilename");
+    return (dir.empty() ? "." : dir) + "/" + (name.empty() ? "dump.rdb" : name);
+}
+
+// the parser only finds where each record ends and which shard its key goes to, the loader builds them.
+// False when the snapshot is broken
+bool load_rdb(Rdb_reader& rdb, Record_loader& loader)
+{
+    const std::string_view header = rdb.bytes(9);
+    if (!header.starts_with("REDIS"))
+    {
+        std::cerr << "Supplied file is not an RDB file\n";
+        return false;
+    }
+
+    std::string buffer;
+    uint64_t skipped;
+    while (rdb.ok())
+    {
+        std::optional<long long> expiry;
+        unsigned char type = rdb.byte();
+        switch (type)
+        {
+        case Rdb_eof:
+            // the checksum isn't checked, only read past, for what's streamed after the snapshot
+            rdb.bytes(8);
+            if (!loader.finish() || !rdb.ok())
+            {
+                std::cerr << "Supplied file is broken\n";
+                return false;
+            }
+            return true;
+        case Rdb_select_db:
+            // we currently ignore this as there is only one database present
+            read_length(rdb, skipped);
+            continue;
+        case Rdb_resize_db:
+            {
+                // the keys that follow, then how many of them expire
+                uint64_t keys;
+                read_length(rdb, keys);
+                read_length(rdb, skipped);
+                if (rdb.ok())
+                {
+                    reserve_keys(keys);
+                }
+                continue;
+            }
+        case Rdb_aux:
+            // currently do nothing with this
+            skip_string(rdb);
+            skip_string(rdb);
+            continue;
+        case Rdb_expiry_sec:
+            expiry = (read_little_endian(rdb.fixed(4), 4) & 0xffffffff) * 1000;
+            type = rdb.byte();
+            break;
+        case Rdb_expiry_ms:
+            expiry = read_little_endian(rdb.fixed(8), 8);
+            type = rdb.byte();
+            break;
+        default:
+            break;
+        }
+
+        rdb.forget();
+        const size_t begin = rdb.offset();
+        const size_t shard = shard_of(read_string(rdb, buffer));
+        if (!skip_value(rdb, type))
+        {
+            break;
+        }
+        loader.add(rdb, begin, shard, type, expiry);
+    }
+
+    loader.finish();
+    std::cerr << "Supplied file is broken\n";
+    return false;
+}
+
+void read_rdb(std::basic_istream<char>* s)
+{
+    if (s != nullptr)
+    {
+        Rdb_reader rdb(s->rdbuf());
+        Record_loader loader({});
+        load_rdb(rdb, loader);
+        return;
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+    const int fd = open(rdb_path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (!has_config("dir") && !has_config("dbfilename"))
+        {
+            std::cout << "Database file not loaded\n";
+        }
+        else
+        {
+            std::cerr << "Unable to open rdb file\n";
+        }
+        return;
+    }
+    // the file is parsed where the kernel maps it, read ahead as the parser goes
+    struct stat st{};
+    const size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    void* map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        std::cerr << "Supplied file is not an RDB file\n";
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    {
+        const std::string_view bytes(static_cast<const char*>(map), size);
+        Rdb_reader rdb(bytes);
+        Record_loader loader(bytes);
+        load_rdb(rdb, loader);
+    }
+    munmap(map, size);
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - started;
+    std::cout << "DB loaded from disk: " << key_count() << " keys in " << took.count() << " seconds\n";
+}
+
+size_t read_rdb_preamble(const std::string_view file)
+{
+    Rdb_reader rdb(file);
+    Record_loader loader(file);
+    return load_rdb(rdb, loader) ? rdb.offset() : 0;
+}
+
+void write_stream(Rdb_writer& rdb, const Stream& stream)
+{
+    rdb.length((stream.size() + stream_node_entries - 1) / stream_node_entries);
+    for (size_t first = 0; first < stream.size(); first += stream_node_entries)
+    {
+        const size_t n = std::min(stream_node_entries, stream.size() - first);
+        const Stream_entry& master = stream[first];
+        char id[16];
+        for (size_t i = 0; i < 8; i++)
+        {
+            id[i] = static_cast<char>(static_cast<uint64_t>(master.milliseconds_time) >> 8 * (7 - i) & 0xff);
+            id[8 + i] = static_cast<char>(static_cast<uint64_t>(master.sequence_number) >> 8 * (7 - i) & 0xff);
+        }
+        rdb.string({id, sizeof(id)});
+
+        Listpack lp;
+        lp.integer(static_cast<long long>(n));
+        lp.integer(0);
+        lp.integer(static_cast<long long>(master.key_vals.size()));
+        for (const auto& [field, value] : master.key_vals)
+        {
+            lp.string(field);
+        }
+        lp.integer(0);
+        for (size_t i = first; i < first + n; i++)
+        {
+            // the fields are always written out, which needs no comparing with the master's
+            const Stream_entry& entry = stream[i];
+            lp.integer(0);
+            lp.integer(static_cast<long long>(entry.milliseconds_time - master.milliseconds_time));
+            lp.integer(static_cast<long long>(entry.sequence_number) - master.sequence_number);
+            lp.integer(static_cast<long long>(entry.key_vals.size()));
+            for (const auto& [field, value] : entry.key_vals)
+            {
+                lp.string(field);
+                lp.string(value);
+            }
+            lp.integer(2 * static_cast<long long>(entry.key_vals.size()) + 4);
+        }
+        rdb.string(lp.finish());
+    }
+    rdb.length(stream.size());
+    rdb.length(stream.empty() ? 0 : stream.back().milliseconds_time);
+    rdb.length(stream.empty() ? 0 : stream.back().sequence_number);
+    // no consumer groups
+    rdb.length(0);
+}
+
+void write_key(Rdb_writer& rdb, const std::string_view key, const Key_entry& entry)
+{
+    if (entry.has_expiry())
+    {
+        rdb.byte(Rdb_expiry_ms);
+        rdb.little_endian(entry.expiry_ms(), 8);
+    }
+    switch (entry.type())
+    {
+    case Type_string:
+        {
+            rdb.byte(Rdb_string);
+            rdb.string(key);
+            if (const auto* n = std::get_if<long long>(&entry.value))
+            {
+                return rdb.integer(*n);
+            }
+            Digits digits;
+            return rdb.string(entry.string_value(digits));
+        }
+    case Type_list:
+        rdb.byte(Rdb_list);
+        rdb.string(key);
+        rdb.length(entry.as<List>().size());
+        for (const auto& element : entry.as<List>())
+        {
+            rdb.string(element);
+        }
+        return;
+    case Type_zset:
+        rdb.byte(Rdb_zset_2);
+        rdb.string(key);
+        rdb.length(entry.as<Sorted_set>().set.size());
+        for (const auto& [score, member] : entry.as<Sorted_set>().set)
+        {
+            rdb.string(member);
+            rdb.little_endian(std::bit_cast<uint64_t>(score), 8);
+        }
+        return;
+    case Type_stream:
+        rdb.byte(Rdb_stream_listpacks);
+        rdb.string(key);
+        return write_stream(rdb, entry.as<Stream>());
+    }
+}
+
+// the whole keyspace; the shards are locked one at a time, so it's a view of one point in time only when
+// nothing else runs. False when the sink failed
+bool write_rdb(Rdb_writer& rdb, const bool aof_base = false)
+{
+    rdb.bytes("REDIS0011");
+    const auto aux = [&rdb](const std::string_view name)
+    {
+        rdb.byte(Rdb_aux);
+        rdb.string(name);
+    };
+    aux("redis-ver");
+    rdb.string("7.2.0");
+    aux("redis-bits");
+    rdb.integer(64);
+    aux("ctime");
+    rdb.integer(unix_millis_now() / 1000);
+    aux("used-mem");
+    rdb.integer(static_cast<long long>(used_memory()));
+    aux("aof-base");
+    rdb.integer(aof_base);
+
+    rdb.byte(Rdb_select_db);
+    rdb.length(0);
+    // only a hint for sizing the tables, the keys with an expiry aren't counted
+    rdb.byte(Rdb_resize_db);
+    rdb.length(key_count());
+    rdb.length(0);
+
+    const long long now = unix_millis_now();
+    for (size_t shard = 0; shard < shard_count(); shard++)
+    {
+        const Shard_guard guard(shard);
+        for (const auto& node : entries())
+        {
+            if (node.value.has_expiry() && node.value.expiry_ms() < now)
+            {
+                continue;
+            }
+            write_key(rdb, node.key(), node.value);
+            if (!rdb.flush_if_full())
+            {
+                return false;
+            }
+        }
+    }
+    return rdb.finish();
+}
+
+Rdb_sink file_sink(const int fd)
+{
+    return [fd](std::string_view chunk)
+    {
+        while (!chunk.empty())
+        {
+            const ssize_t n = write(fd, chunk.data(), chunk.size());
+            if (n < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            chunk.remove_prefix(std::max<ssize_t>(n, 0));
+        }
+        return true;
+    };
+}
+
+// written to a temporary file that's renamed over the old snapshot once it's on disk, so a crash leaves
+// one or the other whole
+bool write_rdb_file()
+{
+    const std::string path = rdb_path();
+    const std::string temp = path.substr(0, path.rfind('/') + 1) + "temp-" + std::to_string(getpid()) + ".rdb";
+    const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    Rdb_writer rdb(file_sink(fd));
+    const bool written = write_rdb(rdb) && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool write_rdb_preamble(const int fd)
+{
+    Rdb_writer rdb(file_sink(fd));
+    return write_rdb(rdb, true);
+}
+
+// the pages a process wrote to since it was forked, or that it only has itself
+size_t private_dirty_memory()
+{
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    size_t total = 0;
+    for (std::string line; std::getline(smaps, line);)
+    {
+        if (line.starts_with("Private_Dirty:"))
+        {
+            total += std::stoull(line.substr(line.find(':') + 1)) * 1024;
+        }
+    }
+    return total;
+}
+
+struct Save_point
+{
+    long long seconds;
+    size_t changes;
+};
+
+// "seconds changes" pairs, separated by spaces
+std::vector<Save_point> parse_save_points(const std::string& str)
+{
+    std::vector<Save_point> points;
+    std::istringstream in(str);
+    for (Save_point point{}; in >> point.seconds >> point.changes;)
+    {
+        points.push_back(point);
+    }
+    return points;
+}
+
+// a failed BGSAVE is retried this long after, not on every tick
+constexpr auto bgsave_retry_delay = std::chrono::seconds(5);
+// a replica that takes none of the snapshot for this long is given up on
+constexpr int replica_write_timeout_ms = 60000;
+
+void (*pause_reactors)(const std::function<void()>&) = [](const std::function<void()>& f) { f(); };
+// set from the start of a save until it's done, and while there's a child
+std::atomic<bool> saving = false;
+std::atomic<size_t> changes = 0;
+
+// a BGSAVE's child, or a full resync's
+struct Child
+{
+    pid_t pid = 0;
+    // a full resync's child writes a byte per replica here (whether it got the whole snapshot), then
+    // either child writes the size of its private pages before it exits
+    int pipe = -1;
+    std::chrono::steady_clock::time_point started;
+    size_t changes_at_fork = 0;
+    // empty for a BGSAVE
+    std::vector<std::shared_ptr<Full_sync>> syncs;
+};
+
+std::mutex stats_lock;
+Save_stats stats{.last_save_time = std::time(nullptr)};
+Child child;
+std::chrono::steady_clock::time_point last_bgsave_try;
+
+std::mutex sync_lock;
+std::vector<std::shared_ptr<Full_sync>> pending_syncs;
+std::chrono::steady_clock::time_point first_sync_request;
+
+void set_pause_reactors(void (*pause)(const std::function<void()>& f))
+{
+    pause_reactors = pause;
+}
+
+void count_change()
+{
+    changes.fetch_add(1, std::memory_order_relaxed);
+}
+
+// the changes made up to the snapshot are saved, the ones since aren't
+void record_save(const size_t saved_changes)
+{
+    changes.fetch_sub(saved_changes, std::memory_order_relaxed);
+    stats.last_save_time = unix_millis_now() / 1000;
+    stats.saves++;
+}
+
+Save_result save()
+{
+    if (saving.exchange(true))
+    {
+        return Save_in_progress;
+    }
+    bool written = false;
+    size_t saved_changes = 0;
+    pause_reactors([&]
+    {
+        saved_changes = changes.load(std::memory_order_relaxed);
+        written = write_rdb_file();
+    });
+    if (written)
+    {
+        const std::lock_guard lock(stats_lock);
+        record_save(saved_changes);
+    }
+    saving.store(false);
+    std::cout << (written ? "DB saved on disk\n" : "Failed saving the DB\n");
+    return written ? Save_ok : Save_failed;
+}
+
+// forks with the other reactors waiting between commands, so the child's copy of the keyspace has none
+// half done. The child only has this thread, which holds no shard lock: it runs work, writes the size
+// of its private pages to the pipe and exits with work's result. at_fork runs in the parent right
+// after the fork, before the reactors go on; the pipe's ends are closed but the one read from. -1 when
+// the fork failed
+pid_t fork_child(int (&pipe)[2], const std::function<bool()>& work, const std::function<void()>& at_fork)
+{
+    pid_t pid = -1;
+    pause_reactors([&]
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            close(pipe[0]);
+            const bool done = work();
+            const uint64_t cow = private_dirty_memory();
+            (void)!write(pipe[1], &cow, sizeof(cow));
+            _exit(done ? 0 : 1);
+        }
+        if (pid > 0)
+        {
+            at_fork();
+        }
+    });
+    close(pipe[1]);
+    if (pid < 0)
+    {
+        close(pipe[0]);
+    }
+    return pid;
+}
+
+Save_result start_bgsave()
+{
+    int fds[2];
+    if (saving.exchange(true))
+    {
+        return Save_in_progress;
+    }
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+        saving.store(false);
+        return Save_failed;
+    }
+    size_t changes_at_fork = 0;
+    const pid_t pid = fork_child(fds, write_rdb_file, [&]
+    {
+        changes_at_fork = changes.load(std::memory_order_relaxed);
+    });
+
+    const std::lock_guard lock(stats_lock);
+    last_bgsave_try = steady_now();
+    if (pid < 0)
+    {
+        stats.last_bgsave_ok = false;
+        saving.store(false);
+        return Save_failed;
+    }
+    child = {pid, fds[0], steady_now(), changes_at_fork, {}};
+    std::cout << "Background saving started by pid " << pid << "\n";
+    return Save_ok;
+}
+
+// false when the socket failed, or took none of the bytes for the timeout
+bool write_socket(const int fd, std::string_view bytes)
+{
+    while (!bytes.empty())
+    {
+        const ssize_t n = send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            bytes.remove_prefix(n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        // the socket is non-blocking, the parent's event loop set it up that way
+        pollfd writable{fd, POLLOUT, 0};
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || poll(&writable, 1, replica_write_timeout_ms) <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the child of a full resync: writes the snapshot to every replica in its format, and whether each got
+// all of it to the pipe. A replica that fails is dropped, the others go on
+bool stream_full_sync(const std::vector<std::shared_ptr<Full_sync>>& syncs, const std::string& mark, const int pipe)
+{
+    std::vector<char> alive(syncs.size(), 1);
+    const auto send_streamed = [&](const std::string_view bytes)
+    {
+        bool any = false;
+        for (size_t i = 0; i < syncs.size(); i++)
+        {
+            if (alive[i] && syncs[i]->eof_format)
+            {
+                alive[i] = write_socket(syncs[i]->fd, bytes);
+                any |= alive[i];
+            }
+        }
+        return any;
+    };
+    const bool sized = std::ranges::any_of(syncs, [](const auto& sync) { return !sync->eof_format; });
+
+    send_streamed("$EOF:" + mark + "\r\n");
+    std::string whole;
+    Rdb_writer rdb([&](const std::string_view chunk)
+    {
+        const bool streamed = send_streamed(chunk);
+        if (sized)
+        {
+            whole += chunk;
+        }
+        return streamed || sized;
+    });
+    const bool written = write_rdb(rdb);
+    send_streamed(mark);
+    for (size_t i = 0; i < syncs.size(); i++)
+    {
+        if (!syncs[i]->eof_format)
+        {
+            alive[i] = write_socket(syncs[i]->fd, "$" + std::to_string(whole.size()) + "\r\n") &&
+                write_socket(syncs[i]->fd, whole);
+        }
+    }
+    (void)!write(pipe, alive.data(), alive.size());
+    return written;
+}
+
+// 40 random characters, which the snapshot won't end with by chance
+std::string eof_mark()
+{
+    constexpr std::string_view chars = "0123456789abcdefghijklmnopqrstuvwxyz";
+    std::random_device random;
+    std::string mark(40, '\0');
+    for (char& c : mark)
+    {
+        c = chars[random() % chars.size()];
+    }
+    return mark;
+}
+
+std::shared_ptr<Full_sync> request_full_sync(const int fd, const bool eof_format)
+{
+    auto sync = std::make_shared<Full_sync>(fd, eof_format);
+    const std::lock_guard lock(sync_lock);
+    if (pending_syncs.empty())
+    {
+        first_sync_request = steady_now();
+    }
+    pending_syncs.push_back(sync);
+    return sync;
+}
+
+void start_full_sync()
+{
+    static const std::chrono::duration<double> delay(
+        std::strtod(get_config("repl-diskless-sync-delay").c_str(), nullptr));
+    std::vector<std::shared_ptr<Full_sync>> syncs;
+    {
+        const std::lock_guard lock(sync_lock);
+        if (pending_syncs.empty() || steady_now() - first_sync_request < delay || saving.exchange(true))
+        {
+            return;
+        }
+        syncs.swap(pending_syncs);
+    }
+    int fds[2];
+    pid_t pid = -1;
+    if (pipe2(fds, O_CLOEXEC) == 0)
+    {
+        const std::string mark = eof_mark();
+        pid = fork_child(fds, [&] { return stream_full_sync(syncs, mark, fds[1]); }, [&]
+        {
+            // the commands from here on aren't in the snapshot
+            for (const auto& sync : syncs)
+            {
+                sync->offset = add_replica();
+                sync->registered = true;
+            }
+        });
+    }
+    if (pid < 0)
+    {
+        for (const auto& sync : syncs)
+        {
+            sync->state = Sync_failed;
+        }
+        saving.store(false);
+        return;
+    }
+    const std::lock_guard lock(stats_lock);
+    child = {pid, fds[0], steady_now(), 0, std::move(syncs)};
+    std::cout << "Starting full resync by pid " << pid << ", for " << child.syncs.size() << " replica(s)\n";
+}
+
+void reap_child()
+{
+    const std::lock_guard lock(stats_lock);
+    int status = 0;
+    const pid_t done = child.pid ? waitpid(child.pid, &status, WNOHANG) : 0;
+    if (done == 0)
+    {
+        return;
+    }
+    const bool ok = done == child.pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::vector<char> synced(child.syncs.size());
+    const bool read_synced = read(child.pipe, synced.data(), synced.size()) == static_cast<ssize_t>(synced.size());
+    uint64_t cow = 0;
+    if (read(child.pipe, &cow, sizeof(cow)) != sizeof(cow))
+    {
+        cow = 0;
+    }
+    close(child.pipe);
+
+    if (child.syncs.empty())
+    {
+        stats.last_bgsave_ok = ok;
+        stats.last_bgsave_seconds =
+            std::chrono::duration_cast<std::chrono::seconds>(steady_now() - child.started).count();
+        stats.last_cow_bytes = cow;
+        if (ok)
+        {
+            record_save(child.changes_at_fork);
+        }
+        std::cout << (ok ? "Background saving terminated with success\n" : "Background saving error\n");
+    }
+    for (size_t i = 0; i < child.syncs.size(); i++)
+    {
+        const bool sent = read_synced && synced[i];
+        child.syncs[i]->state = sent ? Sync_ok : Sync_failed;
+        std::cout << (sent ? "Streamed database to replica\n" : "Full resync of a replica failed\n");
+    }
+    child = {};
+    saving.store(false);
+}
+
+void persistence_cron()
+{
+    reap_child();
+    start_full_sync();
+
+    static const std::vector<Save_point> points = parse_save_points(get_config("save"));
+    if (points.empty() || saving.load())
+    {
+        return;
+    }
+    {
+        const std::lock_guard lock(stats_lock);
+        if (!stats.last_bgsave_ok && steady_now() - last_bgsave_try < bgsave_retry_delay)
+        {
+            return;
+        }
+    }
+    const Save_stats current = save_stats();
+    const long long now = unix_millis_now() / 1000;
+    for (const auto& [seconds, min_changes] : points)
+    {
+        if (current.changes >= min_changes && now - current.last_save_time >= seconds)
+        {
+            std::cout << min_changes << " changes in " << seconds << " seconds. Saving...\n";
+            start_bgsave();
+            return;
+        }
+    }
+}
+
+Save_stats save_stats()
+{
+    const std::lock_guard lock(stats_lock);
+    Save_stats current = stats;
+    current.changes = changes.load(std::memory_order_relaxed);
+    current.bgsave_in_progress = child.pid != 0 && child.syncs.empty();
+    if (current.bgsave_in_progress)
+    {
+        current.current_bgsave_seconds =
+            std::chrono::duration_cast<std::chrono::seconds>(steady_now() - child.started).count();
+    }
+    return current;
+}
@@ -0,0 +1,93 @@
+#ifndef PERSISTENCE_H
+#define PERSISTENCE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// RDB snapshots, in the format of Redis 7.2 (RDB version 11): strings (as integers when they fit 32 bits),
+// lists, sorted sets and streams, with their expiry times. Strings past rdb-compression-threshold bytes
+// are LZF compressed, as Redis does, unless rdbcompression is no. Files from Redis load too, as long as
+// their values are of these types
+
+// loads the snapshot in dir/dbfilename, or the one read from s, into the shards owning its keys. The
+// file is mapped into memory; the values are built on a thread per core, and the tables are sized up
+// front when the file says how many keys it holds. A stream is read no further than the snapshot's end
+void read_rdb(std::basic_istream<char>* s = nullptr);
+
+// the snapshot an append only file starts with (see Aof.h): read_rdb_preamble loads it from the front of
+// the mapped file and returns its length, 0 when it's broken; write_rdb_preamble writes the keyspace to
+// fd, false when that failed
+size_t read_rdb_preamble(std::string_view file);
+bool write_rdb_preamble(int fd);
+
+// SAVE writes the snapshot on the calling reactor, BGSAVE from a forked child, which sees the keyspace
+// as it was at the fork (copy on write) while the server goes on. Both need every other reactor to
+// wait between two commands while they start; the server hands over the function that does that,
+// which runs f while they wait. Saves never overlap, so it's only called by one reactor at a time
+void set_pause_reactors(void (*pause)(const std::function<void()>& f));
+
+enum Save_result
+{
+    Save_ok,
+    Save_in_progress,
+    Save_failed
+};
+
+Save_result save();
+Save_result start_bgsave();
+
+enum Sync_state
+{
+    Sync_pending,
+    Sync_ok,
+    Sync_failed
+};
+
+// a replica's full resync. A forked child writes the snapshot straight to the replica's socket as it's
+// serialized, so the connection mustn't touch the socket while the state is pending
+struct Full_sync
+{
+    int fd;
+    // "$EOF:<40 byte mark>\r\n", the RDB file, then the mark again, for replicas that said REPLCONF capa
+    // eof. The others get "$<length>\r\n" and the file, which the child has to build in memory first
+    bool eof_format;
+    // set when the child is forked: the replica was added to the command queue, from offset on (the
+    // commands that aren't in the snapshot)
+    bool registered = false;
+    size_t offset = 0;
+    std::atomic<Sync_state> state = Sync_pending;
+};
+
+// the replicas that ask within repl-diskless-sync-delay seconds of the first share one child, and one
+// pass over the keyspace. A sync waits for a BGSAVE that's running, as saves wait for it
+std::shared_ptr<Full_sync> request_full_sync(int fd, bool eof_format);
+
+// called about every 10 ms from one reactor: reaps the child of a BGSAVE or a full resync that finished,
+// starts the full resync the replicas asked for, and starts a BGSAVE when a save point (a "seconds
+// changes" pair of the save setting) is reached
+void persistence_cron();
+// a write ran, for the save points
+void count_change();
+
+// what INFO persistence reports; times are unix seconds, durations whole seconds (-1 before the first)
+struct Save_stats
+{
+    size_t changes = 0;
+    bool bgsave_in_progress = false;
+    long long last_save_time = 0;
+    bool last_bgsave_ok = true;
+    long long last_bgsave_seconds = -1;
+    long long current_bgsave_seconds = -1;
+    // the memory the last BGSAVE's child copied as the server wrote to its pages
+    size_t last_cow_bytes = 0;
+    size_t saves = 0;
+};
+
+Save_stats save_stats();
+
+#endif //PERSISTENCE_H
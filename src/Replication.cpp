@@ -1,9 +1,11 @@
 #include "Replication.h"
 
 #include <iostream>
+#include <sstream>
 
+#include "Aof.h"
 #include "Database.h"
-#include <sys/socket.h>
+#include "Persistence.h"
 #include "Resp.h"
 #include <mutex>
 #include <ranges>
@@ -49,22 +51,32 @@ size_t& top_offset()
     return top_offset_int;
 }
 
-void slave_disconnected()
+size_t add_replica()
 {
-    const std::lock_guard lock(command_queue_lock);
-    const std::lock_guard lock2(slave_count_lock);
+    const std::lock_guard lock(top_offset_lock);
+    const std::lock_guard lock2(command_queue_lock);
+    const std::lock_guard lock3(slave_count_lock);
+    slave_count_int++;
+    return top_offset_int + command_queue_q.size();
+}
+
+void slave_disconnected(const size_t from)
+{
+    const std::lock_guard lock(top_offset_lock);
+    const std::lock_guard lock2(command_queue_lock);
+    const std::lock_guard lock3(slave_count_lock);
     slave_count_int--;
     if (!slave_count_int)
     {
         command_queue_q.clear();
     }
-    for (auto& val : command_queue_q)
+    for (size_t i = from > top_offset_int ? from - top_offset_int : 0; i < command_queue_q.size(); i++)
     {
-        val.remaining--;
+        command_queue_q[i].remaining--;
     }
 }
 
-void add_command(const std::string& command, bool expect_response, unsigned int timeout)
+void add_command(const std::string_view command, bool expect_response, unsigned int timeout)
 {
     const std::lock_guard lock(command_queue_lock);
     const std::lock_guard lock2(slave_count_lock);
@@ -72,14 +84,37 @@ void add_command(const std::string& command, bool expect_response, unsigned int
     {
         return;
     }
-    command_queue_q.emplace_back(command, slave_count_int, expect_response, timeout);
+    command_queue_q.emplace_back(std::string(command), slave_count_int, expect_response, timeout);
+}
+
+size_t propagate(const Request cmd, std::string_view frame, const bool to_aof)
+{
+    send_getack() = true;
+    const bool aof = to_aof && aof_enabled();
+    if (!aof && !slave_count())
+    {
+        return 0;
+    }
+    std::string encoded;
+    if (frame.empty())
+    {
+        Resp_writer encoder(encoded);
+        encoder.array_header(cmd.size());
+        for (const std::string_view arg : cmd)
+        {
+            encoder.bulk_string(arg);
+        }
+        frame = encoded;
+    }
+    add_command(frame);
+    return aof ? append_aof(cmd, frame) : 0;
 }
 
 void remove_command()
 {
     const std::lock_guard lock(top_offset_lock);
     const std::lock_guard lock2(command_queue_lock);
-    if (command_queue_q.front().remaining == 0)
+    if (!command_queue_q.empty() && command_queue_q.front().remaining == 0)
     {
         command_queue_q.pop_front();
         top_offset_int++;
@@ -112,68 +147,109 @@ bool& send_getack()
 
 bool is_slave()
 {
-    return config_key_vals().contains("replicaof");
+    return has_config("replicaof");
+}
+
+asio::awaitable<std::string> read_line(asio::ip::tcp::socket& master, std::string& in_buffer)
+{
+    const size_t n = co_await asio::async_read_until(master, asio::dynamic_buffer(in_buffer), CRLF, asio::use_awaitable);
+    std::string line = in_buffer.substr(0, n - CRLF.size());
+    in_buffer.erase(0, n);
+    co_return line;
+}
+
+asio::awaitable<std::string> handshake_step(asio::ip::tcp::socket& master, std::string& in_buffer, const std::string& cmd)
+{
+    co_await asio::async_write(master, asio::buffer(cmd), asio::use_awaitable);
+    co_return co_await read_line(master, in_buffer);
 }
 
-int find(const char* s, const char c, const int start, const int end)
+// the master's bytes for the snapshot loader, starting with what the handshake read past its last line.
+// The replica has nothing else to do until its data is loaded, so they're read with blocking reads as the
+// loader asks for them, and never more than a buffer of them is held
+class Master_streambuf final : public std::streambuf
 {
-    for (int i = start; i < end; i++)
+public:
+    Master_streambuf(asio::ip::tcp::socket& master, std::string buffered) : master(master), buffer(std::move(buffered))
     {
-        if (s[i] == c)
+        setg(buffer.data(), buffer.data(), buffer.data() + buffer.size());
+    }
+
+    // the bytes handed to the loader so far
+    size_t consumed() const
+    {
+        return before + (gptr() - eback());
+    }
+
+    // what was read but not handed out: the start of the command stream
+    std::string rest() const
+    {
+        return {gptr(), egptr()};
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+        {
+            return traits_type::to_int_type(*gptr());
+        }
+        before += egptr() - eback();
+        buffer.resize(64 * 1024);
+        asio::error_code ec;
+        const size_t n = master.read_some(asio::buffer(buffer), ec);
+        if (ec)
         {
-            return i;
+            setg(buffer.data(), buffer.data(), buffer.data());
+            return traits_type::eof();
         }
+        setg(buffer.data(), buffer.data(), buffer.data() + n);
+        return traits_type::to_int_type(*gptr());
     }
-    return -1;
-}
 
-std::string send_handshake(const int master_fd)
+private:
+    asio::ip::tcp::socket& master;
+    std::string buffer;
+    size_t before = 0;
+};
+
+asio::awaitable<std::string> send_handshake(asio::ip::tcp::socket& master)
 {
-    constexpr int buffer_size = 4096;
-    char in_buffer[buffer_size];
+    std::string in_buffer;
 
     const std::string str1 = command({"PING"});
-    send(master_fd, str1.c_str(), str1.size(), 0);
-    recv(master_fd, in_buffer, buffer_size, 0); // pong
+    co_await handshake_step(master, in_buffer, str1); // pong
 
-    const std::string str2 = command({"REPLCONF", "listening-port", config_key_vals()["port"]});
-    send(master_fd, str2.c_str(), str2.size(), 0);
-    recv(master_fd, in_buffer, buffer_size, 0); // ok
+    const std::string str2 = command({"REPLCONF", "listening-port", get_config("port")});
+    co_await handshake_step(master, in_buffer, str2); // ok
 
-    const std::string str3 = command({"REPLCONF", "capa", "psync2"});
-    send(master_fd, str3.c_str(), str3.size(), 0);
-    recv(master_fd, in_buffer, buffer_size, 0); // ok
+    const std::string str3 = command({"REPLCONF", "capa", "eof", "capa", "psync2"});
+    co_await handshake_step(master, in_buffer, str3); // ok
 
     const std::string str4 = command({"PSYNC", "?", "-1"});
-    send(master_fd, str4.c_str(), str4.size(), 0);
-    unsigned int r = recv(master_fd, in_buffer, buffer_size, 0); // fullresync
-
-    int s = find(in_buffer, '$', 0, r);
-    if (s == -1)
+    co_await handshake_step(master, in_buffer, str4); // fullresync
+
+    // "$EOF:<mark>" for a snapshot streamed as it's written, which ends with the mark; "$<length>" otherwise
+    const std::string header = co_await read_line(master, in_buffer);
+    const bool streamed = header.starts_with("$EOF:");
+    Master_streambuf snapshot(master, std::move(in_buffer));
+    std::istream in(&snapshot);
+    read_rdb(&in);
+    if (streamed)
     {
-        r = recv(master_fd, in_buffer, buffer_size, 0);
-        s = 0;
+        std::string mark(header.size() - 5, '\0');
+        if (!in.read(mark.data(), static_cast<std::streamsize>(mark.size())) || mark != header.substr(5))
+        {
+            throw std::runtime_error("Snapshot from master doesn't end with its mark");
+        }
     }
-    s += 1;
-    char* end;
-    const long n = std::strtol(in_buffer + s, &end, 10);
-    end += 2;
-    std::stringstream ss;
-    ss.write(end, n);
-    read_rdb(&ss);
-
-    return {end + n, static_cast<std::string::size_type>(r - n - (end - in_buffer))};
-}
-
-std::vector<unsigned char> make_rdb()
-{
-    // currently returns only an empty db
-    return {'$', '8', '8', '\r', '\n',
-    0x52, 0x45, 0x44, 0x49, 0x53, 0x30, 0x30, 0x31, 0x31, 0xfa, 0x09, 0x72, 0x65, 0x64, 0x69, 0x73, //|REDIS0011..redis|
-    0x2d, 0x76, 0x65, 0x72, 0x05, 0x37, 0x2e, 0x32, 0x2e, 0x30, 0xfa, 0x0a, 0x72, 0x65, 0x64, 0x69, //|-ver.7.2.0..redi|
-    0x73, 0x2d, 0x62, 0x69, 0x74, 0x73, 0xc0, 0x40, 0xfa, 0x05, 0x63, 0x74, 0x69, 0x6d, 0x65, 0xc2, //|s-bits.@..ctime.|
-    0x6d, 0x08, 0xbc, 0x65, 0xfa, 0x08, 0x75, 0x73, 0x65, 0x64, 0x2d, 0x6d, 0x65, 0x6d, 0xc2, 0xb0, //|m..e..used-mem..|
-    0xc4, 0x10, 0x00, 0xfa, 0x08, 0x61, 0x6f, 0x66, 0x2d, 0x62, 0x61, 0x73, 0x65, 0xc0, 0x00, 0xff, //|.....aof-base...|
-    0xf0, 0x6e, 0x3b, 0xfe, 0xc0, 0xff, 0x5a, 0xa2};                                                //|.n;...Z.|
+    else if (const size_t n = std::stoul(header.substr(1)); snapshot.consumed() <= n)
+    {
+        in.ignore(static_cast<std::streamsize>(n - snapshot.consumed()));
+    }
+    else
+    {
+        throw std::runtime_error("Snapshot from master is longer than it said");
+    }
+    co_return snapshot.rest();
 }
-
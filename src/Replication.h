@@ -1,8 +1,12 @@
 #ifndef REPLICATION_H
 #define REPLICATION_H
 #include <string>
+#include <string_view>
 #include <vector>
 #include <queue>
+#include <asio.hpp>
+
+#include "Resp.h"
 
 struct PropagatedCmd
 {
@@ -18,9 +22,16 @@ size_t& master_repl_offset();
 std::deque<PropagatedCmd>& command_queue();
 int& slave_count();
 size_t& top_offset();
-void slave_disconnected();
-void add_command(const std::string& command, bool expect_response = false, unsigned int timeout = 0);
+// the replica joins the queue behind the commands already in it; where its feed starts
+size_t add_replica();
+// from is where the replica's feed had got to: the entries after it were still counting on it
+void slave_disconnected(size_t from);
+void add_command(std::string_view command, bool expect_response = false, unsigned int timeout = 0);
 void remove_command();
+// a write goes to the replicas, and to the AOF unless to_aof is false (PUBLISH), from the reactor that
+// made it while it still holds the key's shard. Without a frame, the command is encoded again. The
+// offset in the AOF of its end, 0 when it wasn't appended
+size_t propagate(Request cmd, std::string_view frame = {}, bool to_aof = true);
 
 void replica_acked();
 void reset_acks();
@@ -29,7 +40,6 @@ bool& send_getack();
 
 bool is_slave();
 
-std::string send_handshake(int master_fd);
-std::vector<unsigned char> make_rdb();
+asio::awaitable<std::string> send_handshake(asio::ip::tcp::socket& master);
 
 #endif //REPLICATION_H
@@ -1,9 +1,13 @@
 #include "Resp.h"
 
+#include <algorithm>
+#include <charconv>
 #include <memory>
 #include <utility>
 #include <vector>
-#include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 std::string simple_string(const std::string& content)
 {
@@ -40,155 +44,295 @@ std::string boolean(const bool val)
     return std::to_string('#') + (val ? 't' : 'f') + CRLF;
 }
 
-void copy_data(const RESP_data& src, RESP_data& dest)
+std::string concat_arrays(const std::vector<std::string>& arrays)
 {
-    switch (src.type)
+    long n = 0;
+    std::string elements;
+    for (const auto& arr : arrays)
     {
-    case Null:
-    case Integer:
-        dest.integer = src.integer;
-        break;
-    case Double:
-        dest.real = src.real;
-        break;
-    case Boolean:
-        dest.boolean = src.boolean;
-        break;
-    case Simple_string:
-    case Simple_error:
-    case Bulk_string:
-    case Bulk_error:
-    case Big_number:
-    case Verbatim_string:
-        new (&dest.string) std::string;
-        dest.string = src.string;
-        break;
-    case Array:
-    case Map:
-    case Attribute:
-    case Set:
-    case Push:
-        new (&dest.array) std::vector<RESP_data>;
-        dest.array = src.array;
-        break;
+        if (!arr.starts_with('*'))
+        {
+            return arr;
+        }
+        const size_t header_end = arr.find(CRLF);
+        if (const long len = std::stol(arr.substr(1, header_end - 1)); len > 0)
+        {
+            n += len;
+            elements += arr.substr(header_end + CRLF.size());
+        }
+    }
+    return "*" + std::to_string(n) + CRLF + elements;
+}
+
+std::vector<std::string_view> array_elements(const std::string_view reply)
+{
+    std::vector<std::string_view> elements;
+    size_t pos = reply.find(CRLF) + CRLF.size();
+    while (pos < reply.size())
+    {
+        size_t end = reply.find(CRLF, pos) + CRLF.size();
+        if (reply[pos] == Bulk_string)
+        {
+            long len = -1;
+            std::from_chars(reply.data() + pos + 1, reply.data() + end - CRLF.size(), len);
+            if (len >= 0)
+            {
+                end += len + CRLF.size();
+            }
+        }
+        elements.push_back(reply.substr(pos, end - pos));
+        pos = end;
     }
+    return elements;
+}
+
+Resp_writer::Resp_writer(std::string& out) : out(out)
+{
+}
+
+void Resp_writer::header(const char type, const long long int n)
+{
+    char buf[24];
+    buf[0] = type;
+    char* end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, n).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buf, end);
+}
+
+void Resp_writer::simple_string(const std::string_view content)
+{
+    out += '+';
+    out += content;
+    out += CRLF;
+}
+
+void Resp_writer::error(const std::string_view error)
+{
+    out += '-';
+    out += error;
+    out += CRLF;
+}
+
+void Resp_writer::integer(const long long int val)
+{
+    header(':', val);
+}
+
+void Resp_writer::bulk_string(const std::string_view content)
+{
+    header('$', static_cast<long long int>(content.size()));
+    out += content;
+    out += CRLF;
 }
 
-RESP_data::RESP_data(): type(Null)
+void Resp_writer::array_header(const size_t n)
 {
+    header('*', static_cast<long long int>(n));
 }
 
-RESP_data::RESP_data(const RESP_data& data): type(data.type)
+void Resp_writer::raw(const std::string_view reply)
 {
-    copy_data(data, *this);
+    out += reply;
 }
 
-RESP_data::RESP_data(RESP_data&& data) noexcept : type(std::exchange(data.type, Null))
+Owned_request::Owned_request(const Request request)
 {
-    switch (type)
+    size_t size = 0;
+    for (const std::string_view arg : request)
+    {
+        size += arg.size();
+    }
+    arena = std::make_unique_for_overwrite<char[]>(size);
+    args.reserve(request.size());
+    char* pos = arena.get();
+    for (const std::string_view arg : request)
     {
-    case Null:
-    case Integer:
-        integer = std::exchange(data.integer, 0);
-        break;
-    case Double:
-        real = std::exchange(data.real, 0.0);
-        break;
-    case Boolean:
-        boolean = std::exchange(data.boolean, false);
-        break;
-    case Simple_string:
-    case Simple_error:
-    case Bulk_string:
-    case Bulk_error:
-    case Big_number:
-    case Verbatim_string:
-        new (&string) std::string;  // kinda defeats the point of a move constructor, but it is required
-        string = std::move(data.string);
-        break;
-    case Array:
-    case Map:
-    case Attribute:
-    case Set:
-    case Push:
-        new (&array) std::vector<RESP_data>;
-        array = std::move(data.array);
-        break;
+        std::ranges::copy(arg, pos);
+        args.emplace_back(pos, arg.size());
+        pos += arg.size();
     }
 }
 
-RESP_data::~RESP_data()
+Request Owned_request::request() const
+{
+    return args;
+}
+
+// redis' limits for proto-max-bulk-len and the multibulk length
+constexpr long max_bulk_len = 512 * 1024 * 1024;
+constexpr long max_multibulk_len = 1024 * 1024;
+// longest inline command or length header we wait for before giving up on the client
+constexpr size_t max_inline_len = 64 * 1024;
+
+const char* find_crlf(const char* begin, const char* end)
 {
-    switch (type)
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    // compares every byte with '\r' and the byte after it with '\n'
+    while (end - begin > 16)
     {
-    case Simple_string:
-    case Simple_error:
-    case Bulk_string:
-    case Bulk_error:
-    case Big_number:
-    case Verbatim_string:
-        string.~basic_string();
-        break;
-    case Array:
-    case Map:
-    case Attribute:
-    case Set:
-    case Push:
-        array.~vector();
-        break;
-    default:
-        break;
+        const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + 1));
+        if (const int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, cr), _mm_cmpeq_epi8(second, lf))))
+        {
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 16;
+    }
+#endif
+    for (; end - begin > 1; begin++)
+    {
+        if (begin[0] == '\r' && begin[1] == '\n')
+        {
+            return begin;
+        }
     }
+    return nullptr;
 }
 
-RESP_data& RESP_data::operator=(const RESP_data& other)
+bool parse_length(const std::string_view str, long& val)
 {
-    if (this == &other)
+    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+    return ec == std::errc() && end == str.data() + str.size();
+}
+
+Request_parser::Status Request_parser::parse(const std::string_view input, std::vector<std::string_view>& args,
+                                             size_t& consumed)
+{
+    while (true)
     {
-        return *this;
+        switch (state)
+        {
+        case Start:
+            if (pos >= input.size())
+            {
+                return Incomplete;
+            }
+            spans.clear();
+            if (input[pos] == Array)
+            {
+                pos++;
+                state = Array_len;
+            }
+            else
+            {
+                state = Inline;
+            }
+            break;
+        case Array_len:
+        case Bulk_len:
+            {
+                const char* crlf = find_crlf(input.data() + pos, input.data() + input.size());
+                if (crlf == nullptr)
+                {
+                    if (input.size() - pos > max_inline_len)
+                    {
+                        return fail("too big length header");
+                    }
+                    return Incomplete;
+                }
+                const std::string_view header(input.data() + pos, crlf - input.data() - pos);
+                pos += header.size() + CRLF.size();
+                if (state == Array_len)
+                {
+                    if (!parse_length(header, remaining) || remaining > max_multibulk_len)
+                    {
+                        return fail("invalid multibulk length");
+                    }
+                    if (remaining <= 0)
+                    {
+                        return finish(input, args, consumed);
+                    }
+                    state = Bulk_len;
+                    break;
+                }
+                if (header.empty() || header[0] != Bulk_string)
+                {
+                    return fail("expected '$', got '" + std::string(header.substr(0, 1)) + "'");
+                }
+                if (!parse_length(header.substr(1), bulk_len) || bulk_len < 0 || bulk_len > max_bulk_len)
+                {
+                    return fail("invalid bulk length");
+                }
+                state = Bulk_data;
+                break;
+            }
+        case Bulk_data:
+            if (input.size() - pos < static_cast<size_t>(bulk_len) + CRLF.size())
+            {
+                return Incomplete;
+            }
+            if (input.substr(pos + bulk_len, CRLF.size()) != CRLF)
+            {
+                return fail("invalid bulk string terminator");
+            }
+            spans.emplace_back(pos, bulk_len);
+            pos += bulk_len + CRLF.size();
+            if (--remaining == 0)
+            {
+                return finish(input, args, consumed);
+            }
+            state = Bulk_len;
+            break;
+        case Inline:
+            {
+                const size_t end = input.find('\n', pos);
+                if (end == std::string_view::npos)
+                {
+                    if (input.size() - pos > max_inline_len)
+                    {
+                        return fail("too big inline request");
+                    }
+                    return Incomplete;
+                }
+                const size_t line_end = end > pos && input[end - 1] == '\r' ? end - 1 : end;
+                size_t i = pos;
+                while (i < line_end)
+                {
+                    if (input[i] == ' ' || input[i] == '\t')
+                    {
+                        i++;
+                        continue;
+                    }
+                    const size_t start = i;
+                    while (i < line_end && input[i] != ' ' && input[i] != '\t')
+                    {
+                        i++;
+                    }
+                    spans.emplace_back(start, i - start);
+                }
+                pos = end + 1;
+                return finish(input, args, consumed);
+            }
+        }
     }
-    type = other.type;
-    copy_data(other, *this);
-    return *this;
 }
 
-RESP_data parse(std::stringstream& input)
+const std::string& Request_parser::error() const
 {
-    auto next_line = [&input]
-    {
-        input.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    };
+    return error_msg;
+}
 
-    RESP_data data;
-    data.type = static_cast<RESP_type>(input.get());
+Request_parser::Status Request_parser::fail(const std::string& msg)
+{
+    error_msg = msg;
+    return Protocol_error;
+}
 
-    size_t n;
-    switch (data.type)
+Request_parser::Status Request_parser::finish(const std::string_view input, std::vector<std::string_view>& args,
+                                              size_t& consumed)
+{
+    args.clear();
+    for (const auto& [start, len] : spans)
     {
-    case Array:
-        input >> n;
-        new (&data.array) std::vector<RESP_data>;
-        data.array.reserve(n);
-
-        next_line();
-        for (size_t i = 0; i < n; i++)
-        {
-            data.array.push_back(std::move(parse(input)));
-        }
-        break;
-    case Bulk_string:
-        input >> n;
-        new (&data.string) std::string;
-        data.string.reserve(n);
-
-        next_line();
-        std::getline(input, data.string, '\r');
-        next_line();
-        break;
-    default:
-        break;
+        args.push_back(input.substr(start, len));
     }
-    return data;
+    consumed = pos;
+    state = Start;
+    pos = 0;
+    return Complete;
 }
 
 std::string command(const std::vector<std::string>& args)
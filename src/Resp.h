@@ -1,9 +1,11 @@
 #ifndef RESP_H
 #define RESP_H
 
+#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <sstream>
 
 constexpr std::string CRLF = "\r\n";
 constexpr std::string OK_simple = "+OK\r\n";
@@ -12,6 +14,8 @@ constexpr std::string empty_bulk_string = "$0\r\n\r\n";
 constexpr std::string null_array = "*-1\r\n";
 constexpr std::string empty_array = "*0\r\n";
 constexpr std::string null = "_\r\n";
+// too long for a constexpr std::string
+constexpr std::string_view wrong_type = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
 
 std::string simple_string(const std::string& content);
 std::string simple_error(const std::string& error);
@@ -19,6 +23,31 @@ std::string integer(long long int val);
 std::string bulk_string(const std::string& content);
 std::string array(const std::vector<std::string>& elements);
 std::string boolean(bool val);
+// joins array replies into one array; a reply that isn't an array is returned as is
+std::string concat_arrays(const std::vector<std::string>& arrays);
+// the encoded elements of an array reply, which mustn't hold arrays itself
+std::vector<std::string_view> array_elements(std::string_view reply);
+
+// encodes replies straight into an output buffer; arrays are written as their header followed by
+// each element, so no reply needs temporary strings
+class Resp_writer
+{
+public:
+    explicit Resp_writer(std::string& out);
+
+    void simple_string(std::string_view content);
+    void error(std::string_view error);
+    void integer(long long int val);
+    void bulk_string(std::string_view content);
+    void array_header(size_t n);
+    // appends a reply that is already encoded
+    void raw(std::string_view reply);
+
+private:
+    std::string& out;
+
+    void header(char type, long long int n);
+};
 
 enum RESP_type
 {
@@ -39,28 +68,65 @@ enum RESP_type
     Push = '>'
 };
 
-struct RESP_data
+// a client request; the arguments point into memory the connection keeps in place until the
+// command has run (the read buffer it was parsed from, or an Owned_request)
+typedef std::span<const std::string_view> Request;
+
+// a copy of a request that has to outlive the read buffer, e.g. one queued by MULTI; all arguments
+// share one allocation
+class Owned_request
 {
-    RESP_type type;
-    union
+public:
+    explicit Owned_request(Request request);
+
+    Request request() const;
+
+private:
+    std::unique_ptr<char[]> arena;
+    std::vector<std::string_view> args;
+};
+
+// resumable parser for client requests, either RESP arrays of bulk strings or inline commands;
+// a request split over several reads is picked up where the previous call stopped
+class Request_parser
+{
+public:
+    enum Status
     {
-        long long int integer{};
-        double real;
-        bool boolean;
-        std::string string;
-        std::vector<RESP_data> array;
+        Complete,
+        Incomplete,
+        Protocol_error
     };
 
-    RESP_data();
-    RESP_data(const RESP_data& data);
-    RESP_data(RESP_data&& data) noexcept;
+    // parses the request at the front of input; when it is complete, args point into input and
+    // consumed is the request's length; when it is incomplete, the next call has to pass the same
+    // bytes again with more data appended (the buffer may have moved in between)
+    Status parse(std::string_view input, std::vector<std::string_view>& args, size_t& consumed);
+    const std::string& error() const;
+
+private:
+    enum State
+    {
+        Start,
+        Array_len,
+        Bulk_len,
+        Bulk_data,
+        Inline
+    };
 
-    ~RESP_data();
+    State state = Start;
+    size_t pos = 0;
+    long remaining = 0;
+    long bulk_len = 0;
+    // offsets into the request, so they survive the buffer moving between calls
+    std::vector<std::pair<size_t, size_t>> spans;
+    std::string error_msg;
 
-    RESP_data& operator=(const RESP_data& other);
+    Status fail(const std::string& msg);
+    Status finish(std::string_view input, std::vector<std::string_view>& args, size_t& consumed);
 };
 
-RESP_data parse(std::stringstream& input);
+const char* find_crlf(const char* begin, const char* end);
 std::string command(const std::vector<std::string>& args);
 
 #endif //RESP_H
@@ -1,179 +1,589 @@
-#include <cmath>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <cstring>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netdb.h>
 #include <thread>
 #include <vector>
+#include <asio.hpp>
 
 #include "Command.h"
+#include "Connection.h"
 #include "Resp.h"
 #include "Args.h"
+#include "Aof.h"
 #include "Channels.h"
+#include "Clock.h"
 #include "Database.h"
+#include "Memory.h"
+#include "Persistence.h"
 #include "Replication.h"
 
-constexpr int buffer_size = 4096;
+using asio::ip::tcp;
+using asio::awaitable;
+using asio::use_awaitable;
+
+// smallest free space handed to a read; the input buffer grows past it for big requests
+constexpr size_t buffer_size = 4096;
+// an input buffer grown past this is shrunk back once it is drained
+constexpr size_t max_idle_buffer = 64 * 1024;
+// queued replies past this are flushed before more input is processed
+constexpr size_t max_pending_output = 64 * 1024;
+// how often replica feeds, subscriptions and blocked commands check for new data
+constexpr auto poll_interval = std::chrono::milliseconds(1);
+// how often every reactor frees the expired keys of its shards, and the slice of that it may spend
+constexpr auto expire_interval = std::chrono::milliseconds(10);
+constexpr auto expire_budget = std::chrono::microseconds(2500);
+
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+// single threaded reactors, each owning a share of the keyspace's shards; a connection lives on the
+// reactor that accepted it and hands commands for keys of other shards over to their owners
+std::vector<std::unique_ptr<asio::io_context>> reactors;
+thread_local size_t reactor_index = 0;
 
-class Rel
+// whether a command can run on the calling reactor as it is
+bool runs_here(const Route& route)
 {
+  return route.type == Anywhere || (route.type == Single_shard && shard_owner(route.shard) == reactor_index);
+}
+
+// runs f on the calling reactor while every other one waits inside a handler posted to it, so between
+// two commands and holding no shard lock
+void pause_reactors(const std::function<void()>& f)
+{
+  struct Pause
+  {
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t waiting = 0;
+    bool done = false;
+  };
+  const auto pause = std::make_shared<Pause>();
+  for (size_t i = 0; i < reactors.size(); i++)
+  {
+    if (i == reactor_index)
+    {
+      continue;
+    }
+    asio::post(*reactors[i], [pause]
+    {
+      std::unique_lock lock(pause->lock);
+      pause->waiting++;
+      pause->changed.notify_all();
+      pause->changed.wait(lock, [&] { return pause->done; });
+    });
+  }
+  {
+    std::unique_lock lock(pause->lock);
+    pause->changed.wait(lock, [&] { return pause->waiting == reactors.size() - 1; });
+  }
+  f();
+  {
+    const std::lock_guard lock(pause->lock);
+    pause->done = true;
+  }
+  pause->changed.notify_all();
+}
+
+// a command's shard is locked around each call into the command, never while it is suspended
+template <typename F>
+auto with_shard(const Route& route, F&& f)
+{
+  if (route.type != Single_shard)
+  {
+    return f();
+  }
+  const Shard_guard guard(route.shard);
+  return f();
+}
+
+// a write goes out from the reactor that ran it, before anything else can run on its shard, so the
+// replicas and the AOF get the writes to a key in the order they were made. Without a frame, the command
+// is encoded again (the frame it was read in may hold other commands' keys, split or queued). With
+// appendfsync always, where the write ends in the AOF, which its reply waits for; 0 otherwise
+size_t propagate_write(const Request cmd, const std::string_view frame = {})
+{
+  // PUBLISH goes to replicas, not the AOF
+  const size_t end = propagate(cmd, frame, !(find_command(cmd[0])->flags & Cmd_pubsub));
+  return aof_fsync_always() ? end : 0;
+}
+
+class Rel : public std::enable_shared_from_this<Rel>
+{
+  std::unique_ptr<Connection> connection;
+  asio::any_io_executor executor;
   std::string response;
-  std::stringstream in_stream{};
-  char in_buffer[buffer_size]{};
+  std::vector<char> in_buffer = std::vector<char>(buffer_size);
+  size_t in_start = 0;
+  size_t in_end = 0;
+  Request_parser parser;
+  std::vector<std::string_view> args;
 
-  int client_fd;
   Rel_data data;
+  std::string out_buffer;
+  std::string out_chunk;
+  asio::steady_timer drained;
+  // with appendfsync always, the end in the AOF of the last write whose reply waits for its fsync
+  size_t unsynced = 0;
+  asio::steady_timer synced;
+  bool writing = false;
+  bool closed = false;
+  bool feeding_subscriber = false;
 
-  void process_input()
+  // replies are queued and written by a single writer coroutine. It only starts once the reactor gets
+  // back to it, so every reply produced by one read batch goes out in one write; a command that
+  // suspends (blocking, another shard) lets the replies queued before it go out first
+  void send(const std::string_view msg)
   {
-    size_t prevg = 0;
-    while (in_stream.peek() != EOF)
-    {
-      RESP_data cmd = parse(in_stream);
+    out_buffer += msg;
+    flush();
+  }
 
-      response = process_command(cmd, data);
-      const size_t currg = in_stream.tellg();
+  // starts the writer for replies encoded straight into out_buffer
+  void flush()
+  {
+    if (out_buffer.empty() || writing || closed || unsynced)
+    {
+      return;
+    }
+    writing = true;
+    asio::post(executor, [self = shared_from_this()]
+    {
+      asio::co_spawn(self->executor, self->write_pending(), asio::detached);
+    });
+  }
 
-      if (data.is_replica)
+  awaitable<void> write_pending()
+  {
+    try
+    {
+      // replies queued behind one that waits for the AOF wait with it, wait_for_aof flushes them
+      while (!out_buffer.empty() && !unsynced)
       {
-        master_repl_offset() += currg - prevg;
+        // the two buffers swap so neither gives up its capacity
+        std::swap(out_chunk, out_buffer);
+        co_await connection->write(asio::buffer(out_chunk));
+        out_chunk.clear();
       }
+    }
+    catch (const std::exception&)
+    {
+      closed = true;
+      out_buffer.clear();
+      connection->close();
+    }
+    if (out_chunk.capacity() > max_idle_buffer)
+    {
+      out_chunk = std::string();
+    }
+    writing = false;
+    drained.cancel();
+  }
 
-      if (data.repeat)
+  // replies held back for the AOF go out once the writes before them are on disk; the writes of every
+  // connection that ran during the same loop iteration share one fsync
+  awaitable<void> wait_for_aof()
+  {
+    while (unsynced && !aof_synced(unsynced))
+    {
+      when_aof_synced(unsynced, [self = shared_from_this()]
       {
-        data.repeat = false;
-        add_command(in_stream.str().substr(prevg, currg - prevg));
-        send_getack() = true;
-      }
-      prevg = currg;
-      if (data.is_replica && !data.respond)
+        asio::post(self->executor, [self] { self->synced.cancel(); });
+      });
+      asio::error_code ec;
+      co_await synced.async_wait(asio::redirect_error(use_awaitable, ec));
+    }
+    unsynced = 0;
+    flush();
+  }
+
+  // waits until everything queued has been written
+  awaitable<void> drain()
+  {
+    while (writing)
+    {
+      asio::error_code ec;
+      co_await drained.async_wait(asio::redirect_error(use_awaitable, ec));
+    }
+  }
+
+  // queues a reply, holding the caller back while the client is slow to read
+  awaitable<void> write(const std::string_view msg)
+  {
+    send(msg);
+    if (out_buffer.size() >= max_pending_output)
+    {
+      co_await drain();
+    }
+  }
+
+  awaitable<void> unblock(const Route& route, Resp_writer& out)
+  {
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    while (true)
+    {
+      update_clock();
+      const bool timed_out = steady_now() >= data.blocked->deadline;
+      if (with_shard(route, [&] { return data.blocked->poll(timed_out, out); }))
       {
-        continue;
+        data.blocked.reset();
+        co_return;
       }
-      data.respond = false;
-      send(client_fd, response.c_str(), response.length(), 0);
-      if (data.send_rdb)
+      timer.expires_after(poll_interval);
+      co_await timer.async_wait(use_awaitable);
+    }
+  }
+
+  // back on the connection's reactor once a command is done with; with appendfsync always, its reply waits
+  // for the fsync of the write that ended at aof_end
+  void hold_reply(const size_t aof_end)
+  {
+    data.repeat = false;
+    unsynced = std::max(unsynced, aof_end);
+  }
+
+  // the reply is appended to out, which only the reactor running the command may touch; what the reply
+  // waits for in the AOF is handed back to the connection's reactor
+  awaitable<size_t> run_command(const Route route, const Request cmd, const bool in_transaction, std::string& out)
+  {
+    // this may be another reactor, whose clock could be as old as its last piece of work
+    update_clock();
+    Resp_writer writer(out);
+    with_shard(route, [&]
+    {
+      process_command(cmd, data, writer);
+      if (data.blocked && in_transaction)
       {
-        data.send_rdb = false;
-        std::vector<unsigned char> data = make_rdb();
-        send(client_fd, data.data(), data.size(), 0);
-        std::cout << "Sent database to replica\n";
+        // blocking commands don't block inside a transaction
+        if (!data.blocked->poll(false, writer))
+        {
+          data.blocked->poll(true, writer);
+        }
+        data.blocked.reset();
       }
+    });
+    if (data.blocked)
+    {
+      co_await unblock(route, writer);
     }
+    co_return data.repeat ? propagate_write(cmd) : 0;
   }
 
-  public:
-  explicit Rel(const int fd, const bool is_replica = false, const std::string& remainder = "") : in_stream(remainder), client_fd(fd)
+  awaitable<void> run_on_shard(const size_t shard, const Request cmd, const bool in_transaction, std::string& out)
   {
-    data.is_replica = is_replica;
+    const Route route{Single_shard, shard};
+    const size_t owner = shard_owner(shard);
+    if (owner == reactor_index)
+    {
+      hold_reply(co_await run_command(route, cmd, in_transaction, out));
+      co_return;
+    }
+    // another reactor can't write to this connection's buffer, its reply is copied over once it is done
+    std::string reply;
+    const size_t aof_end = co_await asio::co_spawn(reactors[owner]->get_executor(),
+                                                   run_command(route, cmd, in_transaction, reply), use_awaitable);
+    out += reply;
+    hold_reply(aof_end);
   }
 
-  void operator()()
+  awaitable<void> execute(const Request cmd, std::string& out, const bool in_transaction = false)
   {
-    if (!in_stream.str().empty())
+    const Route route = route_command(cmd, data);
+    switch (route.type)
     {
-      process_input();
+    case Single_shard:
+      co_await run_on_shard(route.shard, cmd, in_transaction, out);
+      co_return;
+    case All_shards:
+      {
+        std::vector<std::string> replies(shard_count());
+        for (size_t i = 0; i < replies.size(); i++)
+        {
+          co_await run_on_shard(i, cmd, in_transaction, replies[i]);
+        }
+        out += concat_arrays(replies);
+        co_return;
+      }
+    case Each_queued:
+      {
+        data.queue_commands = false;
+        Resp_writer(out).array_header(data.transaction_queue.size());
+        while (!data.transaction_queue.empty())
+        {
+          const Owned_request queued = std::move(data.transaction_queue.front());
+          data.transaction_queue.pop();
+          co_await execute(queued.request(), out, true);
+        }
+        co_return;
+      }
+    case Split_keys:
+      {
+        const Key_split split = split_keys(cmd);
+        std::vector<std::string> replies(split.requests.size());
+        for (size_t i = 0; i < replies.size(); i++)
+        {
+          co_await run_on_shard(split.shards[i], split.requests[i], in_transaction, replies[i]);
+        }
+        out += merge_replies(cmd, split, replies);
+        co_return;
+      }
+    case Cross_shard:
+      data.repeat = false;
+      Resp_writer(out).error("CROSSSLOT Keys in request don't hash to the same slot");
+      co_return;
+    case Anywhere:
+      break;
     }
-    while (true)
+    hold_reply(co_await run_command(route, cmd, in_transaction, out));
+  }
+
+  // makes room for at least buffer_size more bytes after the unparsed input
+  void reserve_input()
+  {
+    if (in_start == in_end)
+    {
+      in_start = in_end = 0;
+      if (in_buffer.size() > max_idle_buffer)
+      {
+        in_buffer = std::vector<char>(buffer_size);
+      }
+    }
+    if (in_buffer.size() - in_end >= buffer_size)
+    {
+      return;
+    }
+    if (in_start > 0)
+    {
+      std::memmove(in_buffer.data(), in_buffer.data() + in_start, in_end - in_start);
+      in_end -= in_start;
+      in_start = 0;
+    }
+    if (in_buffer.size() - in_end < buffer_size)
     {
-      if (data.client_is_replica)
+      in_buffer.resize(std::max(in_buffer.size() * 2, in_end + buffer_size));
+    }
+  }
+
+  awaitable<void> process_input()
+  {
+    // everything that came in with this read runs at the same time
+    update_clock();
+    while (in_start < in_end)
+    {
+      // args point into in_buffer, which isn't touched until the next read, so a request is handed to
+      // the commands without copying its arguments
+      const std::string_view input(in_buffer.data() + in_start, in_end - in_start);
+      size_t consumed;
+      const Request_parser::Status status = parser.parse(input, args, consumed);
+      if (status == Request_parser::Incomplete)
+      {
+        break;
+      }
+      if (status == Request_parser::Protocol_error)
       {
-        if (top_offset() != data.local_offset)
+        send(simple_error("ERR Protocol error: " + parser.error()));
+        closed = true;
+        break;
+      }
+      in_start += consumed;
+      if (args.empty())
+      {
+        continue;
+      }
+      const Request cmd = args;
+      const std::string_view frame = input.substr(0, consumed);
+
+      // replicas only ever send acks, which don't get a reply, and a master only gets the replies it
+      // asks for; everyone else's replies are encoded straight into the output buffer
+      const bool replica_link = data.client_is_replica;
+      response.clear();
+      std::string& out = replica_link || data.is_replica ? response : out_buffer;
+      if (const Route route = route_command(cmd, data); runs_here(route))
+      {
+        // the common case, run without setting up coroutine frames
+        Resp_writer writer(out);
+        with_shard(route, [&] { process_command(cmd, data, writer); });
+        if (data.blocked)
         {
-          std::this_thread::yield();
-          continue;
+          // the replies before a command that blocks go out once they're on disk, not once it's unblocked
+          co_await wait_for_aof();
+          co_await unblock(route, writer);
         }
-        if (command_queue().empty())
+      }
+      else
+      {
+        // one for another reactor blocks there, so they go out first in case it does
+        if (route.type == Single_shard && find_command(cmd[0])->flags & Cmd_blocking)
         {
-          std::this_thread::yield();
-          continue;
+          co_await wait_for_aof();
         }
-        response = command_queue().front().cmd;
-        long n = send(client_fd, response.c_str(), response.length(), MSG_NOSIGNAL);
-        if (n == -1)
+        co_await execute(cmd, out);
+      }
+      flush();
+
+      if (data.is_replica)
+      {
+        master_repl_offset() += frame.size();
+      }
+
+      if (data.repeat)
+      {
+        hold_reply(propagate_write(cmd, frame));
+      }
+      if (replica_link || (data.is_replica && !data.respond))
+      {
+        continue;
+      }
+      data.respond = false;
+      if (data.is_replica)
+      {
+        send(response);
+      }
+      if (out_buffer.size() >= max_pending_output)
+      {
+        co_await drain();
+      }
+      if (data.send_rdb)
+      {
+        data.send_rdb = false;
+        // the FULLRESYNC reply goes out first; from then on the socket is the snapshot child's until it's done
+        co_await wait_for_aof();
+        co_await drain();
+        const auto sync = request_full_sync(connection->native_handle(), data.replica_eof);
+        asio::steady_timer timer(executor);
+        while (sync->state == Sync_pending)
         {
-          slave_disconnected();
-          remove_command();
-          break;
+          timer.expires_after(poll_interval);
+          co_await timer.async_wait(use_awaitable);
         }
-        if (command_queue().front().expect_response)
+        if (sync->state == Sync_failed)
         {
-          // not the best solution as high timeout values will block everything for a while
-          const unsigned int ms = command_queue().front().timeout;
-          timeval tv{ms / 1000, ms % 1000 * 1000};
-          if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO_NEW, &tv, sizeof(tv)) < 0) {
-            const int err = errno;
-            std::cerr << "Setsockopt failed:\n" << strerror(err) << "\n";
-          }
-          else
+          if (sync->registered)
           {
-            n = recv(client_fd, in_buffer, buffer_size, 0);
-            if (n > 0)
-            {
-              in_stream.str({in_buffer, static_cast<size_t>(n)});
-              in_stream.clear();
-              RESP_data cmd = parse(in_stream);
-              process_command(cmd, data);
-            }
+            slave_disconnected(sync->offset);
+            remove_command();
           }
+          closed = true;
+          connection->close();
+          break;
+        }
+        data.local_offset = sync->offset;
+        asio::co_spawn(executor, [self = shared_from_this()] { return self->feed_replica(); }, asio::detached);
+      }
+    }
+    co_await wait_for_aof();
+  }
+
+  awaitable<void> feed_replica()
+  {
+    asio::steady_timer timer(executor);
+    try
+    {
+      while (!closed)
+      {
+        if (top_offset() != data.local_offset || command_queue().empty())
+        {
+          timer.expires_after(poll_interval);
+          co_await timer.async_wait(use_awaitable);
+          continue;
         }
+        // acks to GETACK are picked up by the read loop
+        co_await write(command_queue().front().cmd);
         command_queue().front().remaining--;
         data.local_offset++;
         remove_command();
-        continue;
       }
-      if (data.subscribed)
+    }
+    catch (const std::exception&)
+    {
+    }
+    slave_disconnected(data.local_offset);
+    remove_command();
+  }
+
+  awaitable<void> feed_subscriber()
+  {
+    asio::steady_timer timer(executor);
+    std::string messages;
+    Resp_writer writer(messages);
+    try
+    {
+      while (!closed)
       {
-        bool sleep = true;
+        messages.clear();
         for (auto& channel : data.subscribed_channels)
         {
           if (std::string msg = get_message(channel); !msg.empty())
           {
-            response = array({message_bulk, channel, msg});
-            send(client_fd, response.c_str(), response.length(), 0);
-            sleep = false;
+            writer.array_header(3);
+            writer.raw(message_bulk);
+            writer.raw(channel);
+            writer.raw(msg);
           }
         }
-        if (sleep)
+        if (!messages.empty())
         {
-          std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-      }
-      if (data.set_nonblocking)
-      {
-        // a bit of a hacky solution
-        timeval tv{0, 1000};
-        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO_NEW, &tv, sizeof(tv)) < 0) {
-          const int err = errno;
-          std::cerr << "Setsockopt failed:\n" << strerror(err) << "\n";
+          co_await write(messages);
+          continue;
         }
-        data.set_nonblocking = false;
+        timer.expires_after(poll_interval);
+        co_await timer.async_wait(use_awaitable);
       }
+    }
+    catch (const std::exception&)
+    {
+    }
+  }
+
+  public:
+  Rel(std::unique_ptr<Connection> connection, asio::any_io_executor executor, const bool is_replica = false,
+      const std::string& remainder = "")
+    : connection(std::move(connection)), executor(std::move(executor)), drained(this->executor),
+      synced(this->executor)
+  {
+    drained.expires_at(asio::steady_timer::time_point::max());
+    synced.expires_at(asio::steady_timer::time_point::max());
+    data.is_replica = is_replica;
+    in_buffer.resize(std::max(buffer_size, remainder.size()));
+    std::ranges::copy(remainder, in_buffer.begin());
+    in_end = remainder.size();
+  }
 
-      const long n = recv(client_fd, in_buffer, buffer_size, 0);
-      if (n == 0)
+  awaitable<void> operator()()
+  {
+    try
+    {
+      co_await process_input();
+      while (!closed)
       {
-        if (data.subscribed)
+        reserve_input();
+        in_end += co_await connection->read_some(asio::buffer(in_buffer.data() + in_end, in_buffer.size() - in_end));
+
+        co_await process_input();
+
+        if (data.subscribed && !feeding_subscriber)
         {
-          unsubscribe(data.subscribed_channels);
+          feeding_subscriber = true;
+          asio::co_spawn(executor, [self = shared_from_this()] { return self->feed_subscriber(); },
+                         asio::detached);
         }
-        break;
-      }
-      if (n < 0)
-      {
-        continue;
       }
-      in_stream.str({in_buffer, static_cast<size_t>(n)});
-      in_stream.clear();
-
-      process_input();
+    }
+    catch (const std::exception&)
+    {
     }
 
-    close(client_fd);
+    closed = true;
+    co_await drain();
+    if (data.subscribed)
+    {
+      unsubscribe(data.subscribed_channels);
+    }
+    connection->close();
     std::string str = "Client";
     if (data.client_is_replica)
     {
@@ -187,6 +597,77 @@ class Rel
   }
 };
 
+awaitable<void> expire_keys()
+{
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  // the shards owned by this reactor are reactor_index + k * reactors; a slice that runs out of time
+  // leaves the rest for the next one
+  const size_t owned = (shard_count() - reactor_index + reactors.size() - 1) / reactors.size();
+  size_t next = 0;
+  while (true)
+  {
+    timer.expires_after(expire_interval);
+    co_await timer.async_wait(use_awaitable);
+    update_clock();
+    const auto deadline = steady_now() + expire_budget;
+    for (size_t i = 0; i < owned; i++)
+    {
+      if (!expire_shard(reactor_index + next * reactors.size(), deadline))
+      {
+        break;
+      }
+      next = (next + 1) % owned;
+    }
+    // what the writes' eviction steps left over, in the time expiry didn't use
+    if (over_maxmemory())
+    {
+      evict_keys(reactor_index, deadline);
+    }
+    rehash_keys(reactor_index, deadline);
+    if (reactor_index == 0)
+    {
+      sample_expiry_stats();
+      persistence_cron();
+    }
+  }
+}
+
+void spawn_rel(tcp::socket socket, const bool is_replica = false, const std::string& remainder = "")
+{
+  const asio::any_io_executor executor = socket.get_executor();
+  const auto rel = std::make_shared<Rel>(make_connection(std::move(socket)), executor, is_replica, remainder);
+  asio::co_spawn(executor, [rel] { return (*rel)(); }, asio::detached);
+}
+
+awaitable<void> accept_clients(tcp::acceptor acceptor)
+{
+  while (true)
+  {
+    std::cout << "Waiting for a client to connect...\n";
+    tcp::socket client = co_await acceptor.async_accept(use_awaitable);
+    std::cout << "Client connected\n";
+    spawn_rel(std::move(client));
+  }
+}
+
+awaitable<void> connect_to_master()
+{
+  const asio::any_io_executor executor = co_await asio::this_coro::executor;
+  const std::string str = get_config("replicaof");
+  const std::string madd = str.substr(0, str.find(' '));
+  const std::string mp = str.substr(str.rfind(' ') + 1);
+
+  tcp::resolver resolver(executor);
+  tcp::socket master(executor);
+  co_await asio::async_connect(master, co_await resolver.async_resolve(madd, mp, use_awaitable), use_awaitable);
+
+  const std::string remainder = co_await send_handshake(master);
+  std::cout << "Sent handshake to master\n";
+  // the keyspace is the master's now, the AOF starts over from it
+  start_aof(true);
+  spawn_rel(std::move(master), true, remainder);
+}
+
 int main(const int argc, char **argv) {
   // Flush after every std::cout / std::cerr
   std::cout << std::unitbuf;
@@ -196,88 +677,109 @@ int main(const int argc, char **argv) {
   {
     std::cerr << "Failed to apply at least one argument\n";
   }
-  
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-   std::cerr << "Failed to create server socket\n";
-   return 1;
-  }
-  
-  // Since the tester restarts your program quite often, setting SO_REUSEADDR
-  // ensures that we don't run into 'Address already in use' errors
-  constexpr int reuse = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-    std::cerr << "setsockopt failed\n";
-    return 1;
-  }
-  
-  sockaddr_in server_addr{};
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(std::stoi(config_key_vals()["port"]));
-  
-  if (bind(server_fd, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) != 0) {
-    std::cerr << "Failed to bind to port " + config_key_vals()["port"] + "\n";
-    return 1;
-  }
-
-  if (constexpr int connection_backlog = 5; listen(server_fd, connection_backlog) != 0) {
-    std::cerr << "listen failed\n";
-    return 1;
-  }
 
-  std::vector<std::thread> rels;
+  const size_t n_threads = std::max(1, std::stoi(get_config("threads")));
+  init_keyspace(n_threads);
 
-  if (is_slave())
+  const tcp::endpoint endpoint(tcp::v4(), std::stoi(get_config("port")));
+  std::vector<tcp::acceptor> acceptors;
+  std::vector<asio::executor_work_guard<asio::io_context::executor_type>> work_guards;
+  for (size_t i = 0; i < n_threads; i++)
   {
-    const int master_fd = socket(AF_INET, SOCK_STREAM, 0);
-    const std::string str = config_key_vals()["replicaof"];
-    const std::string madd = str.substr(0, str.find(' '));
-    const std::string mp = str.substr(str.rfind(' ') + 1);
+    reactors.push_back(std::make_unique<asio::io_context>(1));
+    work_guards.push_back(asio::make_work_guard(*reactors[i]));
 
-    sockaddr_in master_addr{};
-    master_addr.sin_family = AF_INET;
-    inet_pton(AF_INET, madd.c_str(), &master_addr.sin_addr);
-    master_addr.sin_port = htons(std::stoi(mp));
+    // every reactor listens on its own socket and the kernel spreads the connections between them
+    tcp::acceptor& acceptor = acceptors.emplace_back(*reactors[i]);
+    asio::error_code ec;
 
-    if (connect(master_fd, reinterpret_cast<sockaddr*>(&master_addr), sizeof(master_addr)) != 0)
-    {
-      const int err = errno;
-      std::cerr << "Failed to connect to master:\n" << strerror(err) << "\n";
+    // Since the tester restarts your program quite often, setting SO_REUSEADDR
+    // ensures that we don't run into 'Address already in use' errors
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(reuse_port(true));
+
+    if (acceptor.bind(endpoint, ec); ec) {
+      std::cerr << "Failed to bind to port " + get_config("port") + "\n";
       return 1;
     }
-    const std::string remainder = send_handshake(master_fd);
-    std::cout << "Sent handshake to master\n";
-    rels.emplace_back(Rel(master_fd, true, remainder));
-  }
-  else
-  {
-    read_rdb();
-  }
 
+    if (acceptor.listen(asio::socket_base::max_listen_connections, ec); ec) {
+      std::cerr << "listen failed\n";
+      return 1;
+    }
+  }
 
-  std::thread rel_adder([server_fd, &rels]()
+  auto accept_all = [&acceptors]
   {
-    while (true)
+    for (auto& acceptor : acceptors)
     {
-      sockaddr_in client_addr{};
-      int client_addr_len = sizeof(client_addr);
-      std::cout << "Waiting for a client to connect...\n";
-
-      const int client_fd = accept(server_fd, reinterpret_cast<sockaddr*>(&client_addr), reinterpret_cast<socklen_t*>(&client_addr_len));
-      std::cout << "Client connected\n";
+      const asio::any_io_executor executor = acceptor.get_executor();
+      asio::co_spawn(executor, accept_clients(std::move(acceptor)), asio::detached);
+    }
+  };
 
-      rels.emplace_back(Rel(client_fd));
+  for (const auto& reactor : reactors)
+  {
+    asio::co_spawn(*reactor, expire_keys(), asio::detached);
+  }
+  set_pause_reactors(pause_reactors);
+  record_startup_memory();
 
-      // some ending condition
+  int status = 0;
+  if (is_slave())
+  {
+    // clients are only accepted once the master's snapshot is loaded into every shard
+    asio::co_spawn(*reactors[0], connect_to_master(), [&status, &accept_all](const std::exception_ptr& e)
+    {
+      if (!e)
+      {
+        accept_all();
+        return;
+      }
+      try
+      {
+        std::rethrow_exception(e);
+      }
+      catch (const std::exception& err)
+      {
+        std::cerr << "Failed to connect to master:\n" << err.what() << "\n";
+      }
+      status = 1;
+      for (const auto& reactor : reactors)
+      {
+        reactor->stop();
+      }
+    });
+  }
+  else
+  {
+    if (!load_aof())
+    {
+      read_rdb();
     }
-  });
+    start_aof();
+    accept_all();
+  }
 
-  rel_adder.join();
-  // also need a relation manager/ender
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; i++)
+  {
+    threads.emplace_back([i]
+    {
+      reactor_index = i;
+      init_io_backend(reactors[i]->get_executor());
+      reactors[i]->run();
+    });
+  }
+  init_io_backend(reactors[0]->get_executor());
+  reactors[0]->run();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
 
-  close(server_fd);
   std::cout << "Server terminated\n";
 
-  return 0;
+  return status;
 }
@@ -0,0 +1,382 @@
+#include "Uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <cstring>
+#include <vector>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+constexpr unsigned ring_entries = 4096;
+// the buffer ring size has to be a power of two
+constexpr unsigned n_buffers = 1024;
+constexpr unsigned buffer_len = 4096;
+constexpr int buffer_group = 0;
+
+class Uring
+{
+    io_uring ring{};
+    bool ring_ready = false;
+    io_uring_buf_ring* buf_ring = nullptr;
+    std::vector<char> buffers;
+    asio::posix::stream_descriptor event;
+    bool submit_scheduled = false;
+
+    asio::awaitable<void> reap();
+
+public:
+    asio::any_io_executor executor;
+    // cleared when the kernel rejects multishot recv, receives are then rearmed one at a time
+    bool multishot = true;
+
+    explicit Uring(const asio::any_io_executor& executor);
+    ~Uring();
+
+    int init();
+    io_uring_sqe* get_sqe();
+    const char* buffer(unsigned short bid) const;
+    void recycle(unsigned short bid);
+};
+
+thread_local std::unique_ptr<Uring> uring;
+
+Uring::Uring(const asio::any_io_executor& executor) : event(executor), executor(executor)
+{
+}
+
+Uring::~Uring()
+{
+    if (buf_ring != nullptr)
+    {
+        io_uring_free_buf_ring(&ring, buf_ring, n_buffers, buffer_group);
+    }
+    if (ring_ready)
+    {
+        io_uring_queue_exit(&ring);
+    }
+}
+
+int Uring::init()
+{
+    if (const int ret = io_uring_queue_init(ring_entries, &ring, 0); ret < 0)
+    {
+        return -ret;
+    }
+    ring_ready = true;
+
+    int ret;
+    buf_ring = io_uring_setup_buf_ring(&ring, n_buffers, buffer_group, 0, &ret);
+    if (buf_ring == nullptr)
+    {
+        return -ret;
+    }
+    buffers.resize(n_buffers * buffer_len);
+    for (unsigned short i = 0; i < n_buffers; i++)
+    {
+        io_uring_buf_ring_add(buf_ring, &buffers[i * buffer_len], buffer_len, i, io_uring_buf_ring_mask(n_buffers), i);
+    }
+    io_uring_buf_ring_advance(buf_ring, n_buffers);
+
+    const int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+    {
+        return errno;
+    }
+    event.assign(event_fd);
+    if (ret = io_uring_register_eventfd(&ring, event_fd); ret < 0)
+    {
+        return -ret;
+    }
+
+    asio::co_spawn(executor, reap(), asio::detached);
+    return 0;
+}
+
+io_uring_sqe* Uring::get_sqe()
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr)
+    {
+        // the submission queue is full, flush it early
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    if (!submit_scheduled)
+    {
+        submit_scheduled = true;
+        asio::post(executor, [this]
+        {
+            submit_scheduled = false;
+            io_uring_submit(&ring);
+        });
+    }
+    return sqe;
+}
+
+const char* Uring::buffer(const unsigned short bid) const
+{
+    return &buffers[bid * buffer_len];
+}
+
+void Uring::recycle(const unsigned short bid)
+{
+    io_uring_buf_ring_add(buf_ring, &buffers[bid * buffer_len], buffer_len, bid, io_uring_buf_ring_mask(n_buffers), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+asio::awaitable<void> Uring::reap()
+{
+    while (true)
+    {
+        co_await event.async_wait(asio::posix::descriptor_base::wait_read, asio::use_awaitable);
+        eventfd_t count;
+        eventfd_read(event.native_handle(), &count);
+
+        unsigned head;
+        unsigned n = 0;
+        io_uring_cqe* cqe;
+        io_uring_for_each_cqe(&ring, head, cqe)
+        {
+            static_cast<Uring_op*>(io_uring_cqe_get_data(cqe))->complete(*cqe);
+            n++;
+        }
+        io_uring_cq_advance(&ring, n);
+    }
+}
+
+int init_uring(const asio::any_io_executor& executor)
+{
+    auto instance = std::make_unique<Uring>(executor);
+    if (const int err = instance->init(); err != 0)
+    {
+        return err;
+    }
+    uring = std::move(instance);
+    return 0;
+}
+
+bool uring_active()
+{
+    return uring != nullptr;
+}
+
+// outlives the connection while the kernel still holds operations on it
+struct Uring_connection::Stream : std::enable_shared_from_this<Stream>
+{
+    struct Recv_op final : Uring_op
+    {
+        Stream& stream;
+        explicit Recv_op(Stream& stream) : stream(stream) {}
+        void complete(const io_uring_cqe& cqe) override { stream.received(cqe); }
+    };
+
+    struct Send_op final : Uring_op
+    {
+        Stream& stream;
+        explicit Send_op(Stream& stream) : stream(stream) {}
+        void complete(const io_uring_cqe& cqe) override { stream.sent(cqe); }
+    };
+
+    const int fd;
+    Recv_op recv_op{*this};
+    Send_op send_op{*this};
+    int in_flight = 0;
+    std::shared_ptr<Stream> keep_alive;
+
+    std::string in_data;
+    size_t in_pos = 0;
+    bool recv_armed = false;
+    bool eof = false;
+    int error = 0;
+    asio::steady_timer recv_wake;
+
+    bool send_pending = false;
+    int send_result = 0;
+    asio::steady_timer send_wake;
+
+    bool closed = false;
+
+    explicit Stream(const int fd) : fd(fd), recv_wake(uring->executor), send_wake(uring->executor)
+    {
+    }
+
+    void started()
+    {
+        if (in_flight++ == 0)
+        {
+            keep_alive = shared_from_this();
+        }
+    }
+
+    void finished()
+    {
+        if (--in_flight > 0)
+        {
+            return;
+        }
+        if (closed)
+        {
+            ::close(fd);
+        }
+        // may destroy the stream
+        const std::shared_ptr<Stream> self = std::move(keep_alive);
+    }
+
+    void arm_recv()
+    {
+        io_uring_sqe* sqe = uring->get_sqe();
+        if (uring->multishot)
+        {
+            io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+        }
+        else
+        {
+            io_uring_prep_recv(sqe, fd, nullptr, 0, 0);
+        }
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        io_uring_sqe_set_data(sqe, &recv_op);
+        recv_armed = true;
+        started();
+    }
+
+    void received(const io_uring_cqe& cqe)
+    {
+        if (cqe.res > 0)
+        {
+            const auto bid = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            in_data.append(uring->buffer(bid), cqe.res);
+            uring->recycle(bid);
+        }
+        else if (cqe.res == 0)
+        {
+            eof = true;
+        }
+        else if (cqe.res == -EINVAL && uring->multishot)
+        {
+            uring->multishot = false;
+        }
+        // out of buffers just ends the multishot, it is rearmed by the next read
+        else if (cqe.res != -ENOBUFS)
+        {
+            error = -cqe.res;
+        }
+        recv_wake.cancel();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            recv_armed = false;
+            finished();
+        }
+    }
+
+    void sent(const io_uring_cqe& cqe)
+    {
+        send_result = cqe.res;
+        send_pending = false;
+        send_wake.cancel();
+        finished();
+    }
+
+    static asio::awaitable<void> wait(asio::steady_timer& wake)
+    {
+        wake.expires_at(asio::steady_timer::time_point::max());
+        asio::error_code ec;
+        co_await wake.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+};
+
+Uring_connection::Uring_connection(const int fd) : stream(std::make_shared<Stream>(fd))
+{
+}
+
+Uring_connection::~Uring_connection()
+{
+    close();
+}
+
+asio::awaitable<size_t> Uring_connection::read_some(const asio::mutable_buffer buffer)
+{
+    Stream& s = *stream;
+    while (s.in_pos == s.in_data.size() && !s.eof && s.error == 0)
+    {
+        if (s.closed)
+        {
+            throw asio::system_error(asio::error::bad_descriptor);
+        }
+        if (!s.recv_armed)
+        {
+            s.arm_recv();
+        }
+        co_await Stream::wait(s.recv_wake);
+    }
+
+    if (s.in_pos < s.in_data.size())
+    {
+        const size_t n = std::min(buffer.size(), s.in_data.size() - s.in_pos);
+        std::memcpy(buffer.data(), s.in_data.data() + s.in_pos, n);
+        s.in_pos += n;
+        if (s.in_pos == s.in_data.size())
+        {
+            s.in_data.clear();
+            s.in_pos = 0;
+        }
+        co_return n;
+    }
+    if (s.error != 0)
+    {
+        throw asio::system_error(asio::error_code(s.error, asio::system_category()));
+    }
+    throw asio::system_error(asio::error::eof);
+}
+
+asio::awaitable<void> Uring_connection::write(const asio::const_buffer buffer)
+{
+    Stream& s = *stream;
+    auto data = static_cast<const char*>(buffer.data());
+    size_t left = buffer.size();
+    while (left > 0)
+    {
+        if (s.closed)
+        {
+            throw asio::system_error(asio::error::bad_descriptor);
+        }
+        io_uring_sqe* sqe = uring->get_sqe();
+        io_uring_prep_send(sqe, s.fd, data, left, MSG_NOSIGNAL);
+        io_uring_sqe_set_data(sqe, &s.send_op);
+        s.send_pending = true;
+        s.started();
+        while (s.send_pending)
+        {
+            co_await Stream::wait(s.send_wake);
+        }
+        if (s.send_result < 0)
+        {
+            throw asio::system_error(asio::error_code(-s.send_result, asio::system_category()));
+        }
+        data += s.send_result;
+        left -= s.send_result;
+    }
+}
+
+void Uring_connection::close()
+{
+    if (stream->closed)
+    {
+        return;
+    }
+    stream->closed = true;
+    // pending operations complete on their own once the socket is shut down
+    shutdown(stream->fd, SHUT_RDWR);
+    if (stream->in_flight == 0)
+    {
+        ::close(stream->fd);
+    }
+}
+
+int Uring_connection::native_handle()
+{
+    return stream->fd;
+}
+
+#endif //HAVE_IO_URING
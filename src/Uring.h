@@ -0,0 +1,40 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef HAVE_IO_URING
+
+#include <memory>
+#include <liburing.h>
+
+#include "Connection.h"
+
+// each reactor owns one ring; receives are multishot into a ring of provided buffers, and every sqe
+// queued during one pass of the event loop goes out with a single io_uring_submit
+struct Uring_op
+{
+    virtual ~Uring_op() = default;
+    virtual void complete(const io_uring_cqe& cqe) = 0;
+};
+
+// returns 0 or the errno that made setting up the ring fail
+int init_uring(const asio::any_io_executor& executor);
+bool uring_active();
+
+class Uring_connection final : public Connection
+{
+    struct Stream;
+    std::shared_ptr<Stream> stream;
+
+public:
+    explicit Uring_connection(int fd);
+    ~Uring_connection() override;
+
+    asio::awaitable<size_t> read_some(asio::mutable_buffer buffer) override;
+    asio::awaitable<void> write(asio::const_buffer buffer) override;
+    void close() override;
+    int native_handle() override;
+};
+
+#endif //HAVE_IO_URING
+
+#endif //URING_H